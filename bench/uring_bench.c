@@ -0,0 +1,225 @@
+/**
+ * @file 		uring_bench.c
+ *
+ * @brief 		Benchmark of the synchronous and io_uring block enumeration paths
+ *
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date        Jul 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *
+ * A synthetic memory directory with one memoryN/ directory per block is
+ * built under a temporary directory. The library source is included so the
+ * context can be pointed at that tree and the attribute load step of block
+ * enumeration can be timed on its own, once with synchronous reads and once
+ * with batched io_uring reads.
+ *
+ * Usage: uring-bench [<blocks> [<iterations> [<threads>]]]
+ */
+
+/* INCLUDES ==================================================================*/
+
+/* The library is built into the benchmark to reach its static functions
+ */
+#include "../src/libmem.c"
+
+/* mkdir()
+ */
+#include <sys/stat.h>
+
+/* MACROS ====================================================================*/
+
+#define BNLN_BLOCKS 			4096
+#define BNLN_ITERATIONS 		10
+#define BNLN_THREADS 			1
+
+/* PROTOTYPES ================================================================*/
+
+static int bench_tree_create(char *dir, int num);
+static void bench_tree_remove(char *dir, int num);
+static unsigned long long bench_run(struct mem_ctx *ctx, int io_uring, int iterations, int *missing);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Create memory0/ to memory<num-1>/ with the attributes read during enumeration
+ * @return 0 upon success, negative errno otherwise
+ */
+static int bench_tree_create(char *dir, int num)
+{
+	int i, j, fd;
+	char path[LMLN_FILEPATH];
+	const char *vals[LMBA_MAX] = { "1\n", "0\n", "1\n", "online\n", "Movable\n" };
+
+	for ( i = 0 ; i < num ; i++ )
+	{
+		sprintf(path, "%s/memory%d", dir, i);
+		if (mkdir(path, 0755) != 0)
+			return -errno;
+
+		for ( j = 0 ; j < LMBA_MAX ; j++ )
+		{
+			sprintf(path, "%s/memory%d/%s", dir, i, _LMBA[j]);
+			fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+			if (fd < 0)
+				return -errno;
+			if (write(fd, vals[j], strlen(vals[j])) != (ssize_t) strlen(vals[j]))
+			{
+				close(fd);
+				return -EIO;
+			}
+			close(fd);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Remove the synthetic memory directory
+ */
+static void bench_tree_remove(char *dir, int num)
+{
+	int i, j;
+	char path[LMLN_FILEPATH];
+
+	for ( i = 0 ; i < num ; i++ )
+	{
+		for ( j = 0 ; j < LMBA_MAX ; j++ )
+		{
+			sprintf(path, "%s/memory%d/%s", dir, i, _LMBA[j]);
+			unlink(path);
+		}
+
+		sprintf(path, "%s/memory%d", dir, i);
+		rmdir(path);
+	}
+
+	rmdir(dir);
+}
+
+/**
+ * Time the attribute load of every block
+ * @param missing 	set to the number of blocks that were not loaded on the last iteration
+ * @return the fastest iteration in ns
+ */
+static unsigned long long bench_run(struct mem_ctx *ctx, int io_uring, int iterations, int *missing)
+{
+	int i, k;
+	unsigned long long t, best;
+
+	best = 0;
+	mem_set_io_uring(ctx, io_uring);
+
+	for ( k = 0 ; k < iterations ; k++ )
+	{
+		for ( i = 0 ; i < ctx->num ; i++ )
+			ctx->blocks[i].state = LMST_MAX;
+
+		t = mem_now_ns();
+		mem_blk_load_all(ctx);
+		t = mem_now_ns() - t;
+
+		if (k == 0 || t < best)
+			best = t;
+	}
+
+	*missing = 0;
+	for ( i = 0 ; i < ctx->num ; i++ )
+		if (ctx->blocks[i].state != LMST_ONLINE || ctx->blocks[i].valid_zones != LMZM_MOVABLE)
+			(*missing)++;
+
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	int rv, blocks, num, iterations, threads, missing;
+	int *ids;
+	struct mem_ctx *ctx;
+	struct uring *ur;
+	unsigned long long ns;
+	char dir[] = "/tmp/uring-bench.XXXXXX";
+
+	// Initialize variables
+	rv = 1;
+	ids = NULL;
+	ctx = NULL;
+	blocks = (argc > 1) ? atoi(argv[1]) : BNLN_BLOCKS;
+	iterations = (argc > 2) ? atoi(argv[2]) : BNLN_ITERATIONS;
+	threads = (argc > 3) ? atoi(argv[3]) : BNLN_THREADS;
+	if (blocks <= 0 || iterations <= 0 || threads <= 0)
+	{
+		fprintf(stderr, "Usage: %s [<blocks> [<iterations> [<threads>]]]\n", argv[0]);
+		return 1;
+	}
+
+	if (mkdtemp(dir) == NULL)
+	{
+		fprintf(stderr, "Error: Could not create temporary directory: %d\n", errno);
+		return 1;
+	}
+
+	rv = bench_tree_create(dir, blocks);
+	if (rv != 0)
+	{
+		fprintf(stderr, "Error: Could not build the synthetic tree in %s: %d\n", dir, rv);
+		rv = 1;
+		goto end;
+	}
+
+	rv = mem_new(&ctx);
+	if (rv != 0)
+	{
+		fprintf(stderr, "Error: Failed to obtain mem context: %d\n", rv);
+		rv = 1;
+		goto end;
+	}
+	mem_set_threads(ctx, threads);
+
+	// Point the context at the synthetic tree
+	if (ctx->memfd >= 0)
+		close(ctx->memfd);
+	ctx->memfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+	num = mem_blk_scan_dir(ctx, ctx->memfd, DT_DIR, &ids);
+	ctx->blocks = calloc(num, sizeof(struct mem_blk));
+	if (num <= 0 || ctx->blocks == NULL || mem_blk_init_index(ctx, ids, num) != 0)
+	{
+		fprintf(stderr, "Error: Could not index the synthetic tree: %d\n", num);
+		rv = 1;
+		goto end;
+	}
+	ctx->num = num;
+
+	printf("Blocks:     %d\n", num);
+	printf("Iterations: %d\n", iterations);
+	printf("Threads:    %d\n", threads);
+
+	ns = bench_run(ctx, 0, iterations, &missing);
+	printf("sync:       %10.3f ms  %8.0f ns/block  missing %d\n", ns / 1e6, (double) ns / num, missing);
+
+	if (uring_new(&ur, LMLN_URING_ENTRIES) != 0)
+	{
+		printf("io_uring:   not available\n");
+	}
+	else
+	{
+		uring_free(ur);
+		ns = bench_run(ctx, 1, iterations, &missing);
+		printf("io_uring:   %10.3f ms  %8.0f ns/block  missing %d\n", ns / 1e6, (double) ns / num, missing);
+	}
+
+	rv = 0;
+
+end:
+
+	if (ids != NULL)
+		free(ids);
+	if (ctx != NULL)
+		mem_unref(ctx);
+
+	bench_tree_remove(dir, blocks);
+
+	return rv;
+}
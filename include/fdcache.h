@@ -0,0 +1,53 @@
+/**
+ * @file 		fdcache.h
+ *
+ * @brief 		Header file for the open sysfs attribute file descriptor cache
+ *
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date        Jul 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *
+ * sysfs attributes regenerate their contents on every read at offset 0, so an
+ * attribute can be re-read with pread() on a file descriptor that is kept
+ * open. The cache keeps the most recently used descriptors open in LRU order
+ * keyed by directory fd, path and access mode. All functions are thread safe.
+ */
+
+#ifndef _FDCACHE_H
+#define _FDCACHE_H
+
+/* INCLUDES ==================================================================*/
+
+/* MACROS ====================================================================*/
+
+/* ENUMERATIONS ==============================================================*/
+
+/* STRUCTS ===================================================================*/
+
+struct fdcache;
+
+/**
+ * Cache counters
+ */
+struct fdcache_stats
+{
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned size;               // Number of open descriptors held
+	unsigned capacity;           // Maximum number of open descriptors held
+};
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/* PROTOTYPES ================================================================*/
+
+void fdcache_free(struct fdcache *fc);
+void fdcache_get_stats(struct fdcache *fc, struct fdcache_stats *stats);
+int  fdcache_new(struct fdcache **fc, unsigned capacity);
+int  fdcache_pread(struct fdcache *fc, int dirfd, const char *path, char *buf, unsigned len);
+int  fdcache_pwrite(struct fdcache *fc, int dirfd, const char *path, const char *buf, unsigned len);
+void fdcache_set_capacity(struct fdcache *fc, unsigned capacity);
+
+#endif //_FDCACHE_H
@@ -9,7 +9,12 @@
  * @author      Barrett Edwards <code@jrlabs.io>
  *
  * Macro / Enumeration Prefixes (LM)
+ * EM - Event bitfield masks 
+ * EV - Event types 
+ * FT - Memory System Features 
  * PL - Memory Online Policies 
+ * RF - Refresh flags bitfield masks 
+ * SR - State range flags bitfield masks 
  * ST - State options 
  * ZN - Valid Zones bitfield enum
  * ZM - Valid Zones bitfield masks 
@@ -22,6 +27,7 @@
 /* MACROS ====================================================================*/
 
 #define mem_blk_foreach(ctx, blk)  	for (blk = mem_blk_get_first(ctx); blk != NULL; blk = mem_blk_get_next(blk))
+#define mem_region_blk_foreach(ctx, region, blk)  	for (blk = mem_region_blk_get_first(ctx, region); blk != NULL; blk = mem_region_blk_get_next(blk))
 
 /* ENUMERATIONS ==============================================================*/
 
@@ -37,6 +43,28 @@ enum LMLD
 	LMLD_MAX
 };
 
+/* Event types delivered to mem_events_subscribe() callbacks */
+enum LMEV
+{
+	LMEV_BLK_ADD 				= 0,	// A memoryN block appeared
+	LMEV_BLK_REMOVE 			= 1,	// A memoryN block was removed
+	LMEV_BLK_ONLINE 			= 2,	// A memoryN block was onlined
+	LMEV_BLK_OFFLINE 			= 3,	// A memoryN block was offlined
+	LMEV_REGION 				= 4,	// A CXL region changed
+	LMEV_DAX 					= 5,	// A dax device changed
+	LMEV_MAX
+};
+
+/* Memory System Features */
+enum LMFT
+{
+	LMFT_AUTO_ONLINE 			= 0,	// auto_online_blocks is present
+	LMFT_MEMMAP_ON_MEMORY 		= 1,	// memory_hotplug.memmap_on_memory is present
+	LMFT_PROBE 					= 2,	// Memory probe interface is present
+	LMFT_VALID_ZONES 			= 3,	// Per block valid_zones is present
+	LMFT_MAX
+};
+
 /* Auto Online Policy Options */
 enum LMPL
 {
@@ -74,10 +102,144 @@ enum LMZN
 #define LMZM_MOVABLE 	(0x08)
 #define LMZM_NONE   	(0x10)
 
+/* Bitfield masks of enum LMEV for mem_events_subscribe() */
+#define LMEM_BLK_ADD 		(0x01)
+#define LMEM_BLK_REMOVE 	(0x02)
+#define LMEM_BLK_ONLINE 	(0x04)
+#define LMEM_BLK_OFFLINE 	(0x08)
+#define LMEM_REGION 		(0x10)
+#define LMEM_DAX 			(0x20)
+#define LMEM_ALL 			(0x3F)
+
+/* Bitfield masks for mem_refresh() */
+#define LMRF_SYSTEM 	(0x01)     // Reload block size, kernel version and features
+#define LMRF_BLOCKS 	(0x02)     // Add and remove blocks that changed in the memory directory
+#define LMRF_STATE 		(0x04)     // Re-read online, state and valid_zones of every block
+#define LMRF_REGIONS 	(0x08)     // Drop the cached region list and block ranges
+
+/* Bitfield masks for mem_blk_set_state_range() and the region parallel state changes */
+#define LMSR_CONTINUE 	(0x01)     // Keep going after a block fails. Default is to stop on the first error
+#define LMSR_TRANSACTION (0x02)    // Roll back every block that was changed if any block fails
+#define LMSR_COST 		(0x04)     // Offline the blocks with the lowest migration cost first
+
 /* STRUCTS ===================================================================*/
 
 struct mem_ctx;
 struct mem_blk;
+struct mem_op;
+
+/**
+ * Aggregate memory block statistics 
+ *
+ * Filled in a single pass by mem_system_get_stats() and mem_region_get_stats()
+ */
+struct mem_stats
+{
+	unsigned long long block_size;
+	unsigned long long capacity;
+	unsigned long long capacity_online;
+	unsigned long long capacity_offline;
+	int blocks;
+	int online;
+	int offline;
+	int going_offline;
+	int movable;                // Online blocks in zone movable 
+	int kernel;                 // Online blocks in a kernel zone (DMA, DMA32, Normal)
+	int zones[LMZN_MAX];        // Number of blocks that list each zone in valid_zones
+};
+
+/**
+ * Per block outcome of mem_blk_set_state_range(), mem_op_poll(), 
+ * mem_region_online_blocks_parallel() and mem_region_offline_blocks_parallel()
+ */
+struct mem_blk_result
+{
+	int id;
+	int rv;                     // 0 upon success. -ENOENT if no such block. -ECANCELED if not attempted or rolled back. -ETIMEDOUT if not started before the deadline. Otherwise the failure of the state change
+	int state;                  // [LMPL] State of the block after the call. -1 if no such block
+	int retries;                // Number of times a busy block was retried
+	unsigned long long ns;      // Time spent writing the state of the block. 0 if no write was needed
+};
+
+/**
+ * Latency and throughput of a parallel block state change
+ *
+ * Latencies only cover the blocks whose state was written successfully
+ */
+struct mem_op_stats
+{
+	int blocks;                 // Number of blocks in the operation
+	int changed;                // Blocks whose state was written successfully
+	int failed;
+	int threads;                // Number of worker threads used
+	int retries;                // Total number of retries of busy blocks
+	int rolled_back;            // Blocks restored to their previous state by a failed transaction
+	unsigned long long bytes;          // Capacity of the changed blocks
+	unsigned long long elapsed_ns;     // Wall time of the whole operation
+	unsigned long long lat_min_ns;
+	unsigned long long lat_avg_ns;
+	unsigned long long lat_max_ns;
+	unsigned long long bytes_per_sec;  // Throughput: bytes / elapsed_ns
+};
+
+/**
+ * Lease of a contiguous run of memory blocks granted by mem_lease_grant()
+ */
+struct mem_lease
+{
+	int first;                  // First memory block id 
+	int num;                    // Number of blocks 
+	int node;                   // NUMA node of the blocks 
+	char owner[64];             // Tenant name without white space
+};
+
+/**
+ * Page counts of a memory block filled by mem_blk_get_pages()
+ */
+struct mem_blk_pages
+{
+	unsigned long long pages;       // Page frames present in the block
+	unsigned long long free;        // Free in the buddy allocator
+	unsigned long long lru;         // On an LRU list. Migrated when offlining
+	unsigned long long slab;        // Slab pages. Block cannot be offlined
+	unsigned long long unmovable;   // Other pages in use that cannot be migrated
+	unsigned long long huge;        // Pages of hugetlbfs or transparent huge pages
+	unsigned long long mapped;      // Sum of the page map counts from /proc/kpagecount
+	unsigned long long cost;        // Migration cost score. Lower offlines faster
+};
+
+/**
+ * Open sysfs attribute file descriptor cache counters 
+ *
+ * Filled by mem_fdcache_get_stats()
+ */
+struct mem_fdcache_stats
+{
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned size;              // Number of open descriptors held
+	unsigned capacity;          // Maximum number of open descriptors held
+};
+
+/**
+ * Kernel uevent delivered to mem_events_subscribe() callbacks 
+ *
+ * The strings are only valid for the duration of the callback
+ */
+struct mem_event
+{
+	int type;                   // [LMEV]
+	int id;                     // Memory block id for block events. -1 otherwise
+	const char *action;         // uevent ACTION 
+	const char *devpath;        // uevent DEVPATH 
+	const char *subsystem;      // uevent SUBSYSTEM 
+};
+
+/*
+ * Typedef for mem_events_subscribe() callbacks 
+ */
+typedef void (*mem_event_fn)(struct mem_ctx *ctx, const struct mem_event *event, void *arg);
 
 /* 
  * Typedef for mem_set_log_fn()
@@ -92,6 +254,20 @@ typedef void (*mem_log_fn)(struct mem_ctx *ctx, int priority, const char *fn, in
 int                  mem_new(struct mem_ctx **ctx);
 struct mem_ctx *     mem_ref(struct mem_ctx *ctx);
 int                  mem_unref(struct mem_ctx *ctx);
+int                  mem_refresh(struct mem_ctx *ctx, int flags);
+int                  mem_refresh_ids(struct mem_ctx *ctx, int *ids, int num);
+void                 mem_set_io_uring(struct mem_ctx *ctx, int enable);
+int                  mem_set_offline_threads(struct mem_ctx *ctx, int threads);
+int                  mem_set_online_threads(struct mem_ctx *ctx, int threads);
+int                  mem_set_threads(struct mem_ctx *ctx, int threads);
+
+/* Library Events */
+int                  mem_events_apply(struct mem_ctx *ctx);
+int                  mem_events_get_fd(struct mem_ctx *ctx);
+int                  mem_events_start(struct mem_ctx *ctx, int fd);
+int                  mem_events_stop(struct mem_ctx *ctx);
+int                  mem_events_subscribe(struct mem_ctx *ctx, unsigned mask, mem_event_fn fn, void *arg);
+int                  mem_events_unsubscribe(struct mem_ctx *ctx, int id);
 
 /* Library Log Configuration */
 int	                 mem_log_get_priority(struct mem_ctx *ctx);
@@ -105,6 +281,25 @@ void                 mem_log_set_fn(struct mem_ctx *ctx,
                                                        va_list args));
 void                 mem_log_set_priority(struct mem_ctx *ctx, int priority);
 
+/* Asynchronous Block State Changes */
+int                  mem_op_cancel(struct mem_op *op);
+void                 mem_op_free(struct mem_op *op);
+int                  mem_op_get_fd(struct mem_op *op);
+int                  mem_op_poll(struct mem_op *op, struct mem_blk_result *results);
+int                  mem_op_submit(struct mem_ctx *ctx, int *ids, int num, int state, int timeout_ms, struct mem_op **op);
+
+/* Block Lease Manager */
+void                 mem_lease_close(struct mem_ctx *ctx);
+int                  mem_lease_get(struct mem_ctx *ctx, int index, struct mem_lease *lease);
+int                  mem_lease_grant(struct mem_ctx *ctx, int node, struct cxl_region *region, int num, const char *owner, struct mem_lease *lease);
+int                  mem_lease_num(struct mem_ctx *ctx);
+int                  mem_lease_open(struct mem_ctx *ctx, const char *path);
+int                  mem_lease_release(struct mem_ctx *ctx, int first);
+
+/* Library sysfs File Descriptor Cache */
+int                  mem_fdcache_get_stats(struct mem_ctx *ctx, struct mem_fdcache_stats *stats);
+unsigned             mem_fdcache_set_size(struct mem_ctx *ctx, unsigned size);
+
 /* Library Collections API - Get */
 struct cxl_region *  mem_get_region(struct mem_ctx *ctx, char *name);
 struct cxl_memdev *  mem_get_memdev(struct mem_ctx *ctx, char *name);
@@ -120,12 +315,16 @@ unsigned long long   mem_system_get_blocksize(struct mem_ctx *ctx);
 unsigned long long   mem_system_get_capacity(struct mem_ctx *ctx);
 unsigned long long   mem_system_get_capacity_offline(struct mem_ctx *ctx);
 unsigned long long   mem_system_get_capacity_online(struct mem_ctx *ctx);
+int                  mem_system_get_idle(struct mem_ctx *ctx, int node, int interval_ms, unsigned long long *total);
 int                  mem_system_get_policy(struct mem_ctx *ctx);
+int                  mem_system_get_stats(struct mem_ctx *ctx, struct mem_stats *stats);
+int                  mem_system_has_feature(struct mem_ctx *ctx, int feature);
 int                  mem_system_num_blocks(struct mem_ctx *ctx);
 int                  mem_system_num_blocks_online(struct mem_ctx *ctx);
 int                  mem_system_num_blocks_offline(struct mem_ctx *ctx);
 
 /* Memory System API - Actions */
+int                  mem_system_set_online_capacity(struct mem_ctx *ctx, int node, unsigned long long bytes, int zone, int flags, unsigned long long *capacity);
 int                  mem_system_set_policy(struct mem_ctx *ctx, int mode);
 
 /* Memory Block API - Enumeration */
@@ -135,7 +334,10 @@ struct mem_blk *     mem_blk_get_next(struct mem_blk *blk);
 /* Memory Block API - Get */
 int                  mem_blk_get_device(struct mem_blk *blk);
 int                  mem_blk_get_id(struct mem_blk *blk);
+int                  mem_blk_get_idle_range(struct mem_ctx *ctx, int *ids, int num, int interval_ms, unsigned long long *idle);
 int                  mem_blk_get_node(struct mem_blk *blk);
+int                  mem_blk_get_pages(struct mem_blk *blk, struct mem_blk_pages *pages);
+int                  mem_blk_get_pages_range(struct mem_ctx *ctx, int *ids, int num, struct mem_blk_pages *pages);
 struct cxl_region *  mem_blk_get_region(struct mem_blk *blk);	
 int                  mem_blk_get_state(struct mem_blk *blk);
 unsigned long        mem_blk_get_zones(struct mem_blk *blk);
@@ -145,7 +347,9 @@ int                  mem_blk_is_removable(struct mem_blk *blk);
 /* Memory Block API - Actions  */
 int                  mem_blk_offline(struct mem_blk *blk);
 int                  mem_blk_online(struct mem_blk *blk);
+int                  mem_blk_refresh(struct mem_blk *blk);
 int                  mem_blk_set_state(struct mem_blk *blk, int state);
+int                  mem_blk_wait_state(struct mem_blk *blk, int state, int timeout_ms);
 
 /* Memory BlockID API - Get  */
 struct mem_blk *     mem_blkid_get_blk(struct mem_ctx *ctx, int id);
@@ -159,18 +363,27 @@ int                  mem_blkid_is_removable(struct mem_ctx *ctx, int id);
 /* Memory BlockID API - Actions */
 int                  mem_blkid_offline(struct mem_ctx *ctx, int index);
 int                  mem_blkid_online(struct mem_ctx *ctx, int index);
+int                  mem_blkid_refresh(struct mem_ctx *ctx, int index);
 int                  mem_blkid_set_state(struct mem_ctx *ctx, int index, int state);
+int                  mem_blk_set_state_range(struct mem_ctx *ctx, int *ids, int num, int state, int flags, struct mem_blk_result *results);
 
 /* Memory Memdev API - Get */
 int                  mem_memdev_get_interleave_granularity(struct mem_ctx *ctx, struct cxl_memdev *memdev);
 int                  mem_memdev_is_available(struct mem_ctx *ctx, struct cxl_memdev *memdev);
 
+/* Memory Region API - Enumeration */
+struct mem_blk *     mem_region_blk_get_first(struct mem_ctx *ctx, struct cxl_region *region);
+struct mem_blk *     mem_region_blk_get_next(struct mem_blk *blk);
+struct mem_blk *     mem_region_get_span(struct mem_ctx *ctx, struct cxl_region *region, int *num);
+
 /* Memory Region API - Get */
 int                  mem_region_get_blk_state(struct mem_ctx *ctx, struct cxl_region *region, int offset);
 int *                mem_region_get_blocks(struct mem_ctx *ctx, struct cxl_region *region);
 unsigned long long   mem_region_get_capacity(struct mem_ctx *ctx, struct cxl_region *region);
 unsigned long long   mem_region_get_capacity_offline(struct mem_ctx *ctx, struct cxl_region *region);
 unsigned long long   mem_region_get_capacity_online(struct mem_ctx *ctx, struct cxl_region *region);
+int                  mem_region_get_idle(struct mem_ctx *ctx, struct cxl_region *region, int interval_ms, unsigned long long *idle, unsigned long long *total);
+int                  mem_region_get_stats(struct mem_ctx *ctx, struct cxl_region *region, struct mem_stats *stats);
 int                  mem_region_is_daxmode(struct mem_ctx *ctx, struct cxl_region* region);
 int                  mem_region_is_rammode(struct mem_ctx *ctx, struct cxl_region* region);
 int                  mem_region_num_blocks(struct mem_ctx *ctx, struct cxl_region *region);
@@ -182,8 +395,11 @@ int                  mem_region_create(struct mem_ctx *ctx, int granularity, int
 int                  mem_region_delete(struct mem_ctx *ctx, struct cxl_region *region);
 
 int                  mem_region_offline_blocks(struct mem_ctx *ctx, struct cxl_region *region);
+int                  mem_region_offline_blocks_parallel(struct mem_ctx *ctx, struct cxl_region *region, int timeout_ms, int flags, struct mem_blk_result *results, struct mem_op_stats *stats);
 int                  mem_region_online_blocks(struct mem_ctx *ctx, struct cxl_region *region);
+int                  mem_region_online_blocks_parallel(struct mem_ctx *ctx, struct cxl_region *region, int state, int timeout_ms, int flags, struct mem_blk_result *results, struct mem_op_stats *stats);
 int                  mem_region_set_blk_state(struct mem_ctx *ctx, struct cxl_region *region, int offset, int mode);
+int                  mem_region_wait_online(struct mem_ctx *ctx, struct cxl_region *region, int timeout_ms);
 
 int                  mem_region_daxmode(struct mem_ctx *ctx, struct cxl_region *region);
 int                  mem_region_rammode(struct mem_ctx *ctx, struct cxl_region *region);
@@ -28,6 +28,7 @@
  * -k --kernel 			Zone: kernel 
  * -m --movable 		Zone: Online movable
  * -n --num 			Display the number of objects 
+ * -N --node 			NUMA node id 
  * -r --region 			Region name 
  * -v --verbose 		Increase verbosity 
  * 
@@ -99,6 +100,7 @@ enum _CLAP
 	CLAP_SHOW_CAPACITY			,
 	CLAP_SHOW_DEVICE			,
 	CLAP_SHOW_NUM    			,
+	CLAP_SHOW_OCCUPANCY			,
 	CLAP_SHOW_REGION			,
 	CLAP_SHOW_SYSTEM			,
 
@@ -131,6 +133,7 @@ enum _CLCM
 	CLCM_SHOW_NUM_BLOCKS						,
 	CLCM_SHOW_NUM_DEVICES						,
 	CLCM_SHOW_NUM_REGIONS						,
+	CLCM_SHOW_OCCUPANCY 						,
 
 	CLCM_SHOW_SYSTEM_BLOCKSIZE 					, 
 	CLCM_SHOW_SYSTEM_POLICY 					, 
@@ -188,6 +191,8 @@ enum _CLOP
 	CLOP_DEVICES      		= 21,	//!< Show Devices <set>
 	CLOP_REGIONS      		= 22,	//!< Show Regions <set>
 
+	CLOP_NODE         		= 23,	//!< NUMA node id <val>
+
 	CLOP_MAX
 };
 
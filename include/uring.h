@@ -0,0 +1,50 @@
+/**
+ * @file 		uring.h
+ *
+ * @brief 		Header file for io_uring batched file reads
+ *
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date        Jul 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *
+ * Each read is submitted as a linked openat+read+close chain on a direct
+ * (registered) file slot so a whole batch of small files costs a single
+ * io_uring_enter system call. The ring is not thread safe: use one ring per
+ * thread.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+/* INCLUDES ==================================================================*/
+
+/* MACROS ====================================================================*/
+
+/* ENUMERATIONS ==============================================================*/
+
+/* STRUCTS ===================================================================*/
+
+struct uring;
+
+/**
+ * One file read request of a batch
+ */
+struct uring_read
+{
+	int dirfd;         // Directory fd that path is relative to, or AT_FDCWD
+	const char *path;
+	char *buf;
+	unsigned len;      // Size of buf
+	int res;           // Output: Number of bytes read or negative errno
+};
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/* PROTOTYPES ================================================================*/
+
+void uring_free(struct uring *ur);
+int  uring_new(struct uring **ur, unsigned entries);
+int  uring_read_batch(struct uring *ur, struct uring_read *reqs, int num);
+
+#endif //_URING_H
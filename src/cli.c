@@ -103,6 +103,8 @@ int cmd_show_num_blocks(int online, int offline, char *region_name);
 int cmd_show_num_devices();
 int cmd_show_num_regions();
 
+int cmd_show_occupancy(char *region_name, int node);
+
 int cmd_show_region_blk_state(char *name, int offset);
 
 int cmd_show_region_isenabled(char *name);
@@ -118,10 +120,14 @@ int cmd_show_system_policy();
 
 int cmd_blk_offline(int num, int start)
 {
-	int rv; 
+	int rv, n; 
+	int *ids;
 	struct mem_ctx *ctx;
+	struct mem_blk_result *results;
 
 	rv = 1;
+	ids = NULL;
+	results = NULL;
 
 	// Validate Privileges
 	if ( getuid() != 0 )
@@ -142,24 +148,48 @@ int cmd_blk_offline(int num, int start)
 	mem_log_set_destination(ctx, CLI_LOG_DST, NULL);
 	mem_log_set_priority(ctx, CLI_LOG_LEVEL);
 
-	for ( int i = start ; i < (start + num) ; i++)
+	// Build the list of block ids. Ids without a memory block are skipped
+	ids = malloc(num * sizeof(int));
+	results = calloc(num, sizeof(*results));
+	if ((ids == NULL || results == NULL) && num > 0)
 	{
-		if (mem_blkid_is_online(ctx, i) == 1)
-		{
-			// Online a memory block
-			rv = mem_blkid_offline(ctx, i);
-			if (rv != 0)
-			{
-				fprintf(stderr, "Error: Could not offline memory block %d. %d\n", i, rv);
-				goto err;
-			}
-		}
+		fprintf(stderr, "Error: Out of memory\n");
+		rv = 1;
+		goto err;
+	}
+	n = 0;
+	for ( int i = 0 ; i < num ; i++ )
+		if (mem_blkid_get_blk(ctx, start + i) != NULL)
+			ids[n++] = start + i;
+	num = n;
+
+	// Nothing to do 
+	if (num == 0)
+	{
+		rv = 0;
+		goto err;
+	}
+
+	// Offline the cheapest blocks first. Stop on the first failure
+	rv = mem_blk_set_state_range(ctx, ids, num, LMPL_OFFLINE, LMSR_COST, results);
+	if (rv != 0)
+	{
+		for ( int i = 0 ; i < num ; i++ )
+			if (results[i].rv != 0 && results[i].rv != -ECANCELED)
+				fprintf(stderr, "Error: Could not offline memory block %d. %d\n", results[i].id, results[i].rv);
+		rv = 1;
+		goto err;
 	}
 
 	rv = 0;
 
 err:
 
+	if (ids != NULL)
+		free(ids);
+	if (results != NULL)
+		free(results);
+
 	mem_unref(ctx);
 
 end:
@@ -169,11 +199,14 @@ end:
 
 int cmd_blk_online(int num, int start)
 {
-	int rv; 
+	int rv, n, flags; 
+	int *ids;
 	struct mem_ctx *ctx; 
-	struct mem_blk *blk;
+	struct mem_blk_result *results;
 
 	rv = 1;
+	ids = NULL;
+	results = NULL;
 
 	// Validate Privileges
 	if ( getuid() != 0 )
@@ -194,33 +227,62 @@ int cmd_blk_online(int num, int start)
 	mem_log_set_destination(ctx, CLI_LOG_DST, NULL);
 	mem_log_set_priority(ctx, CLI_LOG_LEVEL);
 
-	// Online all blocks 
+	// Build the list of block ids. All blocks keep going past failures
 	if (num < 0)
 	{
-		mem_blk_foreach(ctx, blk)
-			if (!mem_blk_is_online(blk))
-				mem_blk_online(blk);
+		num = mem_system_num_blocks(ctx);
+		ids = (num > 0) ? mem_system_get_blocks(ctx) : NULL;
+		flags = LMSR_CONTINUE;
 	}
 	else 
 	{
-		for ( int i = start ; i < (start + num) ; i++)
+		// Ids without a memory block are skipped
+		ids = malloc(num * sizeof(int));
+		if (ids != NULL)
 		{
-			if (!mem_blkid_is_online(ctx, i))
-			{
-				// Online a memory block
-				rv = mem_blkid_online(ctx, i);
-				if (rv != 0)
-				{
-					fprintf(stderr, "Error: Could not online memory block %d. %d\n", i, rv);
-					goto err;
-				}
-			}
+			n = 0;
+			for ( int i = 0 ; i < num ; i++ )
+				if (mem_blkid_get_blk(ctx, start + i) != NULL)
+					ids[n++] = start + i;
+			num = n;
 		}
+		flags = 0;
+	}
+
+	results = calloc(num, sizeof(*results));
+	if ((ids == NULL || results == NULL) && num > 0)
+	{
+		fprintf(stderr, "Error: Out of memory\n");
+		rv = 1;
+		goto err;
+	}
+
+	// Nothing to do 
+	if (num == 0)
+	{
+		rv = 0;
+		goto err;
+	}
+
+	// Online the blocks 
+	rv = mem_blk_set_state_range(ctx, ids, num, LMPL_MOVABLE, flags, results);
+	if (rv != 0)
+	{
+		for ( int i = 0 ; i < num ; i++ )
+			if (results[i].rv != 0 && results[i].rv != -ECANCELED)
+				fprintf(stderr, "Error: Could not online memory block %d. %d\n", results[i].id, results[i].rv);
+		rv = 1;
+		goto err;
 	}
 
 	rv = 0;
 
 err:
+
+	if (ids != NULL)
+		free(ids);
+	if (results != NULL)
+		free(results);
 	
 	mem_unref(ctx);
 
@@ -233,6 +295,7 @@ int cmd_info()
 {
 	int rv; 
 	struct mem_ctx *ctx; 
+	struct mem_stats stats;
 
 	// Create mem context 
 	rv = mem_new(&ctx);
@@ -245,14 +308,17 @@ int cmd_info()
 	mem_log_set_destination(ctx, CLI_LOG_DST, NULL);
 	mem_log_set_priority(ctx, CLI_LOG_LEVEL);
 
-	printf("Memory Blocksize:              %llu\n", 	mem_system_get_blocksize(ctx));
+	// Collect all block statistics in one pass 
+	mem_system_get_stats(ctx, &stats);
+
+	printf("Memory Blocksize:              %llu\n", 	stats.block_size);
 	printf("Auto Online Memory Policy:     %s\n", 		mem_lmpl(mem_system_get_policy(ctx)));
-	printf("Number of Blocks:              %d\n", 		mem_system_num_blocks(ctx));
-	printf("  Number of Blocks online:     %d\n", 		mem_system_num_blocks_online(ctx));
-	printf("  Number of Blocks offline:    %d\n", 		mem_system_num_blocks_offline(ctx));
-	printf("Memory Capacity:               %llu\n", 	mem_system_get_capacity(ctx));
-	printf("  Memory Capacity online:      %llu\n", 	mem_system_get_capacity_online(ctx));
-	printf("  Memory Capacity offline:     %llu\n", 	mem_system_get_capacity_offline(ctx));
+	printf("Number of Blocks:              %d\n", 		stats.blocks);
+	printf("  Number of Blocks online:     %d\n", 		stats.online);
+	printf("  Number of Blocks offline:    %d\n", 		stats.offline);
+	printf("Memory Capacity:               %llu\n", 	stats.capacity);
+	printf("  Memory Capacity online:      %llu\n", 	stats.capacity_online);
+	printf("  Memory Capacity offline:     %llu\n", 	stats.capacity_offline);
 	printf("Number of CXL regions:         %d\n", 		mem_num_regions(ctx));
 	printf("Number of CXL memdevs:         %d\n", 		mem_num_memdevs(ctx));
 	
@@ -268,7 +334,7 @@ int cmd_list(int online, int offline, char *region_name)
 	int rv;
 	struct mem_blk *blk;
 	struct mem_ctx *ctx;
-	struct cxl_region *region;
+	struct cxl_region *region, *filter;
 	unsigned long u;
 
 	// Initialize variables
@@ -285,6 +351,11 @@ int cmd_list(int online, int offline, char *region_name)
 	mem_log_set_destination(ctx, CLI_LOG_DST, NULL);
 	mem_log_set_priority(ctx, CLI_LOG_LEVEL);
 
+	// Resolve the region filter once rather than comparing names per block
+	filter = NULL;
+	if (region_name != NULL)
+		filter = mem_get_region(ctx, region_name);
+
 	printf("Index  node  online  cxl_region  zones\n");
 	printf("-----  ----  ------  ----------  -------------------\n");
 
@@ -298,10 +369,7 @@ int cmd_list(int online, int offline, char *region_name)
 
 		region = mem_blk_get_region(blk);	
 
-		if (region == NULL && region_name != NULL)
-			continue;
-
-		if (region != NULL && region_name != NULL && strcmp(region_name, cxl_region_get_devname(region)) )
+		if (region_name != NULL && (region == NULL || region != filter))
 			continue;
 
 		printf("%-5d  %-4d  %-6d  ", 
@@ -527,14 +595,18 @@ int cmd_region_delete(char *name)
 	if (name == NULL)
 	{
 		num = mem_num_regions(ctx);
-		regions = mem_get_regions(ctx);
 		char name[256];
 
 		for ( int i = 0 ; i < num ; i++)
 		{
+			// The region array is rebuilt after each delete so always take the first
+			regions = mem_get_regions(ctx);
+			if (regions == NULL)
+				break;
+
 			// Delete region 
-			strcpy(name, cxl_region_get_devname(regions[i]));
-			rv = mem_region_delete(ctx, regions[i]);
+			strcpy(name, cxl_region_get_devname(regions[0]));
+			rv = mem_region_delete(ctx, regions[0]);
 			if (rv != 0)
 			{
 				fprintf(stderr, "Error: Could not delete region: %s\n", name);
@@ -1049,7 +1121,6 @@ int cmd_show_blk_isonline(int id)
 {
 	int rv;
 	struct mem_ctx *ctx;
-	struct mem_blk *blk;
 
 	rv = 1;
 
@@ -1073,13 +1144,7 @@ int cmd_show_blk_isonline(int id)
 	mem_log_set_priority(ctx, CLI_LOG_LEVEL);
 
 	// Check if memory block is online 
-	rv = -1;
-	mem_blk_foreach(ctx, blk)
-		if (id == mem_blk_get_id(blk))
-		{
-			rv = mem_blk_is_online(blk);
-			break;
-		}
+	rv = mem_blkid_is_online(ctx, id);
 	printf("%d\n", rv);
 
 	rv = 0;
@@ -1263,7 +1328,7 @@ int cmd_show_blocks(int online, int offline, char *region_name)
 	int rv;
 	struct mem_ctx *ctx;
 	struct mem_blk *blk;
-	struct cxl_region *region;
+	struct cxl_region *region, *filter;
 
 	rv = 1;
 
@@ -1278,6 +1343,11 @@ int cmd_show_blocks(int online, int offline, char *region_name)
 	mem_log_set_destination(ctx, CLI_LOG_DST, NULL);
 	mem_log_set_priority(ctx, CLI_LOG_LEVEL);
 
+	// Resolve the region filter once rather than comparing names per block
+	filter = NULL;
+	if (region_name != NULL)
+		filter = mem_get_region(ctx, region_name);
+
 	mem_blk_foreach(ctx, blk)
 	{
 		if (online && !mem_blk_is_online(blk))
@@ -1288,10 +1358,7 @@ int cmd_show_blocks(int online, int offline, char *region_name)
 
 		region = mem_blk_get_region(blk);
 
-		if (region_name != NULL && region == NULL)
-			continue;
-
-		if (region_name != NULL && region != NULL && strcmp(region_name, cxl_region_get_devname(region)))
+		if (region_name != NULL && (region == NULL || region != filter))
 			continue;
 
 		printf("%d\n", mem_blk_get_id(blk));
@@ -1767,6 +1834,170 @@ end:
 	return rv;
 }
 
+int cmd_show_occupancy(char *region_name, int node)
+{
+	int rv, i, j, num, *ids, *levels;
+	unsigned long long used, total;
+	struct mem_ctx *ctx;
+	struct mem_blk *blk, **blks;
+	struct mem_blk_pages *pages;
+	struct cxl_region *filter;
+	char range[32];
+
+	// Initialize variables
+	rv = 1;
+	num = 0;
+	ids = NULL;
+	blks = NULL;
+	pages = NULL;
+	levels = NULL;
+
+	// Get mem contex
+	rv = mem_new(&ctx);
+	if (rv != 0)
+	{
+		fprintf(stderr, "Error: Failed to obtain mem context: %d\n", rv);
+		rv = 1;
+		goto end;
+	}
+	mem_log_set_destination(ctx, CLI_LOG_DST, NULL);
+	mem_log_set_priority(ctx, CLI_LOG_LEVEL);
+
+	filter = NULL;
+	if (region_name != NULL)
+	{
+		filter = mem_get_region(ctx, region_name);
+		if (filter == NULL)
+		{
+			fprintf(stderr, "Error: Could not obtain region: %s\n", region_name);
+			rv = 1;
+			goto err;
+		}
+	}
+
+	// Nothing to do on a system without memory blocks
+	i = mem_system_num_blocks(ctx);
+	if (i <= 0)
+	{
+		rv = 0;
+		goto err;
+	}
+
+	ids = malloc(i * sizeof(*ids));
+	blks = malloc(i * sizeof(*blks));
+	if (ids == NULL || blks == NULL)
+	{
+		fprintf(stderr, "Error: Out of memory\n");
+		rv = 1;
+		goto err;
+	}
+
+	// Collect the blocks that pass the filters 
+	mem_blk_foreach(ctx, blk)
+	{
+		if (filter != NULL && mem_blk_get_region(blk) != filter)
+			continue;
+
+		if (node >= 0 && mem_blk_get_node(blk) != node)
+			continue;
+
+		blks[num] = blk;
+		ids[num] = mem_blk_get_id(blk);
+		num++;
+	}
+
+	// Nothing to do if no block passes the filters 
+	if (num == 0)
+	{
+		rv = 0;
+		goto err;
+	}
+
+	pages = calloc(num, sizeof(*pages));
+	levels = calloc(num, sizeof(*levels));
+	if (pages == NULL || levels == NULL)
+	{
+		fprintf(stderr, "Error: Out of memory\n");
+		rv = 1;
+		goto err;
+	}
+
+	rv = mem_blk_get_pages_range(ctx, ids, num, pages);
+	if (rv < 0)
+	{
+		fprintf(stderr, "Error: Could not read page flags: %d\n", rv);
+		rv = 1;
+		goto err;
+	}
+
+	// Round the used fraction up to tenths so only empty blocks show 0. 
+	// Blocks without page frames, such as offline blocks, have no level
+	for ( i = 0 ; i < num ; i++ )
+	{
+		levels[i] = -1;
+		if (pages[i].pages > 0)
+			levels[i] = ((pages[i].pages - pages[i].free) * 10 + pages[i].pages - 1) / pages[i].pages;
+	}
+
+	printf("%-16s %6s %5s %-8s %5s %5s  %s\n", "BLOCKS", "NUM", "NODE", "STATE", "USED", "FREE", "MAP");
+
+	// Print runs of consecutive blocks with the same node, state and level
+	for ( i = 0 ; i < num ; i = j )
+	{
+		used = pages[i].pages - pages[i].free;
+		total = pages[i].pages;
+
+		for ( j = i + 1 ; j < num ; j++ )
+		{
+			if (ids[j] != ids[j-1] + 1 
+			    || levels[j] != levels[i]
+			    || mem_blk_get_node(blks[j]) != mem_blk_get_node(blks[i]) 
+			    || mem_blk_is_online(blks[j]) != mem_blk_is_online(blks[i]))
+				break;
+
+			used += pages[j].pages - pages[j].free;
+			total += pages[j].pages;
+		}
+
+		if (j - i == 1)
+			snprintf(range, sizeof(range), "%d", ids[i]);
+		else 
+			snprintf(range, sizeof(range), "%d-%d", ids[i], ids[j-1]);
+
+		printf("%-16s %6d %5d %-8s ", range, j - i, mem_blk_get_node(blks[i]), mem_blk_is_online(blks[i]) ? "online" : "offline");
+
+		if (levels[i] < 0)
+		{
+			printf("%5s %5s  -\n", "-", "-");
+			continue;
+		}
+
+		printf("%4llu%% %4llu%%  ", used * 100 / total, 100 - used * 100 / total);
+		for ( int k = 0 ; k < 10 ; k++ )
+			putchar(k < levels[i] ? '#' : '.');
+		printf("\n");
+	}
+
+	rv = 0;
+
+err:
+
+	if (ids != NULL)
+		free(ids);
+	if (blks != NULL)
+		free(blks);
+	if (pages != NULL)
+		free(pages);
+	if (levels != NULL)
+		free(levels);
+
+	mem_unref(ctx);
+
+end:
+
+	return rv;
+}
+
 int cmd_show_region_blk_state(char *name, int offset)
 {
 	int rv;
@@ -1886,6 +2117,7 @@ int cmd_show_regions(char *name, int human)
 	struct cxl_decoder *d;
 	struct cxl_region **regions, *region;
 	struct cxl_memdev *memdev;
+	struct mem_stats stats;
 	int i, j, num, num_regions;
 
 	rv = 1;
@@ -1939,11 +2171,13 @@ int cmd_show_regions(char *name, int human)
 		else 
 			printf("%14llu  ", cxl_region_get_size(region));
 
+		mem_region_get_stats(ctx, region, &stats);
+
 		printf("%4d  %11d  %10d  %13d  ", 
 			cxl_region_get_interleave_ways(region),
 			cxl_region_get_interleave_granularity(region),
-			mem_region_num_blocks(ctx, region),
-			mem_region_num_blocks_online(ctx, region)
+			stats.blocks,
+			stats.online
 			);
 	
 		num = cxl_region_get_interleave_ways(region);
@@ -2223,6 +2457,10 @@ int run()
 			rv = cmd_show_num_regions();
 			break;
 
+		case CLCM_SHOW_OCCUPANCY:
+			rv = cmd_show_occupancy(opts[CLOP_REGION].str, opts[CLOP_NODE].set ? opts[CLOP_NODE].val : -1);
+			break;
+
 		case CLCM_SHOW_REGION_ISENABLED:
 			rv = cmd_show_region_isenabled(opts[CLOP_REGION].str);
 			break;
@@ -0,0 +1,476 @@
+/**
+ * @file 		fdcache.c
+ *
+ * @brief 		Code file for the open sysfs attribute file descriptor cache
+ *
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date        Jul 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *
+ * Entries are reference counted while a read or write is in progress so a
+ * descriptor is never closed underneath another thread. Lookups and the LRU
+ * list are protected by a single mutex that is not held across the open or
+ * the I/O itself.
+ */
+
+/* INCLUDES ==================================================================*/
+
+/* calloc()
+ * free()
+ * malloc()
+ */
+#include <stdlib.h>
+
+/* strcmp()
+ * strcpy()
+ * strlen()
+ */
+#include <string.h>
+
+/* close()
+ * pread()
+ * pwrite()
+ */
+#include <unistd.h>
+
+/* errno
+ */
+#include <errno.h>
+
+/* openat()
+ * O_RDONLY
+ * O_WRONLY
+ */
+#include <fcntl.h>
+
+/* pthread_mutex_lock()
+ * pthread_mutex_unlock()
+ */
+#include <pthread.h>
+
+#include "fdcache.h"
+
+/* MACROS ====================================================================*/
+
+/* ENUMERATIONS ==============================================================*/
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * One open file descriptor
+ */
+struct fdcache_ent
+{
+	int fd;
+	int dirfd;
+	int flags;
+	int refs;                    // Number of reads / writes using fd
+	int linked;                  // 1 while in the hash table and LRU list
+	unsigned hash;
+	struct fdcache_ent *hnext;   // Next entry in the hash bucket
+	struct fdcache_ent *prev;    // More recently used entry
+	struct fdcache_ent *next;    // Less recently used entry
+	char path[];
+};
+
+/**
+ * File descriptor cache
+ */
+struct fdcache
+{
+	pthread_mutex_t lock;
+	unsigned capacity;
+	unsigned size;
+	unsigned mask;               // Number of hash buckets - 1
+	struct fdcache_ent **buckets;
+	struct fdcache_ent *head;    // Most recently used
+	struct fdcache_ent *tail;    // Least recently used
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+};
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/* PROTOTYPES ================================================================*/
+
+static struct fdcache_ent *fdcache_acquire(struct fdcache *fc, int dirfd, const char *path, int flags, int *fd);
+static void fdcache_evict(struct fdcache *fc, unsigned limit);
+static unsigned fdcache_hash(int dirfd, const char *path, int flags);
+static int fdcache_io(struct fdcache *fc, int dirfd, const char *path, void *buf, unsigned len, int flags);
+static void fdcache_link(struct fdcache *fc, struct fdcache_ent *e);
+static int fdcache_rehash(struct fdcache *fc, unsigned capacity);
+static void fdcache_release(struct fdcache *fc, struct fdcache_ent *e, int fd, int invalidate);
+static void fdcache_unlink(struct fdcache *fc, struct fdcache_ent *e);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Get an open file descriptor for a path
+ *
+ * On a hit the entry is referenced and moved to the head of the LRU list.
+ * On a miss the file is opened and inserted if there is room
+ * @param fd 	set to the descriptor, or a negative errno if the open failed
+ * @return 		the referenced entry. NULL if fd is not cached and must be closed
+ */
+static struct fdcache_ent *fdcache_acquire(struct fdcache *fc, int dirfd, const char *path, int flags, int *fd)
+{
+	int f;
+	unsigned h;
+	struct fdcache_ent *e;
+
+	h = fdcache_hash(dirfd, path, flags);
+
+	pthread_mutex_lock(&fc->lock);
+
+	for (e = fc->buckets[h & fc->mask] ; e != NULL ; e = e->hnext)
+		if (e->hash == h && e->dirfd == dirfd && e->flags == flags && !strcmp(e->path, path))
+			break;
+
+	if (e != NULL)
+	{
+		e->refs++;
+		fdcache_unlink(fc, e);
+		fdcache_link(fc, e);
+		fc->hits++;
+		*fd = e->fd;
+		pthread_mutex_unlock(&fc->lock);
+		return e;
+	}
+
+	fc->misses++;
+
+	pthread_mutex_unlock(&fc->lock);
+
+	f = openat(dirfd, path, flags|O_CLOEXEC);
+	if (f < 0)
+	{
+		*fd = -errno;
+		return NULL;
+	}
+	*fd = f;
+
+	e = malloc(sizeof(*e) + strlen(path) + 1);
+	if (e == NULL)
+		return NULL;
+
+	e->fd = f;
+	e->dirfd = dirfd;
+	e->flags = flags;
+	e->refs = 1;
+	e->hash = h;
+	strcpy(e->path, path);
+
+	// Make room. If every entry is in use the descriptor is not cached.
+	// Two threads that miss on the same path both insert it and the
+	// duplicate simply ages out
+	pthread_mutex_lock(&fc->lock);
+
+	if (fc->size >= fc->capacity)
+		fdcache_evict(fc, fc->capacity > 0 ? fc->capacity - 1 : 0);
+
+	if (fc->size >= fc->capacity)
+	{
+		pthread_mutex_unlock(&fc->lock);
+		free(e);
+		return NULL;
+	}
+
+	fdcache_link(fc, e);
+
+	pthread_mutex_unlock(&fc->lock);
+
+	return e;
+}
+
+/**
+ * Close least recently used descriptors that are not in use until no more
+ * than limit remain. Must be called with the lock held
+ */
+static void fdcache_evict(struct fdcache *fc, unsigned limit)
+{
+	struct fdcache_ent *e, *prev;
+
+	for (e = fc->tail ; e != NULL && fc->size > limit ; e = prev)
+	{
+		prev = e->prev;
+
+		if (e->refs > 0)
+			continue;
+
+		fdcache_unlink(fc, e);
+		close(e->fd);
+		free(e);
+		fc->evictions++;
+	}
+}
+
+/**
+ * Close all descriptors and free the cache
+ */
+void fdcache_free(struct fdcache *fc)
+{
+	struct fdcache_ent *e, *next;
+
+	if (fc == NULL)
+		return;
+
+	for (e = fc->head ; e != NULL ; e = next)
+	{
+		next = e->next;
+		close(e->fd);
+		free(e);
+	}
+
+	if (fc->buckets != NULL)
+		free(fc->buckets);
+
+	pthread_mutex_destroy(&fc->lock);
+
+	free(fc);
+}
+
+/**
+ * Copy the cache counters
+ */
+void fdcache_get_stats(struct fdcache *fc, struct fdcache_stats *stats)
+{
+	pthread_mutex_lock(&fc->lock);
+
+	stats->hits = fc->hits;
+	stats->misses = fc->misses;
+	stats->evictions = fc->evictions;
+	stats->size = fc->size;
+	stats->capacity = fc->capacity;
+
+	pthread_mutex_unlock(&fc->lock);
+}
+
+/**
+ * FNV-1a hash of the lookup key
+ */
+static unsigned fdcache_hash(int dirfd, const char *path, int flags)
+{
+	unsigned h;
+
+	h = 2166136261u ^ (unsigned) dirfd ^ ((unsigned) flags << 16);
+
+	for ( ; *path ; path++ )
+	{
+		h ^= (unsigned char) *path;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/**
+ * Read or write a file at offset 0 through a cached descriptor
+ *
+ * A cached descriptor of a sysfs file that has since been removed returns
+ * ENODEV. It is dropped and the path is opened again once
+ * @return number of bytes transferred. negative errno if an error
+ */
+static int fdcache_io(struct fdcache *fc, int dirfd, const char *path, void *buf, unsigned len, int flags)
+{
+	int rv, fd, tries;
+	struct fdcache_ent *e;
+
+	for ( tries = 0 ; ; tries++ )
+	{
+		e = fdcache_acquire(fc, dirfd, path, flags, &fd);
+		if (fd < 0)
+			return fd;
+
+		if (flags == O_WRONLY)
+			rv = pwrite(fd, buf, len, 0);
+		else
+			rv = pread(fd, buf, len, 0);
+
+		if (rv < 0)
+			rv = -errno;
+
+		fdcache_release(fc, e, fd, rv == -ENODEV);
+
+		if (rv != -ENODEV || e == NULL || tries > 0)
+			return rv;
+	}
+}
+
+/**
+ * Insert an entry at the head of the LRU list and into its hash bucket.
+ * Must be called with the lock held
+ */
+static void fdcache_link(struct fdcache *fc, struct fdcache_ent *e)
+{
+	struct fdcache_ent **b;
+
+	b = &fc->buckets[e->hash & fc->mask];
+	e->hnext = *b;
+	*b = e;
+
+	e->prev = NULL;
+	e->next = fc->head;
+	if (fc->head != NULL)
+		fc->head->prev = e;
+	fc->head = e;
+	if (fc->tail == NULL)
+		fc->tail = e;
+
+	e->linked = 1;
+	fc->size++;
+}
+
+/**
+ * Create a descriptor cache
+ * @param capacity 	maximum number of descriptors to hold open. 0 disables caching
+ * @return 0 upon success. negative errno if an error
+ */
+int fdcache_new(struct fdcache **fc, unsigned capacity)
+{
+	struct fdcache *c;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_init(&c->lock, NULL);
+	c->capacity = capacity;
+
+	if (fdcache_rehash(c, capacity) != 0)
+	{
+		fdcache_free(c);
+		return -ENOMEM;
+	}
+
+	*fc = c;
+
+	return 0;
+}
+
+/**
+ * Read up to len bytes from offset 0 of a file
+ * @return number of bytes read. negative errno if an error
+ */
+int fdcache_pread(struct fdcache *fc, int dirfd, const char *path, char *buf, unsigned len)
+{
+	return fdcache_io(fc, dirfd, path, buf, len, O_RDONLY);
+}
+
+/**
+ * Write len bytes to offset 0 of a file
+ * @return number of bytes written. negative errno if an error
+ */
+int fdcache_pwrite(struct fdcache *fc, int dirfd, const char *path, const char *buf, unsigned len)
+{
+	return fdcache_io(fc, dirfd, path, (void *) buf, len, O_WRONLY);
+}
+
+/**
+ * Resize the hash table to at least capacity buckets. Must be called with
+ * the lock held
+ */
+static int fdcache_rehash(struct fdcache *fc, unsigned capacity)
+{
+	unsigned n;
+	struct fdcache_ent *e, **buckets;
+
+	for ( n = 1 ; n < capacity ; n <<= 1 ) ;
+
+	if (fc->buckets != NULL && n == fc->mask + 1)
+		return 0;
+
+	buckets = calloc(n, sizeof(*buckets));
+	if (buckets == NULL)
+		return -ENOMEM;
+
+	if (fc->buckets != NULL)
+		free(fc->buckets);
+
+	fc->buckets = buckets;
+	fc->mask = n - 1;
+
+	for (e = fc->head ; e != NULL ; e = e->next)
+	{
+		e->hnext = buckets[e->hash & fc->mask];
+		buckets[e->hash & fc->mask] = e;
+	}
+
+	return 0;
+}
+
+/**
+ * Drop the reference taken by fdcache_acquire()
+ * @param invalidate 	1 to remove the entry so it is not handed out again
+ */
+static void fdcache_release(struct fdcache *fc, struct fdcache_ent *e, int fd, int invalidate)
+{
+	if (e == NULL)
+	{
+		close(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&fc->lock);
+
+	e->refs--;
+
+	if (invalidate && e->linked)
+		fdcache_unlink(fc, e);
+
+	if (!e->linked && e->refs == 0)
+	{
+		close(e->fd);
+		free(e);
+	}
+
+	pthread_mutex_unlock(&fc->lock);
+}
+
+/**
+ * Change the maximum number of descriptors held open. Descriptors beyond
+ * the new capacity are closed once they are no longer in use
+ */
+void fdcache_set_capacity(struct fdcache *fc, unsigned capacity)
+{
+	pthread_mutex_lock(&fc->lock);
+
+	fc->capacity = capacity;
+	fdcache_evict(fc, capacity);
+	fdcache_rehash(fc, capacity);
+
+	pthread_mutex_unlock(&fc->lock);
+}
+
+/**
+ * Remove an entry from its hash bucket and the LRU list. Must be called
+ * with the lock held
+ */
+static void fdcache_unlink(struct fdcache *fc, struct fdcache_ent *e)
+{
+	struct fdcache_ent **p;
+
+	for (p = &fc->buckets[e->hash & fc->mask] ; *p != NULL ; p = &(*p)->hnext)
+		if (*p == e)
+		{
+			*p = e->hnext;
+			break;
+		}
+
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		fc->head = e->next;
+
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		fc->tail = e->prev;
+
+	e->hnext = NULL;
+	e->prev = NULL;
+	e->next = NULL;
+	e->linked = 0;
+	fc->size--;
+}
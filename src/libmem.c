@@ -9,6 +9,11 @@
  * @author      Barrett Edwards <code@jrlabs.io>
  */
 
+/* cpu_set_t
+ * sched_setaffinity()
+ */
+#define _GNU_SOURCE
+
 /* INCLUDES ==================================================================*/
 
 /* printf()
@@ -26,6 +31,7 @@
 #include <string.h>
 
 /* open()
+ * openat()
  */
 #include <fcntl.h>
 
@@ -38,10 +44,65 @@
  */
 #include <errno.h>
 
+/* uname()
+ */
+#include <sys/utsname.h>
+
 /* opendir()
+ * fdopendir()
  */
 #include <dirent.h>
 
+/* SYS_getdents64
+ */
+#include <sys/syscall.h>
+
+/* getrlimit()
+ */
+#include <sys/resource.h>
+
+/* socket()
+ * bind()
+ * recv()
+ */
+#include <sys/socket.h>
+
+/* struct sockaddr_nl
+ * NETLINK_KOBJECT_UEVENT
+ */
+#include <linux/netlink.h>
+
+/* poll()
+ */
+#include <poll.h>
+
+/* eventfd()
+ */
+#include <sys/eventfd.h>
+
+/* clock_gettime()
+ * clock_nanosleep()
+ */
+#include <time.h>
+
+/* pthread_create()
+ * pthread_join()
+ */
+#include <pthread.h>
+
+/* CPU_COUNT()
+ * CPU_SET()
+ * CPU_ZERO()
+ * sched_setaffinity()
+ */
+#include <sched.h>
+
+/* pthread_kill()
+ * sigaction()
+ * SIGRTMIN
+ */
+#include <signal.h>
+
 /* LOG_* Macros 
  */
 #include <syslog.h>
@@ -67,16 +128,90 @@
 
 #include "libmem.h"
 
+/* uring_new()
+ * uring_read_batch()
+ */
+#include "uring.h"
+
+/* fdcache_pread()
+ * fdcache_pwrite()
+ */
+#include "fdcache.h"
+
 /* MACROS ====================================================================*/
 
 #define LMLN_SYSFS_ATTR_SIZE 			1024
+#define LMLN_FDCACHE_SIZE 				256
 #define LMLN_FILEPATH 					1024
+#define LMLN_DIRENT_BUF 				32768
+#define LMLN_THREADS_MAX 				64
+#define LMLN_BLOCKS_PER_THREAD 			256
+#define LMLN_URING_ENTRIES 				512
+#define LMLN_URING_BLOCKS 				32
+#define LMLN_BLK_ATTR_PATH 				64
+#define LMLN_UEVENT_BUF 				8192
+#define LMLN_SUBSCRIBERS 				16
+#define LMLN_WAIT_POLL_MIN_MS 			1
+#define LMLN_WAIT_POLL_MAX_MS 			100
+#define LMLN_WAIT_RECHECK_MS 			1000
+#define LMLN_NODES_MAX 					1024
+#define LMLN_KPF_CHUNK 					32768
+#define LMLN_COST_UNMOVABLE 			512
+#define LMLN_KPF_BLOCKS_PER_THREAD 		8
+#define LMLN_IDLE_CHUNK 				32768
+#define LMLN_RETRY_MIN_MS 				10
+#define LMLN_RETRY_MAX_MS 				1000
+#define LMLN_OFFLINE_TIMEOUT_MS 		10000
+#define LMLN_OP_KILL_MS 				10
+#define LMLN_BUDDY_ORDERS 				24
+#define LMLN_LEASE_LINE 				256
 #define LMFP_MEM_DIR    				"/sys/devices/system/memory"
+#define LMFP_NODE_DIR    				"/sys/devices/system/node"
+#define LMFP_MEMMAP_ON_MEMORY			"/sys/module/memory_hotplug/parameters/memmap_on_memory"
+#define LMFP_KPAGEFLAGS 				"/proc/kpageflags"
+#define LMFP_KPAGECOUNT 				"/proc/kpagecount"
+#define LMFP_PAGE_IDLE 					"/sys/kernel/mm/page_idle/bitmap"
+
+/* Signal sent to interrupt the state write of an asynchronous operation */
+#define LMOP_SIGNAL 					(SIGRTMIN + 4)
+
+/* Bits of a /proc/kpageflags entry */
+#define LMKF_LRU 						(1ULL << 5)   // On an LRU list
+#define LMKF_SLAB 						(1ULL << 7)   // Slab allocator page
+#define LMKF_BUDDY 						(1ULL << 10)  // Head page of a free buddy block
+#define LMKF_HUGE 						(1ULL << 17)  // Page of a hugetlbfs huge page
+#define LMKF_NOPAGE 					(1ULL << 20)  // No page frame exists at the address
+#define LMKF_THP 						(1ULL << 22)  // Page of a transparent huge page
 
 /* ENUMERATIONS ==============================================================*/
 
+/**
+ * Memory block sysfs attributes loaded into struct mem_blk
+ */
+enum LMBA
+{
+	LMBA_ONLINE 		= 0,
+	LMBA_PHYS_DEVICE 	= 1,
+	LMBA_REMOVABLE 		= 2,
+	LMBA_STATE 			= 3,
+	LMBA_VALID_ZONES 	= 4,
+	LMBA_MAX
+};
+
 /* STRUCTS ===================================================================*/
 
+/**
+ * Directory entry returned by the getdents64 system call 
+ */
+struct mem_dirent64
+{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
 /**
  * Object representing a kernel memory block 
  */
@@ -92,6 +227,214 @@ struct mem_blk
 	struct mem_ctx *ctx;
 };
 
+/**
+ * Range of memory block ids [first, end) that belong to one NUMA node
+ */
+struct mem_nrange
+{
+	int first;
+	int end;
+	int node;
+};
+
+/**
+ * Slice of the blocks array [first, end) loaded by one enumeration worker
+ */
+struct mem_blk_job
+{
+	struct mem_ctx *ctx;
+	int first;
+	int end;
+};
+
+/**
+ * Blocks [first, end) of a mem_op_run() item array that are on one NUMA node
+ */
+struct mem_op_group
+{
+	int node;
+	int first;
+	int end;
+	int next;                   // Next item to claim. Updated atomically by the workers
+	int pin;                    // 1 if cpus is not empty
+	cpu_set_t cpus;             // CPUs of the node, or of the nearest node with CPUs
+};
+
+/**
+ * Journal entry of a block whose state was changed by a transaction
+ */
+struct mem_op_jent
+{
+	struct mem_blk *blk;
+	int prev;                   // [LMPL] State that restores the block. See mem_blk_restore_state()
+	struct mem_blk_result *res;
+};
+
+/**
+ * One block of a mem_op_run() call and where its outcome is stored
+ */
+struct mem_op_item
+{
+	int pos;                    // Index of the block in the array passed to mem_op_run()
+	struct mem_blk *blk;
+	struct mem_blk_result *res;
+};
+
+/**
+ * State shared by the workers of one mem_op_run() call
+ */
+struct mem_op_job
+{
+	int state;                  // [LMPL] Target state
+	int flags;                  // Bitfield of LMSR masks
+	int retry;                  // 1 to retry EBUSY and EAGAIN
+	unsigned long long deadline;// CLOCK_MONOTONIC ns after which no block is started or retried. 0 for none
+	int abort;                  // Set once a block of a transaction fails. Updated atomically
+	int num_journal;            // Updated atomically by the workers
+	struct mem_op_jent *journal;// State changes made by a transaction
+	int num_groups;
+	struct mem_op_group *groups;
+	struct mem_op_item *items;  // Sorted by node then block id
+};
+
+/**
+ * Asynchronous block state change started by mem_op_submit()
+ *
+ * The blocks are changed in order on a worker thread. A watchdog thread 
+ * interrupts the worker with LMOP_SIGNAL once the operation is cancelled 
+ * or its deadline passes
+ */
+struct mem_op
+{
+	struct mem_ctx *ctx;        // Referenced until mem_op_free()
+	int state;                  // [LMPL] Target state
+	int num;
+	struct mem_blk_result *results;  // In submission order
+	unsigned long long deadline;// CLOCK_MONOTONIC ns. 0 for none
+	int evfd;                   // eventfd signaled when the operation completes
+	int stop;                   // -ECANCELED or -ETIMEDOUT once the operation must stop. 0 otherwise
+	int inwrite;                // 1 while the worker is in a state write
+	int done;                   // 1 once every block has a result
+	int watching;               // 1 if the watchdog thread was started
+	pthread_t worker;
+	pthread_t watchdog;
+	pthread_mutex_t lock;       // Protects stop, inwrite and done
+	pthread_cond_t cond;        // Broadcast on cancel and completion
+};
+
+/**
+ * Buddy free map of the offline, unleased blocks of one NUMA node and region
+ *
+ * Pools cover a block id range [first, end) of a node that is either inside 
+ * one region or outside of all regions. Free chunks of order k hold 2^k 
+ * blocks and start at a block id aligned to 2^k so runs handed out are 
+ * also aligned in physical address 
+ */
+struct mem_pool
+{
+	int first;
+	int end;
+	int node;
+	struct cxl_region *region;  // NULL if the range is not part of a region
+	int free;                   // Number of free blocks
+	signed char *order;         // Order of the free chunk starting at each id - first. -1 if none
+	int *next;                  // Free list links indexed by id - first
+	int *prev;
+	int head[LMLN_BUDDY_ORDERS];// First block id of a free chunk of each order. -1 if none
+};
+
+/**
+ * Memory block and its migration cost 
+ */
+struct mem_blk_cost
+{
+	struct mem_blk *blk;
+	int pos;                    // Index of the block in the caller array. Breaks ties
+	long long cost;             // Migration cost score. -1 if the block does not exist
+};
+
+/**
+ * Open /proc page tables and the buffers one scan reads them into 
+ */
+struct mem_kpf
+{
+	int flags_fd;               // /proc/kpageflags
+	int count_fd;               // /proc/kpagecount. -1 if not readable
+	unsigned long long *flags;  // LMLN_KPF_CHUNK entries plus padding to a whole vector
+	unsigned long long *counts;
+};
+
+/**
+ * Four kpageflags entries classified at once with GCC vector extensions
+ */
+typedef unsigned long long mem_kpf_vec __attribute__((vector_size(32)));
+
+/**
+ * Slice of the blocks [first, end) scanned by one page table worker
+ */
+struct mem_kpf_job
+{
+	struct mem_ctx *ctx;
+	struct mem_blk **blks;      // NULL entries are skipped
+	struct mem_blk_pages *pages;
+	int first;
+	int end;
+	int failed;                 // Blocks that could not be scanned
+	int rv;                     // Negative errno if the page tables could not be opened
+};
+
+#define LMLN_KPF_LANES 					(sizeof(mem_kpf_vec) / sizeof(unsigned long long))
+
+/**
+ * Worker thread of a mem_op_run() call
+ */
+struct mem_op_thread
+{
+	struct mem_op_job *op;
+	int home;                   // Index of the group the worker starts on
+	int pin;                    // 1 to pin the worker to the CPUs of each group it works on
+	pthread_t tid;
+};
+
+/**
+ * Event subscription registered with mem_events_subscribe()
+ */
+struct mem_sub
+{
+	mem_event_fn fn;            // NULL if the slot is free
+	void *arg;
+	unsigned mask;              // Bitfield of LMEM masks 
+};
+
+/**
+ * Immutable facts about the memory system 
+ *
+ * These are read from sysfs once per context and only reloaded by 
+ * mem_refresh() with LMRF_SYSTEM
+ */
+struct mem_sys
+{
+	int loaded;
+	unsigned long long block_size;
+	int kernel_major;
+	int kernel_minor;
+	int memmap_on_memory;       // Value of memory_hotplug.memmap_on_memory. -1 if not present
+	unsigned long features;     // Bitfield of present sysfs features [LMFT]
+};
+
+/**
+ * Entry of the region interval index 
+ *
+ * The range is stored in memory block ids [first, end) so a block can be 
+ * matched to a region without knowing the system block size
+ */
+struct mem_rgn
+{
+	int first;
+	int end;
+	struct cxl_region *region;
+};
+
 /**
  * Memory library context
  */
@@ -99,15 +442,53 @@ struct mem_ctx
 {
 	struct log_ctx *log;  // Must be first for mem_set_log_fn
 	int refcount;
+	int memfd;                  // Held directory fd of LMFP_MEM_DIR. -1 if not open
+	int threads;                // Number of worker threads for block enumeration
+	int io_uring;               // Batch block attribute reads with io_uring when available
+	int online_threads;         // Concurrency limit for parallel block onlining
+	int offline_threads;        // Concurrency limit for parallel block offlining
+	struct fdcache *fdc;        // Open sysfs attribute descriptors
+	unsigned fdc_size;          // Capacity of fdc
+	int fdc_fixed;              // 1 once mem_fdcache_set_size() was called
+	pthread_mutex_t lock;       // Serializes block table changes with the event listener
+	int evfd;                   // uevent socket. -1 if the listener is not running
+	int evown;                  // 1 if evfd was opened by the library
+	int evstop;                 // eventfd that tells the listener to exit
+	pthread_t evthread;
+	int pending;                // LMRF masks queued by the listener for the caller thread
+	pthread_cond_t cond;        // Broadcast after the listener applies an event
+	unsigned long evseq;        // Number of events applied by the listener
+	int evnotify;               // Non-blocking eventfd signaled after each applied event. -1 if not created
+	struct mem_sub subs[LMLN_SUBSCRIBERS];
 	int num;
+	char *lease_path;           // State file of the lease manager. NULL if not persisted
+	int lease_open;             // 1 after mem_lease_open()
+	int lease_stale;            // 1 if the pools must be rebuilt before use
+	unsigned long lease_seq;    // Event sequence number the pools were built at
+	int num_leases;
+	struct mem_lease *leases;
+	int num_pools;
+	struct mem_pool *pools;
 	int num_regions;
+	int max_id;
+	int *index;                 // Dense table of block id -> index into blocks
 	struct mem_blk *blocks;
 	struct cxl_ctx *cxl;
 	struct cxl_region **regions;
+	int num_rgns;
+	struct mem_rgn *rgns;       // Region interval index sorted by first block id
+	int num_nranges;
+	struct mem_nrange *nranges; // Node block id ranges sorted by first block id
+	struct mem_sys sys;
 };
 
 /* GLOBAL VARIABLES ==========================================================*/
 
+/**
+ * Installs the LMOP_SIGNAL handler once per process
+ */
+static pthread_once_t mem_op_once = PTHREAD_ONCE_INIT;
+
 /**
  * String representtaion of enum _LMPL
  */
@@ -141,19 +522,120 @@ const char *_LMZN[] =
 	"none",
 };
 
+/**
+ * File names of enum LMBA
+ */
+static const char *_LMBA[] = 
+{
+	"online",
+	"phys_device",
+	"removable",
+	"state",
+	"valid_zones",
+};
+
 /* PROTOTYPES ================================================================*/
 
 // Static methods for sysfs read / write 
 static int mem_sysfs_read(struct mem_ctx *ctx, const char *path, char *buf);
+static int mem_sysfs_readat(struct mem_ctx *ctx, int dirfd, const char *path, char *buf, int cache);
 static int mem_sysfs_write(struct mem_ctx *ctx, const char *path, const char *buf);
+static int mem_sysfs_writeat(struct mem_ctx *ctx, int dirfd, const char *path, const char *buf);
 
 // Compare functions for qsort
 int mem_compare_cxl_memdevs(const void* a, const void* b);
 int mem_compare_cxl_regions(const void* a, const void* b);
 int mem_compare_ints(const void* a, const void* b);
 int mem_compare_mem_blks(const void* a, const void* b);
+int mem_compare_mem_blk_costs(const void* a, const void* b);
+int mem_compare_mem_blk_results(const void* a, const void* b);
+int mem_compare_mem_nranges(const void* a, const void* b);
+int mem_compare_mem_op_items(const void* a, const void* b);
+int mem_compare_mem_rgns(const void* a, const void* b);
 
 static int mem_blk_init(struct mem_ctx *ctx);
+static int mem_blk_init_index(struct mem_ctx *ctx, int *ids, int num);
+static int mem_blk_find_node(struct mem_blk *blk);
+static int mem_blk_load(struct mem_blk *blk);
+static int mem_blk_reindex(struct mem_ctx *ctx);
+static int mem_blk_rescan(struct mem_ctx *ctx);
+static int mem_blk_restore_state(struct mem_blk *blk, int lock);
+static int mem_blk_scan(struct mem_blk *blk, struct mem_kpf *kpf, struct mem_blk_pages *pages);
+static int mem_blk_verify(struct mem_blk *blk, int online);
+static int mem_blk_write(struct mem_blk *blk, const char *attr, const char *buf);
+static int mem_blkid_apply_state(struct mem_ctx *ctx, int id, int state, int lock, unsigned long long *ns);
+static struct mem_blk *mem_blkid_find(struct mem_ctx *ctx, int id);
+static int mem_blkid_write(struct mem_ctx *ctx, int id, const char *attr, const char *buf);
+static void *mem_blk_load_worker(void *arg);
+static void mem_blk_load_all(struct mem_ctx *ctx);
+static int mem_blk_load_batch(struct mem_ctx *ctx, struct uring *ur, int first, int end);
+static void mem_blk_parse(struct mem_blk *blk, int attr, char *buf);
+static int mem_blk_pick_runs(struct mem_blk **cands, int num, int need, int tail, struct mem_blk **pick);
+static int mem_blk_scan_dir(struct mem_ctx *ctx, int dirfd, int type, int **ids);
+// Kernel uevent listener
+static void mem_events_handle(struct mem_ctx *ctx, char *buf, int len);
+static void *mem_events_listen(void *arg);
+static unsigned long mem_events_seq(struct mem_ctx *ctx);
+static int mem_events_wait(struct mem_ctx *ctx, unsigned long seq, const struct timespec *until, int *delay);
+static void mem_events_deadline(struct timespec *ts, int timeout_ms);
+
+static unsigned mem_fdcache_limit(void);
+static void mem_fdcache_resize(struct mem_ctx *ctx);
+
+// Idle page tracking 
+static int mem_idle_sample(struct mem_ctx *ctx, int *ids, int num, int interval_ms, unsigned long long *idle);
+static unsigned long long mem_popcount(const unsigned long long *words, unsigned long long num);
+
+// /proc page table scanner 
+static void mem_kpf_close(struct mem_kpf *kpf);
+static int mem_kpf_open(struct mem_ctx *ctx, struct mem_kpf *kpf);
+static void *mem_kpf_worker(void *arg);
+
+// Block lease manager 
+static int mem_lease_save(struct mem_ctx *ctx);
+static int mem_lease_sync(struct mem_ctx *ctx);
+static void mem_pool_add(struct mem_pool *p, int id, int order);
+static int mem_pool_alloc(struct mem_pool *p, int order);
+static void mem_pool_del(struct mem_pool *p, int id);
+static struct mem_pool *mem_pool_find(struct mem_ctx *ctx, int id);
+static void mem_pool_free(struct mem_pool *p, int id, int order);
+static void mem_pools_free(struct mem_ctx *ctx);
+static int mem_pools_init(struct mem_ctx *ctx);
+static int mem_list_parse(const char *buf, int *ids, int max);
+static int mem_memfd(struct mem_ctx *ctx);
+static unsigned long long mem_now_ns(void);
+
+// Node block id ranges 
+static void mem_node_assign(struct mem_ctx *ctx);
+static int mem_node_cpulist(struct mem_ctx *ctx, int node, cpu_set_t *set);
+static int mem_node_cpus(struct mem_ctx *ctx, int node, cpu_set_t *set);
+static void mem_node_free(struct mem_ctx *ctx);
+static int mem_node_init(struct mem_ctx *ctx);
+static int mem_node_rebuild(struct mem_ctx *ctx);
+
+// Asynchronous block state changes 
+static void *mem_op_async(void *arg);
+static int mem_op_async_blk(struct mem_op *op, struct mem_blk_result *res);
+static void mem_op_signal(int sig);
+static void mem_op_signal_init(void);
+static void *mem_op_watchdog(void *arg);
+
+// Parallel block state changes 
+static void mem_op_item_run(struct mem_op_job *op, struct mem_op_item *item);
+static int mem_op_rollback(struct mem_ctx *ctx, struct mem_op_jent *journal, int num);
+static int mem_op_run(struct mem_ctx *ctx, struct mem_blk **blks, int num, int state, int threads, int timeout_ms, int flags, struct mem_blk_result *results, struct mem_op_stats *stats);
+static void *mem_op_worker(void *arg);
+
+// Region interval index
+static struct mem_rgn *mem_region_index_find(struct mem_ctx *ctx, int id);
+static void mem_region_index_free(struct mem_ctx *ctx);
+static struct mem_rgn *mem_region_index_get(struct mem_ctx *ctx, struct cxl_region *region);
+static int mem_region_index_init(struct mem_ctx *ctx);
+static void mem_regions_invalidate(struct mem_ctx *ctx);
+
+static int mem_system_init(struct mem_ctx *ctx);
+
+static void mem_stats_fill(struct mem_stats *stats, struct mem_blk *blk, int num, unsigned long long block_size);
 
 /* FUNCTIONS =================================================================*/
 
@@ -162,6 +644,38 @@ int mem_blk_get_device(struct mem_blk *blk)
 	return blk->device;
 }
 
+/**
+ * Find the NUMA node of a single memory block from its nodeX link
+ * @return the node. -1 if the block has no node link
+ */
+static int mem_blk_find_node(struct mem_blk *blk)
+{
+	int node, fd;
+	DIR *d;
+  	struct dirent *e; 
+	char path[LMLN_FILEPATH];
+
+	node = -1;
+
+	sprintf(path, "memory%d", blk->id);
+	fd = openat(mem_memfd(blk->ctx), path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	d = fdopendir(fd);
+	if (d == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	for (e = readdir(d) ; e != NULL ; e = readdir(d))
+		if (e->d_type == DT_LNK && sscanf(e->d_name, "node%d", &node) == 1)
+			break;
+
+	closedir(d);
+
+	return node;
+}
+
 /**
  * Get the first memory block in the system 
  */
@@ -174,7 +688,9 @@ struct mem_blk *mem_blk_get_first(struct mem_ctx *ctx)
 
 	if (ctx->blocks == NULL)
 	{
+		pthread_mutex_lock(&ctx->lock);
 		rv = mem_blk_init(ctx);
+		pthread_mutex_unlock(&ctx->lock);
 		if (rv != 0)
 		{
 			err(ctx, "mem_blk_init() failed: %d", rv);
@@ -195,25 +711,66 @@ int mem_blk_get_id(struct mem_blk *blk)
 	return blk->id;
 }
 
+/**
+ * Measure the idle memory of a list of memory blocks 
+ *
+ * Every page of the blocks is marked idle, then after interval_ms the pages 
+ * that were not accessed are counted. Only user pages on an LRU list can be
+ * tracked so kernel memory always counts as in use. Pages that are free in
+ * the buddy allocator at the end of the interval are counted as idle from
+ * /proc/kpageflags. Offline blocks report 0
+ * @param ids 			array of block ids 
+ * @param interval_ms 	time the pages are left to be accessed 
+ * @param idle 			array of num idle byte counts in the same order as ids
+ * @return 0 upon success, the number of ids without a memory block, or negative errno
+ */
+int mem_blk_get_idle_range(struct mem_ctx *ctx, int *ids, int num, int interval_ms, unsigned long long *idle)
+{
+	int rv, ret, i, *sel;
+	struct mem_blk *blk;
+
+	// Validate inputs 
+	if (ctx == NULL || ids == NULL || idle == NULL || num < 0 || interval_ms < 0)
+		return -EINVAL;
+
+	sel = malloc(num * sizeof(*sel));
+	if (sel == NULL && num > 0)
+		return -ENOMEM;
+
+	// Only ids without a block are not sampled. Offline blocks have no 
+	// page frames to track
+	rv = 0;
+	for ( i = 0 ; i < num ; i++ )
+	{
+		blk = mem_blkid_get_blk(ctx, ids[i]);
+		sel[i] = (blk != NULL && blk->online) ? ids[i] : -1;
+		if (blk == NULL)
+			rv++;
+	}
+
+	ret = mem_idle_sample(ctx, sel, num, interval_ms, idle);
+	if (ret < 0)
+		rv = ret;
+
+	free(sel);
+
+	return rv;
+}
+
 /**
  * Get the next memory block in the system 
  */
 struct mem_blk *mem_blk_get_next(struct mem_blk *blk)
 {
-	int i;
 	struct mem_ctx *ctx;
 	struct mem_blk *next; 
 
 	ctx = blk->ctx;
 	next = NULL; 
 
-	for ( i = 0 ; i < ctx->num ; i++ )
-		if (blk->id == ctx->blocks[i].id)
-			break;
-	i++; 
-
-	if (i < ctx->num)
-		next = &ctx->blocks[i];
+	// The blocks array is sorted by id so the next block is adjacent 
+	if (blk + 1 < ctx->blocks + ctx->num)
+		next = blk + 1;
 
 	return next; 
 }
@@ -223,69 +780,135 @@ int mem_blk_get_node(struct mem_blk *blk)
 	return blk->node;
 }
 
-struct cxl_region *mem_blk_get_region(struct mem_blk *blk)
+/**
+ * Count the pages of a memory block by class and score its migration cost
+ *
+ * The block is scanned through /proc/kpageflags, which needs CAP_SYS_ADMIN.
+ * Offline blocks report no pages in use
+ * @param pages 	set to the page counts 
+ * @return 0 upon success, negative errno otherwise
+ */
+int mem_blk_get_pages(struct mem_blk *blk, struct mem_blk_pages *pages)
 {
-	int num;
-	struct cxl_region *region, **regions;
-	struct mem_ctx *ctx;
-	unsigned long long block_size, base, size, end, addr;
-
-	ctx = blk->ctx;
-	region = NULL;
-	num = mem_num_regions(ctx);
+	int rv;
+	struct mem_kpf kpf;
 
-	// If there are no regions then return null
-	if (num == 0)
-		goto end;
+	if (blk == NULL || pages == NULL)
+		return -EINVAL;
 
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
+	rv = mem_kpf_open(blk->ctx, &kpf);
+	if (rv != 0)
 	{
-		err(ctx, "Unable to read system memory block size");
-		goto end;
+		err(blk->ctx, "Unable to read the pages of memory block %d: %d", blk->id, rv);
+		return rv;
 	}
-	addr = block_size * blk->id;			
 
-	regions = mem_get_regions(ctx);	
-	if (regions == NULL)
+	rv = mem_blk_scan(blk, &kpf, pages);
+
+	mem_kpf_close(&kpf);
+
+	return rv;
+}
+
+/**
+ * Scan the pages of a list of memory blocks in parallel 
+ *
+ * The list is split into contiguous slices scanned by up to one worker 
+ * thread per online CPU, each with its own page table descriptors and 
+ * buffers. Blocks that do not exist or cannot be read report zero pages
+ * @param ids 		array of block ids 
+ * @param pages 	array of num page counts in the same order as ids
+ * @return 0 upon success, the number of blocks not scanned, or negative errno
+ */
+int mem_blk_get_pages_range(struct mem_ctx *ctx, int *ids, int num, struct mem_blk_pages *pages)
+{
+	int rv, i, n, created;
+	long cpus;
+	struct mem_blk **blks;
+	pthread_t tids[LMLN_THREADS_MAX];
+	struct mem_kpf_job jobs[LMLN_THREADS_MAX];
+
+	// Validate inputs 
+	if (ctx == NULL || ids == NULL || pages == NULL || num < 0)
+		return -EINVAL;
+
+	// Resolve the ids on the calling thread so workers never take the lock
+	blks = malloc(num * sizeof(*blks));
+	if (blks == NULL && num > 0)
+		return -ENOMEM;
+
+	for ( i = 0 ; i < num ; i++ )
+		blks[i] = mem_blkid_get_blk(ctx, ids[i]);
+
+	// Determine the number of workers 
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = (num + LMLN_KPF_BLOCKS_PER_THREAD - 1) / LMLN_KPF_BLOCKS_PER_THREAD;
+	if (n > cpus)
+		n = cpus;
+	if (n > LMLN_THREADS_MAX)
+		n = LMLN_THREADS_MAX;
+	if (n < 1)
+		n = 1;
+
+	for ( i = 0 ; i < n ; i++ )
 	{
-		err(ctx, "Could not obtain regions");
-		goto end;	
+		jobs[i].ctx = ctx;
+		jobs[i].blks = blks;
+		jobs[i].pages = pages;
+		jobs[i].first = (int) ((long) num * i / n);
+		jobs[i].end = (int) ((long) num * (i + 1) / n);
+		jobs[i].failed = 0;
+		jobs[i].rv = 0;
 	}
 
-	for ( int i = 0 ; i < num ; i++)
+	// Slice 0 runs on the calling thread 
+	created = 1;
+	for ( i = 1 ; i < n ; i++ )
 	{
-		region = regions[i];
+		if (pthread_create(&tids[i], NULL, mem_kpf_worker, &jobs[i]) != 0)
+			break;
+		created++;
+	}
 
-		// Get region base address 
-		base = cxl_region_get_resource(region);
-		if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
-		{
-			num = 0;
-			err(ctx, "Unable to get cxl region %s resource address", cxl_region_get_devname(region));
-			goto end;
-		}
+	for ( i = created ; i < n ; i++ )
+		mem_kpf_worker(&jobs[i]);
 
-		// Get region size in bytes 
-		size = cxl_region_get_size(region);
-		if (size == 0)
+	mem_kpf_worker(&jobs[0]);
+
+	for ( i = 1 ; i < created ; i++ )
+		pthread_join(tids[i], NULL);
+
+	rv = 0;
+	for ( i = 0 ; i < n ; i++ )
+	{
+		if (jobs[i].rv != 0)
 		{
-			num = 0;
-			warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
-			goto end;
+			rv = jobs[i].rv;
+			break;
 		}
-		end = base + size;
-
-		if (base <= addr && addr < end )
-			goto end;
+		rv += jobs[i].failed;
 	}
 
-	region = NULL;
+	info(ctx, "Scanned the pages of %d memory blocks with %d threads", num, created);
 
-end:
+	free(blks);
 
-	return region;
+	return rv;
+}
+
+/**
+ * Get the cxl_region that contains a memory block 
+ * @return struct cxl_region* or NULL if the block is not part of a region
+ */
+struct cxl_region *mem_blk_get_region(struct mem_blk *blk)
+{
+	struct mem_rgn *rgn;
+
+	rgn = mem_region_index_find(blk->ctx, blk->id);
+	if (rgn == NULL)
+		return NULL;
+
+	return rgn->region;
 }
 
 int mem_blk_get_state(struct mem_blk *blk)
@@ -314,19 +937,21 @@ unsigned long mem_blk_get_zones(struct mem_blk *blk)
 	return blk->valid_zones;
 }
 
+/**
+ * Enumerate the memory blocks of the system into the context
+ *
+ * The memory directory is listed once with getdents64 and every attribute 
+ * is opened relative to the held directory fd so each lookup only resolves
+ * the last two path components
+ */
 static int mem_blk_init(struct mem_ctx *ctx)
 {
-	int rv, i, num, index;
-	DIR *d;
-  	struct dirent *e; 
-	struct mem_blk *mb;
-	char path[LMLN_FILEPATH];
-	char buf[LMLN_FILEPATH];
+	int rv, num, fd;
+	int *ids;
 
 	// Initialize variables 
 	rv = 1;
-	num = 0;
-	i = 0;
+	ids = NULL;
 
 	// Validate inputs 
 	// Skip if the blocks array has already been initialized 
@@ -336,96 +961,110 @@ static int mem_blk_init(struct mem_ctx *ctx)
 		goto end;
 	}
 
-	// 1: Count the number of memory directories
-
 	// Open the directory 
-	d = opendir(LMFP_MEM_DIR);	
-	if (d == NULL)
+	fd = mem_memfd(ctx);
+	if (fd < 0)
 	{
 		err(ctx, "Could not open memory directory for enumeration: %s", LMFP_MEM_DIR);
 		goto end;
 	}
 
-	// Walk the directory tree and get the block index numbers 
-	for (e = readdir(d) ; e != NULL ; e = readdir(d))
-		if (e->d_type == DT_DIR && sscanf(e->d_name, "memory%d", &index) == 1)
-			num++;
+	// 1: Get the block index numbers in a single pass of the directory
+	num = mem_blk_scan_dir(ctx, fd, DT_DIR, &ids);
+	if (num < 0)
+	{
+		err(ctx, "Could not list memory directory: %s %d", LMFP_MEM_DIR, num);
+		goto end;
+	}
 
 	// Allocate array for mem_blks 
 	ctx->blocks = calloc(num, sizeof(struct mem_blk));
+	if (ctx->blocks == NULL && num > 0)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
 	ctx->num = num;
+	mem_fdcache_resize(ctx);
 
 	info(ctx, "Found %d Memory Blocks", num);
 
-	// Populate the mem_blk array 
-	rewinddir(d);
-
-	// Walk the directory tree and get the block index numbers 
-	for (e = readdir(d) ; e != NULL ; e = readdir(d))
-		if (e->d_type == DT_DIR && sscanf(e->d_name, "memory%d", &index) == 1)
-		{
-			mb = &ctx->blocks[i++];
-			mb->ctx = ctx;	
-			mb->id = index;
-
-			{
-				// Open memory directory to search for node link 
-				DIR *d2;	
-  				struct dirent *e2; 
-				mb->node = -1;
-				sprintf(path, "%s/%s", LMFP_MEM_DIR, e->d_name);							
-				d2 = opendir(path);
-				if (d2 != NULL)
-					for (e2 = readdir(d2) ; e2 != NULL ; e2 = readdir(d2))
-						if (e2->d_type == DT_LNK && !strncmp("node", e2->d_name, 4))
-							sscanf(e2->d_name, "node%d", &mb->node);
-			}
-
-			sprintf(path, "%s/%s/online", LMFP_MEM_DIR, e->d_name);
-			if (mem_sysfs_read(ctx, path, buf) > 0)
-				mb->online = strtoul(buf, NULL, 0);
-				
-			sprintf(path, "%s/%s/phys_device", LMFP_MEM_DIR, e->d_name);
-			if (mem_sysfs_read(ctx, path, buf) > 0)
-				mb->device = strtoul(buf, NULL, 0);
-				
-			sprintf(path, "%s/%s/removable", LMFP_MEM_DIR, e->d_name);
-			if (mem_sysfs_read(ctx, path, buf) > 0)
-				mb->removable = strtoul(buf, NULL, 0);
-
-			sprintf(path, "%s/%s/state", LMFP_MEM_DIR, e->d_name);
-			if (mem_sysfs_read(ctx, path, buf) > 0)
-				for ( int j = 0 ; j < LMZN_MAX ; j++)
-					if (!strcmp(buf, mem_lmst(j)))
-					{
-						mb->state = j;
-						break;
-					}
-
-			sprintf(path, "%s/%s/valid_zones", LMFP_MEM_DIR, e->d_name);
-			if (mem_sysfs_read(ctx, path, buf) > 0)
-    		{
-				char *state = NULL;
-				mb->valid_zones = 0;
-				for (char *t = strtok_r(buf, " ", &state); t ; t = strtok_r(NULL, " ", &state))
-   					for ( int j = 0 ; j < LMZN_MAX ; j++ )
-   						if (!strcmp(t, mem_lmzn(j)))
-   							mb->valid_zones |= (0x01 << j);
-			}
-		}
+	// 2: Build the id to index lookup table which places each id at its slot
+	rv = mem_blk_init_index(ctx, ids, num);
+	if (rv != 0)
+	{
+		err(ctx, "Unable to build memory block index table: %d", rv);
+		goto end;
+	}
 
-	closedir(d);
+	// 3: Populate the mem_blk array 
+	mem_blk_load_all(ctx);
 
-	// Sort the array
-	qsort(ctx->blocks, ctx->num, sizeof(struct mem_blk), mem_compare_mem_blks);
+	// 4: Assign NUMA nodes from the node directory sweep
+	if (mem_node_init(ctx) == 0)
+		mem_node_assign(ctx);
+	else 
+		warn(ctx, "Unable to map memory blocks to NUMA nodes");
 
 	rv = 0;
 
 end:
 
+	if (ids != NULL)
+		free(ids);
+
 	return rv;
 }
 
+/**
+ * Build the dense block id to index table from an unsorted list of ids
+ *
+ * Ids are marked in the table and then numbered in ascending order, which 
+ * gives every block its sorted slot in the blocks array without a sort
+ */
+static int mem_blk_init_index(struct mem_ctx *ctx, int *ids, int num)
+{
+	int i, slot;
+
+	if (ctx->index != NULL)
+		free(ctx->index);
+
+	ctx->index = NULL;
+	ctx->max_id = -1;
+
+	if (num <= 0)
+		return 0;
+
+	for ( i = 0 ; i < num ; i++ )
+		if (ids[i] > ctx->max_id)
+			ctx->max_id = ids[i];
+
+	ctx->index = malloc((ctx->max_id + 1) * sizeof(int));
+	if (ctx->index == NULL)
+		return -ENOMEM;
+
+	for ( i = 0 ; i <= ctx->max_id ; i++ )
+		ctx->index[i] = -1;
+
+	for ( i = 0 ; i < num ; i++ )
+		ctx->index[ids[i]] = 0;
+
+	slot = 0;
+	for ( i = 0 ; i <= ctx->max_id ; i++ )
+	{
+		if (ctx->index[i] < 0)
+			continue;
+
+		ctx->index[i] = slot;
+		ctx->blocks[slot].ctx = ctx;
+		ctx->blocks[slot].id = i;
+		ctx->blocks[slot].node = -1;
+		slot++;
+	}
+
+	return 0;
+}
+
 int mem_blk_is_online(struct mem_blk *blk)
 {
 	return blk->online;
@@ -437,53 +1076,258 @@ int mem_blk_is_removable(struct mem_blk *blk)
 }
 
 /**
- * Offline a memory block
+ * Read the sysfs attributes of a memory block 
+ * @return the number of attributes that could not be read
  */
-int mem_blk_offline(struct mem_blk *blk)
+static int mem_blk_load(struct mem_blk *blk)
 {
-	int rv, ret, index, state;
-	DIR *d;
-	char path[LMLN_FILEPATH];
-  	struct dirent *e; 
+	int rv, fd, i;
 	struct mem_ctx *ctx;
+	char path[LMLN_FILEPATH];
+	char buf[LMLN_SYSFS_ATTR_SIZE];
 
 	// Initialize variables 
 	rv = 0;
 	ctx = blk->ctx;
+	fd = mem_memfd(ctx);
 
-    // Open the directory 
-	d = opendir(LMFP_MEM_DIR);	
-	if (d == NULL)
+	for ( i = 0 ; i < LMBA_MAX ; i++ )
 	{
-		err(ctx, "Could not open memory directory for enumeration: %s", LMFP_MEM_DIR);
-		rv = 1;
-		goto end;
+		sprintf(path, "memory%d/%s", blk->id, _LMBA[i]);
+		if (mem_sysfs_readat(ctx, fd, path, buf, 0) > 0)
+			mem_blk_parse(blk, i, buf);
+		else 
+			rv++;
 	}
 
-	// Loop through all the directory entries and online the memory block that matches
-	for (e = readdir(d) ; e != NULL ; e = readdir(d))
-		if (e->d_type == DT_DIR && sscanf(e->d_name, "memory%d", &index) == 1 && index == blk->id)
+	return rv;
+}
+
+/**
+ * Load the attributes of every block in the blocks array 
+ *
+ * The array is split into contiguous slices, one per worker thread. Each 
+ * worker only writes to its own slice so no locking is needed
+ */
+static void mem_blk_load_all(struct mem_ctx *ctx)
+{
+	int i, n, created;
+	pthread_t tids[LMLN_THREADS_MAX];
+	struct mem_blk_job jobs[LMLN_THREADS_MAX];
+
+	// Determine the number of workers. Small systems are loaded inline 
+	n = ctx->threads;
+	if (n > (ctx->num + LMLN_BLOCKS_PER_THREAD - 1) / LMLN_BLOCKS_PER_THREAD)
+		n = (ctx->num + LMLN_BLOCKS_PER_THREAD - 1) / LMLN_BLOCKS_PER_THREAD;
+	if (n < 1)
+		n = 1;
+
+	for ( i = 0 ; i < n ; i++ )
+	{
+		jobs[i].ctx = ctx;
+		jobs[i].first = (int) ((long) ctx->num * i / n);
+		jobs[i].end = (int) ((long) ctx->num * (i + 1) / n);
+	}
+
+	// Slice 0 runs on the calling thread 
+	created = 1;
+	for ( i = 1 ; i < n ; i++ )
+	{
+		if (pthread_create(&tids[i], NULL, mem_blk_load_worker, &jobs[i]) != 0)
+			break;
+		created++;
+	}
+
+	// Any slice without a worker is loaded inline
+	for ( i = created ; i < n ; i++ )
+		mem_blk_load_worker(&jobs[i]);
+
+	mem_blk_load_worker(&jobs[0]);
+
+	for ( i = 1 ; i < created ; i++ )
+		pthread_join(tids[i], NULL);
+
+	info(ctx, "Loaded %d memory blocks with %d threads", ctx->num, created);
+}
+
+/**
+ * Load the attributes of blocks [first, end) with batched io_uring reads
+ *
+ * All attributes of LMLN_URING_BLOCKS blocks are submitted together
+ * @return the index of the first block that was not loaded
+ */
+static int mem_blk_load_batch(struct mem_ctx *ctx, struct uring *ur, int first, int end)
+{
+	int i, j, k, n, fd;
+	char *bufs;
+	char (*paths)[LMLN_BLK_ATTR_PATH];
+	struct uring_read *reqs, *r;
+
+	// Initialize variables 
+	i = first;
+	fd = mem_memfd(ctx);
+	reqs = calloc(LMLN_URING_BLOCKS * LMBA_MAX, sizeof(*reqs));
+	paths = malloc(LMLN_URING_BLOCKS * LMBA_MAX * sizeof(*paths));
+	bufs = malloc(LMLN_URING_BLOCKS * LMBA_MAX * LMLN_SYSFS_ATTR_SIZE);
+	if (reqs == NULL || paths == NULL || bufs == NULL)
+		goto end;
+
+	for ( ; i < end ; i += n )
+	{
+		n = end - i;
+		if (n > LMLN_URING_BLOCKS)
+			n = LMLN_URING_BLOCKS;
+
+		for ( j = 0 ; j < n * LMBA_MAX ; j++ )
 		{
-			state = mem_blk_get_state(blk);
-			info(ctx, "Found memory block %d. Current State: %d Desired State %d", index, state, LMPL_OFFLINE);
+			r = &reqs[j];
+			sprintf(paths[j], "memory%d/%s", ctx->blocks[i + j / LMBA_MAX].id, _LMBA[j % LMBA_MAX]);
+			r->dirfd = fd;
+			r->path = paths[j];
+			r->buf = &bufs[j * LMLN_SYSFS_ATTR_SIZE];
+			r->len = LMLN_SYSFS_ATTR_SIZE;
+		}
 
-			if ( state == LMPL_OFFLINE )
-			{
-				info(ctx, "Memory block %d already offline. Skipping", index, mem_lmpl(state));
-				rv = 0;
-				goto end;
-			}
+		if (uring_read_batch(ur, reqs, n * LMBA_MAX) != 0)
+		{
+			warn(ctx, "io_uring batch read failed. Falling back to synchronous reads");
+			goto end;
+		}
+
+		for ( j = 0 ; j < n * LMBA_MAX ; j++ )
+		{
+			r = &reqs[j];
+			k = r->res;
 
-			sprintf(path, "%s/%s/%s", LMFP_MEM_DIR, e->d_name, "online");							
-			ret = mem_sysfs_write(ctx, path, "0");
-			if (ret != 2)
+			// Attributes the ring could not read are read synchronously 
+			if (k <= 0 || k >= LMLN_SYSFS_ATTR_SIZE)
 			{
-				err(ctx, "Failed to offline memory block %d", index);
-				rv += 1;
+				if (mem_sysfs_readat(ctx, fd, r->path, r->buf, 0) > 0)
+					mem_blk_parse(&ctx->blocks[i + j / LMBA_MAX], j % LMBA_MAX, r->buf);
+				continue;
 			}
-			else 
-				info(ctx, "Offlined memory block %d", index);
+
+			r->buf[k] = 0;
+			if (r->buf[k-1] == '\n')
+				r->buf[k-1] = 0;
+
+			mem_blk_parse(&ctx->blocks[i + j / LMBA_MAX], j % LMBA_MAX, r->buf);
 		}
+	}
+
+end:
+
+	if (reqs != NULL)
+		free(reqs);
+	if (paths != NULL)
+		free(paths);
+	if (bufs != NULL)
+		free(bufs);
+
+	return i;
+}
+
+/**
+ * Worker thread entry point that loads one slice of the blocks array
+ *
+ * The slice is read through a private io_uring when it is enabled and 
+ * available. Anything the ring could not load is read synchronously 
+ */
+static void *mem_blk_load_worker(void *arg)
+{
+	int i;
+	struct mem_blk_job *job;
+	struct uring *ur;
+
+	job = (struct mem_blk_job *) arg;
+	i = job->first;
+
+	if (job->ctx->io_uring && uring_new(&ur, LMLN_URING_ENTRIES) == 0)
+	{
+		i = mem_blk_load_batch(job->ctx, ur, job->first, job->end);
+		uring_free(ur);
+	}
+
+	for ( ; i < job->end ; i++ )
+		mem_blk_load(&job->ctx->blocks[i]);
+
+	return NULL;
+}
+
+/**
+ * Parse the contents of one sysfs attribute into a memory block
+ * @param attr enum LMBA
+ */
+static void mem_blk_parse(struct mem_blk *blk, int attr, char *buf)
+{
+	int j;
+	char *t, *state;
+
+	switch (attr)
+	{
+		case LMBA_ONLINE:
+			blk->online = strtoul(buf, NULL, 0);
+			break;
+
+		case LMBA_PHYS_DEVICE:
+			blk->device = strtoul(buf, NULL, 0);
+			break;
+
+		case LMBA_REMOVABLE:
+			blk->removable = strtoul(buf, NULL, 0);
+			break;
+
+		case LMBA_STATE:
+			for ( j = 0 ; j < LMST_MAX ; j++)
+				if (!strcmp(buf, mem_lmst(j)))
+				{
+					blk->state = j;
+					break;
+				}
+			break;
+
+		case LMBA_VALID_ZONES:
+			state = NULL;
+			blk->valid_zones = 0;
+			for (t = strtok_r(buf, " ", &state); t ; t = strtok_r(NULL, " ", &state))
+				for ( j = 0 ; j < LMZN_MAX ; j++ )
+					if (!strcmp(t, mem_lmzn(j)))
+						blk->valid_zones |= (0x01 << j);
+			break;
+	}
+}
+
+/**
+ * Offline a memory block
+ */
+int mem_blk_offline(struct mem_blk *blk)
+{
+	int rv, ret, state;
+
+	// Initialize variables 
+	rv = 0;
+
+	state = mem_blk_get_state(blk);
+	info(blk->ctx, "Found memory block %d. Current State: %d Desired State %d", blk->id, state, LMPL_OFFLINE);
+
+	if ( state == LMPL_OFFLINE )
+	{
+		info(blk->ctx, "Memory block %d already offline. Skipping", blk->id, mem_lmpl(state));
+		rv = 0;
+		goto end;
+	}
+
+	ret = mem_blk_write(blk, "online", "0");
+	if (ret != 2)
+	{
+		err(blk->ctx, "Failed to offline memory block %d", blk->id);
+		rv += 1;
+	}
+	else if (mem_blk_verify(blk, 0) != 0)
+		rv += 1;
+	else 
+		info(blk->ctx, "Offlined memory block %d", blk->id);
+
 end:
 
 	return rv; 
@@ -491,59 +1335,182 @@ end:
 
 int mem_blk_online(struct mem_blk *blk)
 {
-	int rv, ret, index, state;
-	DIR *d;
-	char path[LMLN_FILEPATH];
-  	struct dirent *e; 
-	struct mem_ctx *ctx;
+	int rv, ret, state;
 
 	// Initialize variables 
 	rv = 0;
-	ctx = blk->ctx;
 
-	// Open the directory 
-	d = opendir(LMFP_MEM_DIR);	
-	if (d == NULL)
+	state = mem_blk_get_state(blk);
+	info(blk->ctx, "Found memory block %d. Current State: %d Desired State %d", blk->id, state, LMPL_MOVABLE);
+
+	if (state == LMPL_MOVABLE)
 	{
-		err(ctx, "Could not open memory directory for enumeration: %s", LMFP_MEM_DIR);
+		info(blk->ctx, "Memory block %d already in state %s. Skipping", blk->id, mem_lmpl(state));
+		rv = 0;
+		goto end;
+	}
+
+	if (state != LMPL_OFFLINE)
+	{
+		err(blk->ctx, "Failed to online Memory block %d becuase it is not offline: %s", blk->id, mem_lmpl(mem_blk_get_state(blk)));
 		rv = 1;
 		goto end;
 	}
 
-	// Loop through all the directory entries and online the memory block that matches
-	for (e = readdir(d) ; e != NULL ; e = readdir(d))
-		if (e->d_type == DT_DIR && sscanf(e->d_name, "memory%d", &index) == 1 && index == blk->id)
+	ret = mem_blk_write(blk, "state", "online_movable");
+	if (ret != 15)
+	{
+		err(blk->ctx, "Failed to online memory block %d", blk->id);
+		rv += 1;
+	}
+	else if (mem_blk_verify(blk, 1) != 0)
+		rv += 1;
+	else 
+		info(blk->ctx, "Onlined memory block %d", blk->id);
+
+end:
+
+	return rv; 
+}
+
+/**
+ * List the memory block ids in a directory with getdents64
+ * @param type d_type of the memoryN entries. DT_DIR in the memory directory, DT_LNK in a node directory
+ * @param ids set to a malloc'd array of ids that the caller must free
+ * @return the number of ids. negative errno if an error
+ */
+static int mem_blk_scan_dir(struct mem_ctx *ctx, int dirfd, int type, int **ids)
+{
+	int rv, num, cap, index, *array, *tmp;
+	long n, pos;
+	char *buf;
+	struct mem_dirent64 *e;
+
+	// Initialize variables 
+	num = 0;
+	cap = 1024;
+	*ids = NULL;
+
+	buf = malloc(LMLN_DIRENT_BUF);
+	array = malloc(cap * sizeof(int));
+	if (buf == NULL || array == NULL)
+	{
+		rv = -ENOMEM;
+		goto err;
+	}
+
+	// Start from the beginning of the directory 
+	if (lseek(dirfd, 0, SEEK_SET) < 0)
+	{
+		rv = -errno;
+		goto err;
+	}
+
+	for (;;)
+	{
+		n = syscall(SYS_getdents64, dirfd, buf, LMLN_DIRENT_BUF);
+		if (n < 0)
 		{
-			state = mem_blk_get_state(blk);
-			info(ctx, "Found memory block %d. Current State: %d Desired State %d", index, state, LMPL_MOVABLE);
+			rv = -errno;
+			err(ctx, "getdents64 failed on directory: %d - %s", errno, strerror(errno));
+			goto err;
+		}
+		if (n == 0)
+			break;
 
-			if (state == LMPL_MOVABLE)
+		for (pos = 0 ; pos < n ; pos += e->d_reclen)
+		{
+			e = (struct mem_dirent64 *) (buf + pos);
+			if (e->d_type != type || sscanf(e->d_name, "memory%d", &index) != 1)
+				continue;
+
+			if (num == cap)
 			{
-				info(ctx, "Memory block %d already in state %s. Skipping", index, mem_lmpl(state));
-				rv = 0;
-				goto end;
+				cap *= 2;
+				tmp = realloc(array, cap * sizeof(int));
+				if (tmp == NULL)
+				{
+					rv = -ENOMEM;
+					goto err;
+				}
+				array = tmp;
 			}
+			array[num++] = index;
+		}
+	}
+
+	free(buf);
+	*ids = array;
+
+	return num;
+
+err:
+
+	if (buf != NULL)
+		free(buf);
+	if (array != NULL)
+		free(array);
+
+	return rv;
+}
+
+/**
+ * Pick blocks from a list of candidates preferring contiguous runs 
+ *
+ * A run is a sequence of candidates with consecutive ids. The smallest run
+ * that holds all of the remaining blocks is used if there is one, 
+ * otherwise the longest run is taken whole, until need blocks are picked 
+ * @param cands 	candidates sorted by id. Picked entries are set to NULL
+ * @param tail 		1 to take the blocks from the end of a run instead of the start
+ * @param pick 		array of at least need entries set to the picked blocks
+ * @return the number of blocks picked. Less than need if there were not enough candidates
+ */
+static int mem_blk_pick_runs(struct mem_blk **cands, int num, int need, int tail, struct mem_blk **pick)
+{
+	int n, i, j, k, len, best, best_len;
+
+	n = 0;
+
+	while (n < need)
+	{
+		best = -1;
+		best_len = 0;
 
-			if (state != LMPL_OFFLINE)
+		for ( i = 0 ; i < num ; i = j )
+		{
+			if (cands[i] == NULL)
 			{
-				err(ctx, "Failed to online Memory block %d becuase it is not offline: %s", index, mem_lmpl(mem_blk_get_state(blk)));
-				rv = 1;
-				goto end;
+				j = i + 1;
+				continue;
 			}
 
-			sprintf(path, "%s/%s/%s", LMFP_MEM_DIR, e->d_name, "state");							
-			ret = mem_sysfs_write(ctx, path, "online_movable");
-			if (ret != 15)
+			for ( j = i + 1 ; j < num && cands[j] != NULL && cands[j]->id == cands[j-1]->id + 1 ; j++ ) ;
+			len = j - i;
+
+			// Best fit if the run is large enough, otherwise the longest
+			if (best < 0 
+			    || (len >= need - n && (best_len < need - n || len < best_len))
+			    || (len < need - n && best_len < need - n && len > best_len))
 			{
-				err(ctx, "Failed to online memory block %d", index);
-				rv += 1;
+				best = i;
+				best_len = len;
 			}
-			else 
-				info(ctx, "Onlined memory block %d", index);
 		}
-end:
 
-	return rv; 
+		if (best < 0)
+			break;
+
+		k = (best_len < need - n) ? best_len : need - n;
+		i = tail ? best + best_len - k : best;
+
+		for ( j = i ; j < i + k ; j++ )
+		{
+			pick[n++] = cands[j];
+			cands[j] = NULL;
+		}
+	}
+
+	return n;
 }
 
 /**
@@ -565,701 +1532,3996 @@ void mem_blk_print(struct mem_blk *blk)
 	printf("\n");
 }
 
-int mem_blk_set_state(struct mem_blk *blk, int state)
+/**
+ * Re-read the state of a memory block from sysfs 
+ *
+ * Only online, state and valid_zones are read since they are the only 
+ * attributes that change while the block exists
+ * @return 0 upon success, otherwise the number of attributes that could not be read
+ */
+int mem_blk_refresh(struct mem_blk *blk)
 {
-	int rv, ret, index;
-	DIR *d;
-	char path[LMLN_FILEPATH];
-  	struct dirent *e; 
+	int rv, fd, i;
 	struct mem_ctx *ctx;
+	char path[LMLN_FILEPATH];
+	char buf[LMLN_SYSFS_ATTR_SIZE];
+	static const int attrs[] = {LMBA_ONLINE, LMBA_STATE, LMBA_VALID_ZONES};
 
 	// Initialize variables 
 	rv = 0;
 	ctx = blk->ctx;
+	fd = mem_memfd(ctx);
+
+	for ( i = 0 ; i < (int) (sizeof(attrs) / sizeof(attrs[0])) ; i++ )
+	{
+		// Only the attributes that are polled for state changes are cached
+		sprintf(path, "memory%d/%s", blk->id, _LMBA[attrs[i]]);
+		if (mem_sysfs_readat(ctx, fd, path, buf, attrs[i] != LMBA_VALID_ZONES) > 0)
+			mem_blk_parse(blk, attrs[i], buf);
+		else 
+			rv++;
+	}
+
+	return rv;
+}
+
+/**
+ * Rebuild the dense block id to index table from the sorted blocks array
+ * @return 0 upon success, negative errno otherwise
+ */
+static int mem_blk_reindex(struct mem_ctx *ctx)
+{
+	int i;
+
+	if (ctx->index != NULL)
+		free(ctx->index);
+
+	ctx->index = NULL;
+	ctx->max_id = -1;
+
+	if (ctx->num <= 0)
+		return 0;
+
+	ctx->max_id = ctx->blocks[ctx->num - 1].id;
+
+	ctx->index = malloc((ctx->max_id + 1) * sizeof(int));
+	if (ctx->index == NULL)
+		return -ENOMEM;
+
+	for ( i = 0 ; i <= ctx->max_id ; i++ )
+		ctx->index[i] = -1;
+
+	for ( i = 0 ; i < ctx->num ; i++ )
+		ctx->index[ctx->blocks[i].id] = i;
+
+	return 0;
+}
+
+/**
+ * Classify the pages of a memory block from its /proc/kpageflags entries
+ *
+ * The entries of the block are read in LMLN_KPF_CHUNK sized preads, with 
+ * the matching /proc/kpagecount entries if available, and classified four 
+ * at a time. Each class is a lane mask that is subtracted from a vector 
+ * counter, so a matching lane adds one. A page is free if it is the head 
+ * of a buddy block or has no flags, as the tail pages of a buddy block do. 
+ * Pages that are neither free, slab, huge nor on an LRU list are counted 
+ * as unmovable
+ * @return 0 upon success, negative errno otherwise
+ */
+static int mem_blk_scan(struct mem_blk *blk, struct mem_kpf *kpf, struct mem_blk_pages *pages)
+{
+	long page_size, left, i, n;
+	unsigned long long pfn, block_size;
+	mem_kpf_vec f, c, none, used, lru, slab, huge;
+	mem_kpf_vec v_pages, v_free, v_lru, v_slab, v_unmov, v_huge, v_mapped;
+
+	memset(pages, 0, sizeof(*pages));
+
+	page_size = sysconf(_SC_PAGESIZE);
+	block_size = mem_system_get_blocksize(blk->ctx);
+	if (page_size <= 0 || block_size == 0)
+		return -EINVAL;
+
+	left = block_size / page_size;
+	pfn = blk->id * (block_size / page_size);
+
+	v_pages = v_free = v_lru = v_slab = v_unmov = v_huge = v_mapped = (mem_kpf_vec) {0};
+
+	while (left > 0)
+	{
+		n = (left < LMLN_KPF_CHUNK) ? left : LMLN_KPF_CHUNK;
+		n = pread(kpf->flags_fd, kpf->flags, n * sizeof(*kpf->flags), pfn * sizeof(*kpf->flags));
+		if (n <= 0)
+			return (n < 0) ? -errno : -EIO;
+		n /= sizeof(*kpf->flags);
+
+		if (kpf->count_fd < 0 || pread(kpf->count_fd, kpf->counts, n * sizeof(*kpf->counts), pfn * sizeof(*kpf->counts)) != (ssize_t) (n * sizeof(*kpf->counts)))
+			memset(kpf->counts, 0, n * sizeof(*kpf->counts));
+
+		// Pad the last vector with entries that match no class 
+		for ( i = n ; i % LMLN_KPF_LANES ; i++ )
+		{
+			kpf->flags[i] = LMKF_NOPAGE;
+			kpf->counts[i] = 0;
+		}
+
+		for ( i = 0 ; i < n ; i += LMLN_KPF_LANES )
+		{
+			memcpy(&f, &kpf->flags[i], sizeof(f));
+			memcpy(&c, &kpf->counts[i], sizeof(c));
+
+			none = (mem_kpf_vec) ((f & LMKF_NOPAGE) != 0);
+			used = (mem_kpf_vec) (f != 0) & (mem_kpf_vec) ((f & LMKF_BUDDY) == 0) & ~none;
+			slab = (mem_kpf_vec) ((f & LMKF_SLAB) != 0) & used;
+			huge = (mem_kpf_vec) ((f & (LMKF_HUGE | LMKF_THP)) != 0) & used;
+			lru = (mem_kpf_vec) ((f & LMKF_LRU) != 0) & used & ~slab;
+
+			v_pages -= ~none;
+			v_free -= ~used & ~none;
+			v_lru -= lru;
+			v_slab -= slab;
+			v_huge -= huge;
+			v_unmov -= used & ~(slab | huge | lru);
+			v_mapped += c;
+		}
+
+		pfn += n;
+		left -= n;
+	}
+
+	for ( i = 0 ; i < (long) LMLN_KPF_LANES ; i++ )
+	{
+		pages->pages += v_pages[i];
+		pages->free += v_free[i];
+		pages->lru += v_lru[i];
+		pages->slab += v_slab[i];
+		pages->unmovable += v_unmov[i];
+		pages->huge += v_huge[i];
+		pages->mapped += v_mapped[i];
+	}
+
+	// Every page to migrate is copied and each mapping is rewritten. Slab 
+	// and unmovable pages make the offline fail after that work is done
+	pages->cost = pages->lru + pages->huge + pages->mapped + LMLN_COST_UNMOVABLE * (pages->slab + pages->unmovable);
+
+	return 0;
+}
+
+/**
+ * Bring the blocks array in line with the memory directory 
+ *
+ * The directory listing is diffed against the id index. Blocks that 
+ * disappeared are dropped and only blocks that appeared are read from sysfs.
+ * Nothing is read or reallocated if the listing did not change
+ * @return 0 upon success, non-zero otherwise
+ */
+static int mem_blk_rescan(struct mem_ctx *ctx)
+{
+	int rv, i, j, k, num, added, removed, total, fd;
+	int *ids;
+	char *seen;
+	struct mem_blk *blocks, *blk;
+
+	// Initialize variables 
+	rv = 1;
+	ids = NULL;
+	seen = NULL;
+	blocks = NULL;
+
+	// A context that was never enumerated does a full enumeration 
+	if (ctx->blocks == NULL)
+		return mem_blk_init(ctx);
+
+	fd = mem_memfd(ctx);
+	if (fd < 0)
+		goto end;
+
+	num = mem_blk_scan_dir(ctx, fd, DT_DIR, &ids);
+	if (num < 0)
+	{
+		err(ctx, "Could not list memory directory: %s %d", LMFP_MEM_DIR, num);
+		goto end;
+	}
+
+	seen = calloc(ctx->num + 1, sizeof(char));
+	if (seen == NULL)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
+
+	// Mark the known blocks and move the new ids to the front of the list 
+	added = 0;
+	for ( i = 0 ; i < num ; i++ )
+	{
+		if (ids[i] <= ctx->max_id && ctx->index[ids[i]] >= 0)
+			seen[ctx->index[ids[i]]] = 1;
+		else 
+			ids[added++] = ids[i];
+	}
+	removed = ctx->num - (num - added);
+
+	if (added == 0 && removed == 0)
+	{
+		rv = 0;
+		goto end;
+	}
+
+	info(ctx, "Memory directory changed. Added: %d Removed: %d", added, removed);
+
+	qsort(ids, added, sizeof(int), mem_compare_ints);
+
+	// Merge the surviving blocks with the new ids in id order 
+	total = num;
+	blocks = calloc(total, sizeof(struct mem_blk));
+	if (blocks == NULL && total > 0)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
+
+	for ( i = 0, j = 0, k = 0 ; k < total ; k++ )
+	{
+		while (i < ctx->num && !seen[i])
+			i++;
+
+		if (j < added && (i >= ctx->num || ids[j] < ctx->blocks[i].id))
+		{
+			blocks[k].ctx = ctx;
+			blocks[k].id = ids[j++];
+			blocks[k].node = -1;
+		}
+		else 
+			blocks[k] = ctx->blocks[i++];
+	}
+
+	free(ctx->blocks);
+	ctx->blocks = blocks;
+	ctx->num = total;
+	blocks = NULL;
+	mem_fdcache_resize(ctx);
+
+	rv = mem_blk_reindex(ctx);
+	if (rv != 0)
+		goto end;
+
+	// Read in only the blocks that were added 
+	for ( j = 0 ; j < added ; j++ )
+	{
+		blk = &ctx->blocks[ctx->index[ids[j]]];
+		mem_blk_load(blk);
+		blk->node = mem_blk_find_node(blk);
+	}
+
+	if (added > 0)
+		mem_node_rebuild(ctx);
+
+	rv = 0;
+
+end:
+
+	if (ids != NULL)
+		free(ids);
+	if (seen != NULL)
+		free(seen);
+	if (blocks != NULL)
+		free(blocks);
+
+	return rv;
+}
+
+/**
+ * Get the state that puts a memory block back where it is now
+ *
+ * mem_blk_get_state() reports a ZONE_NORMAL block as LMPL_ONLINE, which 
+ * lets the kernel pick the zone again. Online blocks are restored to the 
+ * zone in their cached valid_zones instead
+ * @param lock 	1 to read the cached block under ctx->lock
+ * @return LMPL_OFFLINE, LMPL_MOVABLE or LMPL_KERNEL
+ */
+static int mem_blk_restore_state(struct mem_blk *blk, int lock)
+{
+	int state;
+
+	if (lock)
+		pthread_mutex_lock(&blk->ctx->lock);
+
+	if (blk->state == LMST_OFFLINE)
+		state = LMPL_OFFLINE;
+	else if (blk->valid_zones & LMZM_MOVABLE)
+		state = LMPL_MOVABLE;
+	else 
+		state = LMPL_KERNEL;
+
+	if (lock)
+		pthread_mutex_unlock(&blk->ctx->lock);
+
+	return state;
+}
+
+int mem_blk_set_state(struct mem_blk *blk, int state)
+{
+	int rv, ret;
+
+	// Initialize variables 
+	rv = 0;
 
 	// Validate inputs 
 	if (state < 0 || state >= LMPL_MAX)
 	{
-		err(ctx, "Attempted to set invalid state: %d", state);
-		rv = 1;
-		goto end;
+		err(blk->ctx, "Attempted to set invalid state: %d", state);
+		rv = 1;
+		goto end;
+	}
+
+	info(blk->ctx, "Found memory block %d. Current State: %d Desired State %d", blk->id, mem_blk_get_state(blk), state);
+	if (mem_blk_get_state(blk) == state)
+	{
+		info(blk->ctx, "Memory block %d already in state %s. Skipping", blk->id, mem_lmpl(state));
+		rv = 0;
+		goto end;
+	}
+
+	if (state != LMPL_OFFLINE && mem_blk_get_state(blk) != LMPL_OFFLINE)
+	{
+		err(blk->ctx, "Failed to set state of Memory block %d to %s becuase it is not offline: %s", blk->id, mem_lmpl(state), mem_lmpl(mem_blk_get_state(blk)));
+		rv = 1;
+		goto end;
+	}
+
+	ret = mem_blk_write(blk, "state", mem_lmpl(state));
+	if (ret < 0 || ret != (int) (strlen(mem_lmpl(state)) + 1))
+	{
+		err(blk->ctx, "Failed to set state to %s on memory block %d. %d", mem_lmpl(state), blk->id, ret);
+		rv += 1;
+	}
+	else if (mem_blk_verify(blk, state != LMPL_OFFLINE) != 0)
+		rv += 1;
+	else 
+		info(blk->ctx, "Set state to %s on memory block %d", mem_lmpl(state), blk->id);
+
+end:
+
+	return rv; 
+}
+
+/**
+ * Set the state of a list of memory blocks in one pass 
+ *
+ * The writes are issued in block id order, or in ascending migration cost
+ * when offlining with LMSR_COST. Blocks that are already in an online 
+ * state count as success for any online state, matching the behaviour of
+ * the CLI block online command. Duplicate ids are written once.
+ * A transaction stops on the first failure and rolls the blocks it changed
+ * back to their previous state in parallel
+ * @param ids 		array of block ids 
+ * @param state 	enum LMPL
+ * @param flags 	bitfield of LMSR masks 
+ * @param results 	array of num results in the same order as ids. May be NULL 
+ * @return 0 upon success, the number of blocks that failed, or negative errno
+ */
+int mem_blk_set_state_range(struct mem_ctx *ctx, int *ids, int num, int state, int flags, struct mem_blk_result *results)
+{
+	int rv, i, stop, prev_state, num_journal;
+	struct mem_blk *blk;
+	struct mem_blk_result *res, *prev, **order;
+	struct mem_op_jent *journal;
+	struct mem_blk_cost *costs;
+	struct mem_blk_pages pages;
+	struct mem_kpf kpf;
+
+	// Initialize variables 
+	rv = 0;
+	stop = 0;
+	order = NULL;
+	journal = NULL;
+	costs = NULL;
+	num_journal = 0;
+	prev = NULL;
+
+	// Validate inputs 
+	if (ctx == NULL || ids == NULL || num < 0 || state < 0 || state >= LMPL_MAX)
+		return -EINVAL;
+
+	res = results;
+	if (res == NULL)
+		res = calloc(num, sizeof(*res));
+	order = malloc(num * sizeof(*order));
+	if (flags & LMSR_TRANSACTION)
+		journal = malloc(num * sizeof(*journal));
+	if ((res == NULL || order == NULL || (journal == NULL && (flags & LMSR_TRANSACTION))) && num > 0)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
+
+	for ( i = 0 ; i < num ; i++ )
+	{
+		res[i].id = ids[i];
+		res[i].rv = -ECANCELED;
+		res[i].state = -1;
+		res[i].retries = 0;
+		res[i].ns = 0;
+		order[i] = &res[i];
+	}
+
+	qsort(order, num, sizeof(*order), mem_compare_mem_blk_results);
+
+	// Cheapest blocks first. Ties keep id order so duplicates stay adjacent 
+	// and missing blocks fail before anything is written
+	if ((flags & LMSR_COST) && state == LMPL_OFFLINE && num > 1 && mem_kpf_open(ctx, &kpf) == 0)
+	{
+		costs = malloc(num * sizeof(*costs));
+		for ( i = 0 ; costs != NULL && i < num ; i++ )
+		{
+			costs[i].blk = mem_blkid_get_blk(ctx, order[i]->id);
+			costs[i].pos = i;
+			costs[i].cost = (costs[i].blk == NULL) ? -1 : 0;
+			if (costs[i].blk != NULL && costs[i].blk->online && mem_blk_scan(costs[i].blk, &kpf, &pages) == 0)
+				costs[i].cost = pages.cost;
+		}
+
+		mem_kpf_close(&kpf);
+
+		if (costs != NULL)
+		{
+			qsort(costs, num, sizeof(*costs), mem_compare_mem_blk_costs);
+
+			for ( i = 0 ; i < num ; i++ )
+				costs[i].pos = order[costs[i].pos] - res;
+			for ( i = 0 ; i < num ; i++ )
+				order[i] = &res[costs[i].pos];
+		}
+	}
+
+	for ( i = 0 ; i < num && !stop ; i++ )
+	{
+		// Duplicate ids share the result of the first one
+		if (prev != NULL && order[i]->id == prev->id)
+			continue;
+		prev = order[i];
+
+		blk = mem_blkid_get_blk(ctx, order[i]->id);
+		if (blk == NULL)
+		{
+			order[i]->rv = -ENOENT;
+		}
+		else 
+		{
+			prev_state = mem_blk_restore_state(blk, 0);
+			order[i]->rv = mem_blkid_apply_state(ctx, blk->id, state, 0, &order[i]->ns);
+			order[i]->state = mem_blk_get_state(blk);
+
+			if (journal != NULL && order[i]->rv == 0 && order[i]->ns > 0)
+			{
+				journal[num_journal].blk = blk;
+				journal[num_journal].prev = prev_state;
+				journal[num_journal].res = order[i];
+				num_journal++;
+			}
+		}
+
+		if (order[i]->rv != 0 && (!(flags & LMSR_CONTINUE) || journal != NULL))
+			stop = 1;
+	}
+
+	if (stop && num_journal > 0)
+		mem_op_rollback(ctx, journal, num_journal);
+
+	// Copy the results to duplicate ids and count the failures 
+	prev = NULL;
+	for ( i = 0 ; i < num ; i++ )
+	{
+		if (prev != NULL && order[i]->id == prev->id)
+		{
+			order[i]->rv = prev->rv;
+			order[i]->state = prev->state;
+		}
+		else 
+			prev = order[i];
+
+		if (order[i]->rv != 0)
+			rv++;
+	}
+
+	info(ctx, "Set state %s on %d memory blocks. Failed: %d", mem_lmpl(state), num, rv);
+
+end:
+
+	if (order != NULL)
+		free(order);
+	if (journal != NULL)
+		free(journal);
+	if (costs != NULL)
+		free(costs);
+	if (res != NULL && res != results)
+		free(res);
+
+	return rv;
+}
+
+/**
+ * Update the cached state of a block after a state write and verify it 
+ *
+ * The block is re-read from sysfs. If that fails the cached online and 
+ * state fields are set to what the successful write requested
+ * @param online 1 if the write requested the block be online, 0 if offline 
+ * @return 0 if the block is in the requested state, non-zero otherwise
+ */
+static int mem_blk_verify(struct mem_blk *blk, int online)
+{
+	if (mem_blk_refresh(blk) != 0)
+	{
+		warn(blk->ctx, "Unable to re-read memory block %d after write", blk->id);
+		blk->online = online;
+		blk->state = online ? LMST_ONLINE : LMST_OFFLINE;
+		return 0;
+	}
+
+	if ((mem_blk_get_state(blk) != LMPL_OFFLINE) != online)
+	{
+		err(blk->ctx, "Memory block %d is %s after write", blk->id, mem_lmst(blk->state));
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Wait for a memory block to reach a state 
+ *
+ * Blocks on uevents when mem_events_start() is running, otherwise the block 
+ * is re-read with an increasing poll interval
+ * @param state 		enum LMST. e.g. LMST_OFFLINE to wait for going-offline to finish
+ * @param timeout_ms 	-1 to wait forever. 0 to check once
+ * @return 0 upon success, -ETIMEDOUT on timeout, negative errno otherwise
+ */
+int mem_blk_wait_state(struct mem_blk *blk, int state, int timeout_ms)
+{
+	int rv, delay;
+	unsigned long seq;
+	struct mem_ctx *ctx;
+	struct timespec until;
+
+	// Validate inputs 
+	if (blk == NULL || state < 0 || state >= LMST_MAX)
+		return -EINVAL;
+
+	ctx = blk->ctx;
+	delay = LMLN_WAIT_POLL_MIN_MS;
+	if (timeout_ms >= 0)
+		mem_events_deadline(&until, timeout_ms);
+
+	for (;;)
+	{
+		seq = mem_events_seq(ctx);
+
+		mem_blk_refresh(blk);
+		if (blk->state == state)
+			return 0;
+
+		rv = mem_events_wait(ctx, seq, (timeout_ms >= 0) ? &until : NULL, &delay);
+		if (rv != 0)
+			return rv;
+	}
+}
+
+/**
+ * Write a sysfs attribute of a memory block 
+ * @return the number of bytes written. See mem_blkid_write()
+ */
+static int mem_blk_write(struct mem_blk *blk, const char *attr, const char *buf)
+{
+	return mem_blkid_write(blk->ctx, blk->id, attr, buf);
+}
+
+/**
+ * Change the state of one memory block and time the change
+ *
+ * Blocks that are already in an online state count as success for any 
+ * online state. Blocks already in the target state are not written. The 
+ * write is made by block id without holding the block. With lock set the 
+ * cached block is looked up, verified and refreshed under ctx->lock so 
+ * library threads do not race the uevent listener or each other
+ * @param lock 	1 to take ctx->lock around accesses to the cached block
+ * @param ns 	set to the time spent writing the state. 0 if no write was needed. May be NULL
+ * @return 0 upon success, -ENOENT if no such block, negative errno of the 
+ * failed write, or -EIO if the block did not reach the state
+ */
+static int mem_blkid_apply_state(struct mem_ctx *ctx, int id, int state, int lock, unsigned long long *ns)
+{
+	int rv, online, skip;
+	unsigned long long t;
+	struct mem_blk *blk;
+	const char *attr, *val;
+
+	// Initialize variables 
+	rv = 0;
+	t = 0;
+	online = (state != LMPL_OFFLINE);
+
+	// Offline through the online attribute like mem_blk_offline()
+	attr = online ? "state" : "online";
+	val = online ? mem_lmpl(state) : "0";
+
+	if (ns != NULL)
+		*ns = 0;
+
+	// Blocks already in the state are not written
+	if (lock)
+		pthread_mutex_lock(&ctx->lock);
+	blk = mem_blkid_find(ctx, id);
+	skip = (blk == NULL) || (online ? blk->online : mem_blk_get_state(blk) == LMPL_OFFLINE);
+	if (lock)
+		pthread_mutex_unlock(&ctx->lock);
+
+	if (blk == NULL)
+		return -ENOENT;
+	if (skip)
+		return 0;
+
+	t = mem_now_ns();
+
+	rv = mem_blkid_write(ctx, id, attr, val);
+	if (rv == (int) strlen(val) + 1)
+		rv = 0;
+	else if (rv >= 0)
+		rv = -EIO;
+
+	// The block table may have changed during the write 
+	if (lock)
+		pthread_mutex_lock(&ctx->lock);
+	blk = mem_blkid_find(ctx, id);
+	if (blk != NULL)
+	{
+		if (rv != 0)
+			mem_blk_refresh(blk);
+		else if (mem_blk_verify(blk, online) != 0)
+			rv = -EIO;
+	}
+	if (lock)
+		pthread_mutex_unlock(&ctx->lock);
+
+	if (ns != NULL)
+	{
+		*ns = mem_now_ns() - t;
+		if (*ns == 0)
+			*ns = 1;
+	}
+
+	if (rv != 0)
+		err(ctx, "Failed to set state to %s on memory block %d. %d", mem_lmpl(state), id, rv);
+
+	return rv;
+}
+
+/**
+ * Look up a memory block by id in the loaded block table
+ *
+ * Unlike mem_blkid_get_blk() this does not load the table, so it may be 
+ * called from library threads with the lock held
+ */
+static struct mem_blk *mem_blkid_find(struct mem_ctx *ctx, int id)
+{
+	int i;
+
+	if (ctx->blocks == NULL || ctx->index == NULL || id < 0 || id > ctx->max_id)
+		return NULL;
+
+	i = ctx->index[id];
+	if (i < 0)
+		return NULL;
+
+	return &ctx->blocks[i];
+}
+
+/** 
+ * Get a struct mem_blk* from a memory block ID 
+ */ 
+struct mem_blk *mem_blkid_get_blk(struct mem_ctx *ctx, int id)
+{
+	// Validate Inputs 
+	if (ctx == NULL || id < 0)
+		return NULL;
+
+	// Enumerate the memory blocks if not done already
+	if (ctx->blocks == NULL && mem_blk_get_first(ctx) == NULL)
+		return NULL;
+
+	return mem_blkid_find(ctx, id);
+}
+
+/**
+ * Get the physical device for the memory block 
+ */
+int mem_blkid_get_device(struct mem_ctx *ctx, int id)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return -1;
+
+	return blk->device;
+}
+
+/**
+ * Get the numa node for the memory blocks in the system
+ * @return The number of blocks. 0 if error
+ */
+int mem_blkid_get_node(struct mem_ctx *ctx, int index)
+{
+	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, index);
+	if (blk == NULL)
+		return -1;
+
+	return blk->node;
+}
+ 
+/**
+ * Get the onnline state of a memory block
+ */
+int mem_blkid_get_state(struct mem_ctx *ctx, int id)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return -1;
+
+	return blk->state;
+}
+
+/**
+ * Get a bitfield representing the valid zones*
+ */
+unsigned long mem_blkid_get_zones(struct mem_ctx *ctx, int id)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return 0;
+
+	return blk->valid_zones;
+}
+
+/**
+ * Determine if a memory block is online by phys_index
+ */
+int mem_blkid_is_online(struct mem_ctx *ctx, int id)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return -1;
+
+	return blk->online;
+}
+
+/**
+ * Determine if a memory block is removable by phys_index
+ */
+int mem_blkid_is_removable(struct mem_ctx *ctx, int id)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return -1;
+
+	return blk->removable;
+}
+
+/**
+ * Offline a memory block by phys_index
+ */ 
+int mem_blkid_offline(struct mem_ctx *ctx, int id)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return 1;
+
+	return mem_blk_offline(blk);
+}
+
+/**
+ * Online a memory block by phys_index
+ * @return 0 upon success, non-zero othersise
+ */
+int mem_blkid_online(struct mem_ctx *ctx, int id)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return -1;
+
+	return mem_blk_online(blk);
+}
+
+/**
+ * Re-read the state of a memory block by phys_index
+ * @return 0 upon success, non-zero othersise
+ */
+int mem_blkid_refresh(struct mem_ctx *ctx, int id)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return 1;
+
+	return mem_blk_refresh(blk);
+}
+
+/**
+ * Set the online state of the memory block 
+ */
+int mem_blkid_set_state(struct mem_ctx *ctx, int id, int state)
+{
+  	struct mem_blk *blk;
+
+	blk = mem_blkid_get_blk(ctx, id);
+	if (blk == NULL)
+		return -1;
+
+	return mem_blk_set_state(blk, state);
+}
+
+/**
+ * Write a sysfs attribute of a memory block by id 
+ *
+ * The path is built from the block id relative to the held memory 
+ * directory fd, or as an absolute path if the directory could not be opened
+ * @return the number of bytes written. See mem_sysfs_write()
+ */
+static int mem_blkid_write(struct mem_ctx *ctx, int id, const char *attr, const char *buf)
+{
+	int fd;
+	char path[LMLN_FILEPATH];
+
+	fd = mem_memfd(ctx);
+	if (fd < 0)
+	{
+		sprintf(path, "%s/memory%d/%s", LMFP_MEM_DIR, id, attr);
+		return mem_sysfs_write(ctx, path, buf);
+	}
+
+	sprintf(path, "memory%d/%s", id, attr);
+	return mem_sysfs_writeat(ctx, fd, path, buf);
+}
+
+/**
+ * Compare cxl_memdev function for qsort
+ */ 
+int mem_compare_cxl_memdevs(const void* a, const void* b)
+{
+    struct cxl_memdev *arg1 = *(struct cxl_memdev **)a;
+    struct cxl_memdev *arg2 = *(struct cxl_memdev **)b;
+
+ 	int i1 = cxl_memdev_get_id(arg1);
+ 	int i2 = cxl_memdev_get_id(arg2);
+
+ 	return mem_compare_ints(&i1, &i2);
+}
+
+/**
+ * Compare cxl_region function for qsort
+ */ 
+int mem_compare_cxl_regions(const void* a, const void* b)
+{
+    struct cxl_region *arg1 = *(struct cxl_region **)a;
+    struct cxl_region *arg2 = *(struct cxl_region **)b;
+
+ 	int i1 = cxl_region_get_id(arg1);
+ 	int i2 = cxl_region_get_id(arg2);
+
+ 	return mem_compare_ints(&i1, &i2);
+}
+
+/**
+ * Compare int function for qsort
+ */ 
+int mem_compare_ints(const void* a, const void* b)
+{
+    int arg1 = *(const int*)a;
+    int arg2 = *(const int*)b;
+ 
+    if (arg1 < arg2) return -1;
+    if (arg1 > arg2) return 1;
+    return 0;
+}
+
+/**
+ * Compare mem_blk function for qsort
+ */ 
+int mem_compare_mem_blks(const void* a, const void* b)
+{
+    struct mem_blk *arg1 = (struct mem_blk *)a;
+    struct mem_blk *arg2 = (struct mem_blk *)b;
+
+ 	int i1 = arg1->id;
+ 	int i2 = arg2->id;
+
+ 	return mem_compare_ints(&i1, &i2);
+}
+
+/**
+ * Compare mem_blk_cost function for qsort by cost then position
+ */ 
+int mem_compare_mem_blk_costs(const void* a, const void* b)
+{
+    struct mem_blk_cost *arg1 = (struct mem_blk_cost *)a;
+    struct mem_blk_cost *arg2 = (struct mem_blk_cost *)b;
+
+	if (arg1->cost != arg2->cost)
+		return (arg1->cost < arg2->cost) ? -1 : 1;
+
+ 	return mem_compare_ints(&arg1->pos, &arg2->pos);
+}
+
+/**
+ * Compare mem_blk_result function for qsort by block id
+ */ 
+int mem_compare_mem_blk_results(const void* a, const void* b)
+{
+    struct mem_blk_result *arg1 = *(struct mem_blk_result **)a;
+    struct mem_blk_result *arg2 = *(struct mem_blk_result **)b;
+
+ 	return mem_compare_ints(&arg1->id, &arg2->id);
+}
+
+/**
+ * Compare mem_nrange function for qsort
+ */ 
+int mem_compare_mem_nranges(const void* a, const void* b)
+{
+    struct mem_nrange *arg1 = (struct mem_nrange *)a;
+    struct mem_nrange *arg2 = (struct mem_nrange *)b;
+
+ 	return mem_compare_ints(&arg1->first, &arg2->first);
+}
+
+
+/**
+ * Compare mem_op_item function for qsort by node then position
+ */ 
+int mem_compare_mem_op_items(const void* a, const void* b)
+{
+    struct mem_op_item *arg1 = (struct mem_op_item *)a;
+    struct mem_op_item *arg2 = (struct mem_op_item *)b;
+
+	if (arg1->blk->node != arg2->blk->node)
+		return mem_compare_ints(&arg1->blk->node, &arg2->blk->node);
+
+ 	return mem_compare_ints(&arg1->pos, &arg2->pos);
+}
+
+/**
+ * Compare mem_rgn function for qsort
+ */ 
+int mem_compare_mem_rgns(const void* a, const void* b)
+{
+    struct mem_rgn *arg1 = (struct mem_rgn *)a;
+    struct mem_rgn *arg2 = (struct mem_rgn *)b;
+
+ 	return mem_compare_ints(&arg1->first, &arg2->first);
+}
+
+/**
+ * Apply block table and region changes queued by the event listener 
+ *
+ * Added and removed blocks reallocate the blocks array and region events drop
+ * the cached region array, so the listener only queues them. Getters never 
+ * apply the queue. Block pointers and region arrays obtained before are only
+ * invalidated by this call, mem_refresh() and mem_region_wait_online()
+ * @return 0 upon success or if nothing was queued, negative errno otherwise
+ */
+int mem_events_apply(struct mem_ctx *ctx)
+{
+	int pending;
+
+	// Validate inputs 
+	if (ctx == NULL)
+		return -EINVAL;
+
+	pending = __atomic_exchange_n(&ctx->pending, 0, __ATOMIC_ACQ_REL);
+	if (pending == 0)
+		return 0;
+
+	info(ctx, "Applying queued event refresh: 0x%x", pending);
+	return mem_refresh(ctx, pending);
+}
+
+/**
+ * Compute an absolute CLOCK_MONOTONIC deadline timeout_ms from now
+ */
+static void mem_events_deadline(struct timespec *ts, int timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/**
+ * Get a file descriptor that becomes readable when the listener applies events 
+ *
+ * The fd is a non-blocking eventfd for use with poll / epoll. Read 8 bytes 
+ * from it to clear it, then check the state of interest. It is owned by the
+ * context and closed by mem_unref()
+ * @return the fd. negative errno if it could not be created
+ */
+int mem_events_get_fd(struct mem_ctx *ctx)
+{
+	int fd;
+
+	if (ctx == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (ctx->evnotify < 0)
+		ctx->evnotify = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+	fd = (ctx->evnotify >= 0) ? ctx->evnotify : -errno;
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return fd;
+}
+
+/**
+ * Apply one kernel uevent to the context and notify subscribers
+ *
+ * A uevent is "action@devpath" followed by KEY=VALUE strings, all NUL 
+ * separated. Online and offline events update the block in place. Add, 
+ * remove, region and dax events are queued until the caller runs
+ * mem_events_apply() or mem_refresh()
+ * @param buf message buffer with room for a terminating NUL at buf[len]
+ */
+static void mem_events_handle(struct mem_ctx *ctx, char *buf, int len)
+{
+	int i, online;
+	char *p, *end, *name;
+	struct mem_blk *blk;
+	struct mem_event ev;
+	struct mem_sub subs[LMLN_SUBSCRIBERS];
+
+	buf[len] = 0;
+	end = buf + len;
+
+	// Messages rebroadcast by udev start with a libudev header 
+	p = strchr(buf, '@');
+	if (!strncmp(buf, "libudev", 7) || p == NULL)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.id = -1;
+	ev.type = -1;
+
+	*p = 0;
+	ev.action = buf;
+	ev.devpath = p + 1;
+
+	for (p = p + 1 + strlen(p + 1) + 1 ; p < end ; p += strlen(p) + 1)
+	{
+		if (!strncmp(p, "ACTION=", 7))
+			ev.action = p + 7;
+		else if (!strncmp(p, "DEVPATH=", 8))
+			ev.devpath = p + 8;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			ev.subsystem = p + 10;
+	}
+
+	if (ev.subsystem == NULL)
+		return;
+
+	name = strrchr(ev.devpath, '/');
+	name = (name != NULL) ? name + 1 : (char *) ev.devpath;
+
+	// Classify the event 
+	if (!strcmp(ev.subsystem, "memory") && sscanf(name, "memory%d", &ev.id) == 1)
+	{
+		if (!strcmp(ev.action, "add"))
+			ev.type = LMEV_BLK_ADD;
+		else if (!strcmp(ev.action, "remove"))
+			ev.type = LMEV_BLK_REMOVE;
+		else if (!strcmp(ev.action, "online"))
+			ev.type = LMEV_BLK_ONLINE;
+		else if (!strcmp(ev.action, "offline"))
+			ev.type = LMEV_BLK_OFFLINE;
+	}
+	else if (!strcmp(ev.subsystem, "cxl") && !strncmp(name, "region", 6))
+		ev.type = LMEV_REGION;
+	else if (!strcmp(ev.subsystem, "dax"))
+		ev.type = LMEV_DAX;
+
+	if (ev.type < 0)
+		return;
+
+	// Apply the event to the context 
+	switch (ev.type)
+	{
+		case LMEV_BLK_ONLINE:
+		case LMEV_BLK_OFFLINE:
+			online = (ev.type == LMEV_BLK_ONLINE);
+			pthread_mutex_lock(&ctx->lock);
+			if (ctx->blocks != NULL && ev.id <= ctx->max_id && ctx->index[ev.id] >= 0)
+			{
+				blk = &ctx->blocks[ctx->index[ev.id]];
+				if (mem_blk_refresh(blk) != 0)
+				{
+					blk->online = online;
+					blk->state = online ? LMST_ONLINE : LMST_OFFLINE;
+				}
+			}
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+
+		case LMEV_BLK_ADD:
+		case LMEV_BLK_REMOVE:
+			__atomic_or_fetch(&ctx->pending, LMRF_BLOCKS, __ATOMIC_RELEASE);
+			break;
+
+		default:
+			__atomic_or_fetch(&ctx->pending, LMRF_REGIONS, __ATOMIC_RELEASE);
+			break;
+	}
+
+	info(ctx, "uevent %s %s type: %d id: %d", ev.action, ev.devpath, ev.type, ev.id);
+
+	// Wake waiters and notify subscribers outside of the lock so callbacks 
+	// may call the library
+	pthread_mutex_lock(&ctx->lock);
+	ctx->evseq++;
+	pthread_cond_broadcast(&ctx->cond);
+	memcpy(subs, ctx->subs, sizeof(subs));
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (ctx->evnotify >= 0)
+		eventfd_write(ctx->evnotify, 1);
+
+	for ( i = 0 ; i < LMLN_SUBSCRIBERS ; i++ )
+		if (subs[i].fn != NULL && (subs[i].mask & (0x01 << ev.type)))
+			subs[i].fn(ctx, &ev, subs[i].arg);
+}
+
+/**
+ * Event listener thread 
+ *
+ * Waits on the uevent socket and the stop eventfd. If the kernel dropped 
+ * events because the socket buffer overflowed a full block rescan and state
+ * refresh is queued
+ */
+static void *mem_events_listen(void *arg)
+{
+	int n;
+	char *buf;
+	struct mem_ctx *ctx;
+	struct pollfd pfd[2];
+
+	ctx = (struct mem_ctx *) arg;
+
+	buf = malloc(LMLN_UEVENT_BUF + 1);
+	if (buf == NULL)
+		return NULL;
+
+	pfd[0].fd = ctx->evfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctx->evstop;
+	pfd[1].events = POLLIN;
+
+	for (;;)
+	{
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents)
+			break;
+
+		if (pfd[0].revents & POLLIN)
+		{
+			n = recv(ctx->evfd, buf, LMLN_UEVENT_BUF, 0);
+			if (n > 0)
+				mem_events_handle(ctx, buf, n);
+			else if (n == 0)
+				break;
+			else if (errno == ENOBUFS)
+			{
+				warn(ctx, "uevent socket overflowed. Queueing full refresh");
+				__atomic_or_fetch(&ctx->pending, LMRF_BLOCKS | LMRF_STATE | LMRF_REGIONS, __ATOMIC_RELEASE);
+			}
+			else if (errno != EINTR && errno != EAGAIN)
+				break;
+		}
+		else if (pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+			break;
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/**
+ * Get the number of events applied by the listener so far
+ */
+static unsigned long mem_events_seq(struct mem_ctx *ctx)
+{
+	unsigned long seq;
+
+	pthread_mutex_lock(&ctx->lock);
+	seq = ctx->evseq;
+	pthread_mutex_unlock(&ctx->lock);
+
+	return seq;
+}
+
+/**
+ * Start the background kernel uevent listener 
+ *
+ * Memory block online and offline events update the cached block. Block 
+ * add / remove and CXL region / dax events are queued and applied when the 
+ * caller runs mem_events_apply() 
+ * @param fd 	-1 to listen on NETLINK_KOBJECT_UEVENT. Otherwise a socket 
+ * 				(e.g. one end of a socketpair) that delivers messages in the 
+ * 				kernel uevent format. It remains owned by the caller
+ * @return 0 upon success, negative errno otherwise
+ */
+int mem_events_start(struct mem_ctx *ctx, int fd)
+{
+	int rv;
+	struct sockaddr_nl sa;
+
+	// Validate inputs 
+	if (ctx == NULL)
+		return -EINVAL;
+
+	if (ctx->evfd >= 0)
+		return -EBUSY;
+
+	ctx->evown = 0;
+	if (fd < 0)
+	{
+		fd = socket(AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+		if (fd < 0)
+		{
+			rv = -errno;
+			err(ctx, "Unable to open uevent socket: %d - %s", errno, strerror(errno));
+			goto end;
+		}
+
+		memset(&sa, 0, sizeof(sa));
+		sa.nl_family = AF_NETLINK;
+		sa.nl_groups = 1;
+		if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0)
+		{
+			rv = -errno;
+			err(ctx, "Unable to bind uevent socket: %d - %s", errno, strerror(errno));
+			close(fd);
+			goto end;
+		}
+		ctx->evown = 1;
+	}
+
+	ctx->evstop = eventfd(0, EFD_CLOEXEC);
+	if (ctx->evstop < 0)
+	{
+		rv = -errno;
+		goto err;
+	}
+
+	ctx->evfd = fd;
+	rv = pthread_create(&ctx->evthread, NULL, mem_events_listen, ctx);
+	if (rv != 0)
+	{
+		rv = -rv;
+		close(ctx->evstop);
+		ctx->evfd = -1;
+		goto err;
+	}
+
+	info(ctx, "Started uevent listener on fd %d", fd);
+
+	return 0;
+
+err:
+
+	if (ctx->evown)
+		close(fd);
+
+end:
+
+	return rv;
+}
+
+/**
+ * Stop the background kernel uevent listener 
+ * @return 0 upon success, non-zero if the listener was not running
+ */
+int mem_events_stop(struct mem_ctx *ctx)
+{
+	unsigned long long one;
+
+	if (ctx == NULL || ctx->evfd < 0)
+		return 1;
+
+	one = 1;
+	if (write(ctx->evstop, &one, sizeof(one)) != sizeof(one))
+		warn(ctx, "Unable to signal uevent listener: %d", errno);
+
+	pthread_join(ctx->evthread, NULL);
+
+	close(ctx->evstop);
+	if (ctx->evown)
+		close(ctx->evfd);
+
+	ctx->evfd = -1;
+	ctx->evstop = -1;
+
+	return 0;
+}
+
+/**
+ * Register a callback for kernel uevents 
+ *
+ * Callbacks run on the listener thread after the event has been applied
+ * @param mask 	bitfield of LMEM masks to deliver 
+ * @return subscription id (>= 0) upon success, negative errno otherwise
+ */
+int mem_events_subscribe(struct mem_ctx *ctx, unsigned mask, mem_event_fn fn, void *arg)
+{
+	int i;
+
+	if (ctx == NULL || fn == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	for ( i = 0 ; i < LMLN_SUBSCRIBERS ; i++ )
+		if (ctx->subs[i].fn == NULL)
+		{
+			ctx->subs[i].fn = fn;
+			ctx->subs[i].arg = arg;
+			ctx->subs[i].mask = mask;
+			break;
+		}
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (i == LMLN_SUBSCRIBERS)
+		return -ENOSPC;
+
+	return i;
+}
+
+/**
+ * Remove a callback registered with mem_events_subscribe()
+ * @return 0 upon success, non-zero otherwise
+ */
+int mem_events_unsubscribe(struct mem_ctx *ctx, int id)
+{
+	if (ctx == NULL || id < 0 || id >= LMLN_SUBSCRIBERS)
+		return 1;
+
+	pthread_mutex_lock(&ctx->lock);
+	memset(&ctx->subs[id], 0, sizeof(ctx->subs[id]));
+	pthread_mutex_unlock(&ctx->lock);
+
+	return 0;
+}
+
+/**
+ * Wait for the listener to apply another event or for the next poll interval 
+ *
+ * With a running listener this sleeps on the event condition and wakes up 
+ * every LMLN_WAIT_RECHECK_MS in case an event was dropped. Without one it 
+ * sleeps for a poll interval that doubles on each call
+ * @param seq 	value of mem_events_seq() taken before the caller checked its state
+ * @param until absolute CLOCK_MONOTONIC deadline. NULL to wait forever
+ * @param delay poll interval in ms 
+ * @return 0 if the caller should check its state again, -ETIMEDOUT if the deadline passed
+ */
+static int mem_events_wait(struct mem_ctx *ctx, unsigned long seq, const struct timespec *until, int *delay)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (until != NULL && (t.tv_sec > until->tv_sec || (t.tv_sec == until->tv_sec && t.tv_nsec >= until->tv_nsec)))
+		return -ETIMEDOUT;
+
+	// Wake at the next interval or the deadline whichever is first 
+	mem_events_deadline(&t, (ctx->evfd >= 0) ? LMLN_WAIT_RECHECK_MS : *delay);
+	if (until != NULL && (t.tv_sec > until->tv_sec || (t.tv_sec == until->tv_sec && t.tv_nsec > until->tv_nsec)))
+		t = *until;
+
+	if (ctx->evfd >= 0)
+	{
+		pthread_mutex_lock(&ctx->lock);
+		while (ctx->evseq == seq)
+			if (pthread_cond_timedwait(&ctx->cond, &ctx->lock, &t) == ETIMEDOUT)
+				break;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	else 
+	{
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) ;
+
+		*delay *= 2;
+		if (*delay > LMLN_WAIT_POLL_MAX_MS)
+			*delay = LMLN_WAIT_POLL_MAX_MS;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the sysfs file descriptor cache counters 
+ * @return 0 upon success, non-zero otherwise
+ */
+int mem_fdcache_get_stats(struct mem_ctx *ctx, struct mem_fdcache_stats *stats)
+{
+	struct fdcache_stats s;
+
+	if (ctx == NULL || stats == NULL)
+		return 1;
+
+	fdcache_get_stats(ctx->fdc, &s);
+
+	stats->hits = s.hits;
+	stats->misses = s.misses;
+	stats->evictions = s.evictions;
+	stats->size = s.size;
+	stats->capacity = s.capacity;
+
+	return 0;
+}
+
+/**
+ * Maximum number of descriptors the cache may be set to hold 
+ *
+ * Half of the soft RLIMIT_NOFILE so the application keeps the other half
+ */
+static unsigned mem_fdcache_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+		return 512;
+
+	return rl.rlim_cur / 2;
+}
+
+/**
+ * Size the descriptor cache for the block table 
+ *
+ * mem_blk_refresh() caches the online and state attributes of each block, 
+ * so polling every block needs two descriptors per block. The cache follows
+ * that between LMLN_FDCACHE_SIZE and half of the soft RLIMIT_NOFILE. 
+ * Descriptors are only opened when a block is refreshed, so blocks that are
+ * never polled do not pin kernel buffers
+ */
+static void mem_fdcache_resize(struct mem_ctx *ctx)
+{
+	unsigned size;
+
+	// Keep the size the application asked for 
+	if (ctx->fdc_fixed)
+		return;
+
+	size = 2 * ctx->num;
+	if (size < LMLN_FDCACHE_SIZE)
+		size = LMLN_FDCACHE_SIZE;
+	if (size > mem_fdcache_limit())
+		size = mem_fdcache_limit();
+
+	if (size == ctx->fdc_size)
+		return;
+
+	fdcache_set_capacity(ctx->fdc, size);
+	ctx->fdc_size = size;
+}
+
+/**
+ * Set the maximum number of sysfs attribute descriptors held open 
+ *
+ * By default the cache holds two descriptors per memory block, at least 
+ * LMLN_FDCACHE_SIZE, so every block can be polled with mem_blk_refresh() 
+ * without reopening its attributes. A size set here is kept when blocks are
+ * added. Callers that poll more blocks than it covers pay an open and close
+ * per read. The size is capped at half of the soft RLIMIT_NOFILE. 0 
+ * disables the cache
+ * @return the size that was applied
+ */
+unsigned mem_fdcache_set_size(struct mem_ctx *ctx, unsigned size)
+{
+	if (size > mem_fdcache_limit())
+		size = mem_fdcache_limit();
+
+	fdcache_set_capacity(ctx->fdc, size);
+	ctx->fdc_size = size;
+	ctx->fdc_fixed = 1;
+
+	return size;
+}
+
+/**
+ * Search for and return a cxl_memdev object matching name 
+ * @return struct cxl_memdev *. NULL if error. 
+ */
+struct cxl_memdev *mem_get_memdev(struct mem_ctx *ctx, char *name)
+{
+	struct cxl_memdev *memdev; 
+
+	cxl_memdev_foreach(ctx->cxl, memdev)  
+		if (!strcmp(cxl_memdev_get_devname(memdev), name))
+			return memdev;
+	
+	return NULL;
+}
+
+/**
+ * Return an array of pointers to cxl_memdevs
+ */
+struct cxl_memdev **mem_get_memdevs(struct mem_ctx *ctx)
+{
+	int i, num;
+	struct cxl_memdev *memdev;
+	struct cxl_memdev **array;
+
+	// Initialize variables 
+	i = 0;
+	num = mem_num_memdevs(ctx);
+	if (num == 0)
+		return NULL;
+	
+	// Allocate memory 
+	array = calloc(num, sizeof(*array));
+	
+	// Populate the array with the memdev pointers 
+	cxl_memdev_foreach(ctx->cxl, memdev)  
+		array[i++] = memdev;
+
+	// Sort the array
+	qsort(array, num, sizeof(*array), mem_compare_cxl_memdevs);
+	
+	return array;
+}
+
+/**
+ * Search for and return a cxl_region object matching name
+ * @return struct cxl_region* or NULL if not found
+ */
+struct cxl_region *mem_get_region(struct mem_ctx *ctx, char * name)
+{
+	struct cxl_bus *bus;
+	struct cxl_decoder *decoder;
+	struct cxl_region *region;
+	
+	cxl_bus_foreach(ctx->cxl, bus)
+		cxl_decoder_foreach(cxl_bus_get_port(bus), decoder)
+			cxl_region_foreach(decoder, region)
+				if (!strcmp(name, cxl_region_get_devname(region)))
+					goto end;
+
+	region = NULL;
+
+end:
+
+	return region;
+}
+
+/**
+ * Return an array of pointers to cxl_regions 
+ */
+struct cxl_region **mem_get_regions(struct mem_ctx *ctx)
+{
+	struct cxl_bus *bus;
+	struct cxl_decoder *decoder;
+	struct cxl_region *region;
+	struct cxl_region **array;
+	int i, num;
+
+	if (ctx->regions != NULL)
+		return ctx->regions;
+
+	// Initialize variables 
+	i = 0;
+	num = mem_num_regions(ctx);
+	if (num == 0)
+		return NULL;
+	
+	// Allocate memory 
+	array = calloc(num, sizeof(*array));
+	
+	// Loop through CXL tree and get regions 
+	cxl_bus_foreach(ctx->cxl, bus)
+		cxl_decoder_foreach(cxl_bus_get_port(bus), decoder)
+			cxl_region_foreach(decoder, region)
+				array[i++] = region;
+	
+	// Sort the array
+	qsort(array, num, sizeof(*array), mem_compare_cxl_regions);
+
+	ctx->num_regions = num;
+	ctx->regions = array;
+
+	return array;	
+}
+
+/**
+ * Search for and return root cxl_decoder object 
+ * @return struct cxl_decoder* or NULL if error
+ */
+struct cxl_decoder *mem_get_root_decoder(struct mem_ctx *ctx)
+{
+	struct cxl_bus *bus;
+	struct cxl_port *port;
+	struct cxl_decoder *decoder;
+
+	decoder = NULL;
+
+	bus = cxl_bus_get_first(ctx->cxl);
+	if (bus == NULL)
+	{
+		err(ctx, "Unable to obtain first cxl bus");
+		goto end;
+	}
+
+	port = cxl_bus_get_port(bus);
+	if (port == NULL)
+	{
+		err(ctx, "Unable to obtain first cxl bus port on bus %s", cxl_bus_get_devname(bus));
+		goto end;
+	}
+
+	decoder = cxl_decoder_get_first(port);	
+
+end:
+
+	return decoder;
+}
+
+/**
+ * Return a const char * (string) representation of enum LMPL
+ */
+const char *mem_lmpl(int policy)
+{
+	if (policy < 0 || policy >= LMPL_MAX)
+		return NULL;
+	return _LMPL[policy];
+}
+
+/**
+ * Return a const char * (string) representation of enum LMST
+ */
+const char *mem_lmst(int state)
+{
+	if (state < 0 || state >= LMST_MAX)
+		return NULL;
+	return _LMST[state];
+}
+
+/**
+ * Return a const char * (string) representation of enum LMZN
+ */
+const char *mem_lmzn(int zone)
+{
+	if (zone < 0 || zone >= LMZN_MAX)
+		return NULL;
+	return _LMZN[zone];
+}
+
+/**
+ * Return current library log priority level 
+ */
+int	mem_log_get_priority(struct mem_ctx *ctx)
+{
+	return ctx->log->priority;
+}
+
+/**
+ * Set the log library destination to use
+ * @param dst 	int from enum LMLD 
+ */
+void mem_log_set_destination(struct mem_ctx *ctx, int dst, char *filepath)
+{
+	if (dst == LMLD_SYSLOG)
+		ctx->log->log_fn = log_to_syslog;
+	else if (dst == LDST_NULL)
+		ctx->log->log_fn = log_to_null;
+	else if (dst == LDST_FILE & filepath != NULL)
+	{
+		ctx->log->file = fopen(filepath, "a");
+		ctx->log->log_fn = log_to_file;
+	}
+	else 
+		ctx->log->log_fn = log_to_stdio;
+	
+	info(ctx, "Set log destination to %d %s", dst, log_dst_to_str(dst));
+}
+
+/**
+ * Set logging function 
+ */
+void mem_log_set_fn(struct mem_ctx *ctx,
+		void (*mem_log_fn)(	struct mem_ctx *ctx, 
+							int priority,
+							const char *fn,
+							int line, 
+							const char *format, 
+							va_list args))
+{
+	ctx->log->log_fn = (log_fn) mem_log_fn;
+	info(ctx, "custom logging function %p registered\n", mem_log_fn);
+}
+
+/**
+ * Set library log priority level 
+ */
+void mem_log_set_priority(struct mem_ctx *ctx, int priority)
+{
+	if (priority > LOG_DEBUG)
+		priority = LOG_DEBUG;
+	if (priority < 0 )
+		priority = 0;	
+
+	ctx->log->priority = priority;
+	info(ctx, "logging priority set to %d - %s\n", priority, log_priority_to_str(priority));
+}
+
+/**
+ * Get the Interleave granulariy presented by first port of the bus 
+ */
+int mem_memdev_get_interleave_granularity(struct mem_ctx *ctx, struct cxl_memdev *memdev)
+{
+	unsigned int rv; 
+	struct cxl_bus *bus;
+	struct cxl_port *parent, *port; 
+	struct cxl_decoder *decoder;
+
+	rv = 0;
+
+	bus = cxl_memdev_get_bus(memdev);
+	if (bus == NULL)
+	{
+		rv = 0;
+		err(ctx, "Unable to obtain cxl_bus for memdev %s: %d", cxl_memdev_get_devname(memdev), rv);
+		goto end;
+	}
+
+	parent = cxl_bus_get_port(bus);
+	if (parent == NULL)
+	{
+		rv = 0;
+		err(ctx, "Unable to obtain cxl_port for bus %s: %d", cxl_bus_get_devname(bus), rv);
+		goto end;
+	}
+
+	port = cxl_port_get_first(parent);
+	if (port == NULL)
+	{
+		rv = 0;
+		err(ctx, "Unable to obtain first cxl_port for parent %s: %d", cxl_port_get_devname(parent), rv);
+		goto end;
+	}
+
+	decoder = cxl_decoder_get_first(port);
+	if (decoder == NULL)
+	{
+		rv = 0;
+		err(ctx, "Unable to obtain decoder for cxl_port %s: %d", cxl_port_get_devname(port), rv);
+		goto end;
+	}
+
+	rv = cxl_decoder_get_interleave_granularity(decoder);
+
+end:
+
+	return rv;
+}
+
+/**
+ * Is a memdev free to be added to a new region 
+ * @return 1 for true, 0 for false
+ */
+int mem_memdev_is_available(struct mem_ctx *ctx, struct cxl_memdev *memdev)
+{
+	int rv;
+	struct cxl_endpoint *endpoint;
+	struct cxl_port *port;
+	struct cxl_decoder *decoder;
+	struct cxl_region *region;
+
+	rv = 0;
+
+	// Check if memdev is even enabled 
+	rv = cxl_memdev_is_enabled(memdev);
+	if (rv == 0)
+		goto end;
+
+	// Get endpoint 
+	endpoint = cxl_memdev_get_endpoint(memdev);
+	if (endpoint == NULL)
+	{
+		rv = 0;
+		err(ctx, "Unable to get cxl_endpoint for memdev %s", cxl_memdev_get_devname(memdev));
+		goto end;
+	}
+	
+	// Check if endpoint is enabled 
+	rv = cxl_endpoint_is_enabled(endpoint);
+	if (rv == 0)
+		goto end;
+
+	// Get the port 
+	port = cxl_endpoint_get_port(endpoint);
+	if (port == NULL)
+	{
+		rv = 0;
+		err(ctx, "Unable to get cxl_port for cxl_endpoint %s", cxl_endpoint_get_devname(endpoint));
+		goto end;
+	}
+
+	// Check if port is enabled 
+	rv = cxl_port_is_enabled(port);
+	if (rv == 0)
+		goto end;
+
+	// Get Decoder 
+	decoder = cxl_decoder_get_first(port);
+	if (decoder == NULL)
+	{
+		rv = 0;
+		err(ctx, "Unable to get cxl_decoder for cxl_port %s", cxl_port_get_devname(port));
+		goto end;
+	}
+
+	region = cxl_decoder_get_region(decoder);
+	if (region == NULL)
+		rv = 1;
+	else 
+		rv = 0;
+
+end:
+
+	return rv;
+}
+
+/**
+ * Sample the idle pages of a list of memory blocks through the page_idle bitmap
+ *
+ * The bitmap holds one bit per page frame so a block is a whole number of 
+ * 64 bit words at an offset given by its id. Runs of consecutive online 
+ * blocks are written and read back in chunks of up to LMLN_IDLE_CHUNK 
+ * words. Writing ones marks the pages idle and any access clears the bit.
+ * The caller picks the blocks once, so a block that changes state during 
+ * the interval is handled the same way in both passes. The kernel only 
+ * tracks the bit for LRU pages and free pages read back as accessed, so 
+ * the free pages of each block are counted from /proc/kpageflags at the 
+ * end of the interval and added to its idle bytes
+ * @param ids 	array of ids of online blocks. -1 entries are not sampled and left at 0
+ * @param idle 	set to the idle and free bytes of each block 
+ * @return 0 upon success, negative errno otherwise
+ */
+static int mem_idle_sample(struct mem_ctx *ctx, int *ids, int num, int interval_ms, unsigned long long *idle)
+{
+	int rv, fd, pass, i, j, k, per;
+	long page_size;
+	unsigned long long block_size, words, *buf;
+	ssize_t len, n;
+	off_t off;
+	struct timespec until;
+	struct mem_blk *blk;
+	struct mem_blk_pages pages;
+	struct mem_kpf kpf;
+
+	// Initialize variables 
+	rv = 0;
+	fd = -1;
+	buf = NULL;
+
+	for ( i = 0 ; i < num ; i++ )
+		idle[i] = 0;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	block_size = mem_system_get_blocksize(ctx);
+	words = (page_size > 0) ? block_size / page_size / 64 : 0;
+	if (words == 0)
+		return -EINVAL;
+
+	per = LMLN_IDLE_CHUNK / words;
+	if (per < 1)
+		per = 1;
+
+	buf = malloc(per * words * sizeof(*buf));
+	if (buf == NULL)
+		return -ENOMEM;
+
+	fd = open(LMFP_PAGE_IDLE, O_RDWR|O_CLOEXEC);
+	if (fd < 0)
+	{
+		rv = -errno;
+		err(ctx, "Could not open %s: %d", LMFP_PAGE_IDLE, rv);
+		goto end;
+	}
+
+	// Pass 0 marks the pages idle, pass 1 counts the pages still idle
+	for ( pass = 0 ; pass < 2 ; pass++ )
+	{
+		if (pass == 0)
+		{
+			memset(buf, 0xff, per * words * sizeof(*buf));
+		}
+		else if (interval_ms > 0)
+		{
+			mem_events_deadline(&until, interval_ms);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) ;
+		}
+
+		for ( i = 0 ; i < num ; i = j )
+		{
+			if (ids[i] < 0)
+			{
+				j = i + 1;
+				continue;
+			}
+
+			for ( j = i + 1 ; j < num && j - i < per ; j++ )
+				if (ids[j] < 0 || ids[j] != ids[j-1] + 1)
+					break;
+
+			off = (off_t) ids[i] * words * sizeof(*buf);
+			len = (j - i) * words * sizeof(*buf);
+
+			if (pass == 0)
+				n = pwrite(fd, buf, len, off);
+			else 
+				n = pread(fd, buf, len, off);
+
+			if (n != len)
+			{
+				rv = (n < 0) ? -errno : -EIO;
+				err(ctx, "Could not access %s for memory block %d: %d", LMFP_PAGE_IDLE, ids[i], rv);
+				goto end;
+			}
+
+			if (pass == 1)
+				for ( k = i ; k < j ; k++ )
+					idle[k] = mem_popcount(&buf[(k - i) * words], words) * page_size;
+		}
+	}
+
+	// Free pages never have the idle bit set 
+	rv = mem_kpf_open(ctx, &kpf);
+	if (rv != 0)
+	{
+		err(ctx, "Could not count the free pages of the memory blocks: %d", rv);
+		goto end;
+	}
+
+	for ( i = 0 ; i < num && rv == 0 ; i++ )
+	{
+		blk = (ids[i] < 0) ? NULL : mem_blkid_find(ctx, ids[i]);
+		if (blk == NULL)
+			continue;
+
+		rv = mem_blk_scan(blk, &kpf, &pages);
+		if (rv == 0)
+			idle[i] += pages.free * page_size;
+		else 
+			err(ctx, "Could not count the free pages of memory block %d: %d", ids[i], rv);
+	}
+
+	mem_kpf_close(&kpf);
+
+end:
+
+	if (fd >= 0)
+		close(fd);
+	if (buf != NULL)
+		free(buf);
+
+	return rv;
+}
+
+/**
+ * Close the /proc page tables and free the scan buffers 
+ */
+static void mem_kpf_close(struct mem_kpf *kpf)
+{
+	if (kpf->flags_fd >= 0)
+		close(kpf->flags_fd);
+	if (kpf->count_fd >= 0)
+		close(kpf->count_fd);
+	if (kpf->flags != NULL)
+		free(kpf->flags);
+	if (kpf->counts != NULL)
+		free(kpf->counts);
+
+	kpf->flags_fd = -1;
+	kpf->count_fd = -1;
+	kpf->flags = NULL;
+	kpf->counts = NULL;
+}
+
+/**
+ * Open the /proc page tables for mem_blk_scan() 
+ *
+ * /proc/kpagecount is optional. Without it no pages are counted as mapped.
+ * Cost ordering works without /proc/kpageflags so failing to open it is 
+ * only a warning. Callers that need the page counts report the error
+ * @return 0 upon success, negative errno otherwise
+ */
+static int mem_kpf_open(struct mem_ctx *ctx, struct mem_kpf *kpf)
+{
+	int rv;
+
+	kpf->count_fd = -1;
+	kpf->flags = malloc((LMLN_KPF_CHUNK + LMLN_KPF_LANES) * sizeof(*kpf->flags));
+	kpf->counts = malloc((LMLN_KPF_CHUNK + LMLN_KPF_LANES) * sizeof(*kpf->counts));
+
+	kpf->flags_fd = open(LMFP_KPAGEFLAGS, O_RDONLY|O_CLOEXEC);
+	if (kpf->flags_fd < 0)
+	{
+		rv = -errno;
+		warn(ctx, "Could not open %s: %d", LMFP_KPAGEFLAGS, rv);
+		mem_kpf_close(kpf);
+		return rv;
+	}
+
+	if (kpf->flags == NULL || kpf->counts == NULL)
+	{
+		mem_kpf_close(kpf);
+		return -ENOMEM;
+	}
+
+	kpf->count_fd = open(LMFP_KPAGECOUNT, O_RDONLY|O_CLOEXEC);
+	if (kpf->count_fd < 0)
+		warn(ctx, "Could not open %s. Mapped pages are not counted: %d", LMFP_KPAGECOUNT, errno);
+
+	return 0;
+}
+
+/**
+ * Scan the blocks of one mem_kpf_job slice
+ */
+static void *mem_kpf_worker(void *arg)
+{
+	int i;
+	struct mem_kpf kpf;
+	struct mem_kpf_job *job = (struct mem_kpf_job *) arg;
+
+	for ( i = job->first ; i < job->end ; i++ )
+		memset(&job->pages[i], 0, sizeof(job->pages[i]));
+
+	job->rv = mem_kpf_open(job->ctx, &kpf);
+	if (job->rv != 0)
+		return NULL;
+
+	for ( i = job->first ; i < job->end ; i++ )
+		if (job->blks[i] == NULL || mem_blk_scan(job->blks[i], &kpf, &job->pages[i]) != 0)
+			job->failed++;
+
+	mem_kpf_close(&kpf);
+
+	return NULL;
+}
+
+/**
+ * Stop the lease manager and free its state. The state file is kept
+ */
+void mem_lease_close(struct mem_ctx *ctx)
+{
+	mem_pools_free(ctx);
+
+	if (ctx->leases != NULL)
+		free(ctx->leases);
+	if (ctx->lease_path != NULL)
+		free(ctx->lease_path);
+
+	ctx->leases = NULL;
+	ctx->num_leases = 0;
+	ctx->lease_path = NULL;
+	ctx->lease_open = 0;
+}
+
+/**
+ * Get a lease by index 
+ * @param index 	0 to mem_lease_num() - 1
+ * @return 0 upon success, -EINVAL if index is out of range
+ */
+int mem_lease_get(struct mem_ctx *ctx, int index, struct mem_lease *lease)
+{
+	if (ctx == NULL || lease == NULL || index < 0 || index >= ctx->num_leases)
+		return -EINVAL;
+
+	*lease = ctx->leases[index];
+
+	return 0;
+}
+
+/**
+ * Lease a contiguous run of offline memory blocks 
+ *
+ * The run is carved from the buddy free map so it starts at a block id 
+ * aligned to the run size rounded up to a power of two. The pool with the 
+ * smallest free chunk that fits is used to keep large chunks whole. The 
+ * blocks of the chosen chunk are re-read first. Blocks that were onlined 
+ * since the free map was built are dropped from it and another chunk is 
+ * tried. The blocks stay offline, the caller onlines them
+ * @param node 		NUMA node of the blocks. -1 for any 
+ * @param region 	region the blocks must be part of. NULL for any 
+ * @param num 		number of blocks 
+ * @param owner 	name of the tenant. No white space
+ * @param lease 	set to the lease. May be NULL
+ * @return 0 upon success, -ENOSPC if no free run is large enough, negative errno otherwise
+ */
+int mem_lease_grant(struct mem_ctx *ctx, int node, struct cxl_region *region, int num, const char *owner, struct mem_lease *lease)
+{
+	int rv, i, k, o, best, best_order, id, online;
+	struct mem_pool *p;
+	struct mem_lease *l;
+	struct mem_blk *blk;
+
+	// Validate inputs 
+	if (ctx == NULL || num <= 0 || owner == NULL || owner[0] == 0 
+	    || strlen(owner) >= sizeof(l->owner) || strpbrk(owner, " \t\n") != NULL)
+		return -EINVAL;
+
+	for ( k = 0 ; (1 << k) < num ; k++ ) ;
+	if (k >= LMLN_BUDDY_ORDERS)
+		return -EINVAL;
+
+	rv = mem_lease_sync(ctx);
+	if (rv != 0)
+		return rv;
+
+	l = realloc(ctx->leases, (ctx->num_leases + 1) * sizeof(*l));
+	if (l == NULL)
+		return -ENOMEM;
+	ctx->leases = l;
+
+	for (;;)
+	{
+		// Best fit across the pools that match 
+		best = -1;
+		best_order = LMLN_BUDDY_ORDERS;
+		for ( i = 0 ; i < ctx->num_pools ; i++ )
+		{
+			p = &ctx->pools[i];
+			if ((node >= 0 && p->node != node) || (region != NULL && p->region != region))
+				continue;
+
+			for ( o = k ; o < best_order ; o++ )
+				if (p->head[o] >= 0)
+				{
+					best = i;
+					best_order = o;
+					break;
+				}
+		}
+
+		if (best < 0)
+		{
+			err(ctx, "No free run of %d memory blocks on node %d", num, node);
+			return -ENOSPC;
+		}
+
+		p = &ctx->pools[best];
+		id = mem_pool_alloc(p, k);
+
+		// The free map may be behind the kernel. Re-read the chunk 
+		online = 0;
+		for ( i = id ; i < id + (1 << k) ; i++ )
+		{
+			blk = mem_blkid_find(ctx, i);
+			if (blk != NULL)
+				mem_blk_refresh(blk);
+			if ((blk == NULL || blk->online) && i < id + num)
+				online++;
+		}
+
+		// Return the offline blocks past num, or of the whole chunk if the 
+		// run is not usable. Online blocks stay out of the free map
+		for ( i = (online == 0) ? id + num : id ; i < id + (1 << k) ; i++ )
+		{
+			blk = mem_blkid_find(ctx, i);
+			if (blk != NULL && !blk->online)
+				mem_pool_free(p, i, 0);
+		}
+
+		if (online == 0)
+			break;
+
+		warn(ctx, "%d memory blocks of run %d-%d are no longer offline", online, id, id + num - 1);
+	}
+
+	l = &ctx->leases[ctx->num_leases++];
+	l->first = id;
+	l->num = num;
+	l->node = p->node;
+	strcpy(l->owner, owner);
+
+	rv = mem_lease_save(ctx);
+	if (rv != 0)
+	{
+		ctx->num_leases--;
+		for ( i = id ; i < id + num ; i++ )
+			mem_pool_free(p, i, 0);
+		return rv;
+	}
+
+	info(ctx, "Leased memory blocks %d-%d of node %d to %s", id, id + num - 1, p->node, owner);
+
+	if (lease != NULL)
+		*lease = *l;
+
+	return 0;
+}
+
+/**
+ * Get the number of leases 
+ */
+int mem_lease_num(struct mem_ctx *ctx)
+{
+	if (ctx == NULL)
+		return 0;
+
+	return ctx->num_leases;
+}
+
+/**
+ * Start the lease manager 
+ *
+ * Leases are loaded from the state file if it exists and every later 
+ * grant and release rewrites it. The free map is built from the offline 
+ * blocks that are not leased and is rebuilt after the block table changes
+ * @param path 	state file. NULL to keep the leases in memory only
+ * @return 0 upon success, negative errno otherwise
+ */
+int mem_lease_open(struct mem_ctx *ctx, const char *path)
+{
+	int rv, n;
+	FILE *fp;
+	struct mem_lease l, *tmp;
+	char line[LMLN_LEASE_LINE];
+
+	// Initialize variables 
+	rv = 0;
+	fp = NULL;
+
+	mem_lease_close(ctx);
+
+	if (path != NULL)
+	{
+		ctx->lease_path = strdup(path);
+		if (ctx->lease_path == NULL)
+			return -ENOMEM;
+
+		fp = fopen(path, "r");
+		if (fp == NULL && errno != ENOENT)
+		{
+			rv = -errno;
+			err(ctx, "Could not open lease state file %s: %d", path, rv);
+			goto err;
+		}
+	}
+
+	// Each line is: first num node owner
+	while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		memset(&l, 0, sizeof(l));
+		n = sscanf(line, "%d %d %d %63s", &l.first, &l.num, &l.node, l.owner);
+		if (n != 4 || l.first < 0 || l.num <= 0)
+		{
+			warn(ctx, "Skipping malformed lease: %s", line);
+			continue;
+		}
+
+		tmp = realloc(ctx->leases, (ctx->num_leases + 1) * sizeof(*tmp));
+		if (tmp == NULL)
+		{
+			rv = -ENOMEM;
+			goto err;
+		}
+		ctx->leases = tmp;
+		ctx->leases[ctx->num_leases++] = l;
+	}
+
+	if (fp != NULL)
+		fclose(fp);
+	fp = NULL;
+
+	ctx->lease_open = 1;
+	ctx->lease_stale = 1;
+
+	rv = mem_lease_sync(ctx);
+	if (rv != 0)
+		goto err;
+
+	info(ctx, "Loaded %d leases", ctx->num_leases);
+
+	return 0;
+
+err:
+
+	if (fp != NULL)
+		fclose(fp);
+
+	mem_lease_close(ctx);
+
+	return rv;
+}
+
+/**
+ * End the lease that starts at a block 
+ *
+ * Blocks of the lease that are offline go back to the free map. Offline 
+ * the blocks before releasing them, blocks still online are only added 
+ * back when the free map is next rebuilt after they are offlined
+ * @param first 	first block id of the lease 
+ * @return 0 upon success, -ENOENT if no lease starts at first, negative errno otherwise
+ */
+int mem_lease_release(struct mem_ctx *ctx, int first)
+{
+	int rv, i, j;
+	struct mem_lease l;
+	struct mem_pool *p;
+	struct mem_blk *blk;
+
+	// Validate inputs 
+	if (ctx == NULL)
+		return -EINVAL;
+
+	rv = mem_lease_sync(ctx);
+	if (rv != 0)
+		return rv;
+
+	for ( i = 0 ; i < ctx->num_leases ; i++ )
+		if (ctx->leases[i].first == first)
+			break;
+
+	if (i == ctx->num_leases)
+		return -ENOENT;
+
+	l = ctx->leases[i];
+	memmove(&ctx->leases[i], &ctx->leases[i+1], (ctx->num_leases - i - 1) * sizeof(l));
+	ctx->num_leases--;
+
+	rv = mem_lease_save(ctx);
+	if (rv != 0)
+	{
+		memmove(&ctx->leases[i+1], &ctx->leases[i], (ctx->num_leases - i) * sizeof(l));
+		ctx->leases[i] = l;
+		ctx->num_leases++;
+		return rv;
+	}
+
+	for ( j = l.first ; j < l.first + l.num ; j++ )
+	{
+		blk = mem_blkid_find(ctx, j);
+		p = mem_pool_find(ctx, j);
+		if (blk != NULL && p != NULL && !blk->online)
+			mem_pool_free(p, j, 0);
+	}
+
+	info(ctx, "Released memory blocks %d-%d of %s", l.first, l.first + l.num - 1, l.owner);
+
+	return 0;
+}
+
+/**
+ * Write the leases to the state file 
+ *
+ * A temporary file is written and renamed over the state file so a crash
+ * never leaves a partial file
+ * @return 0 upon success, negative errno otherwise
+ */
+static int mem_lease_save(struct mem_ctx *ctx)
+{
+	int rv, i;
+	FILE *fp;
+	char path[LMLN_FILEPATH];
+
+	if (ctx->lease_path == NULL)
+		return 0;
+
+	snprintf(path, sizeof(path), "%s.tmp", ctx->lease_path);
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+	{
+		rv = -errno;
+		err(ctx, "Could not write lease state file %s: %d", path, rv);
+		return rv;
+	}
+
+	fprintf(fp, "# first num node owner\n");
+	for ( i = 0 ; i < ctx->num_leases ; i++ )
+		fprintf(fp, "%d %d %d %s\n", ctx->leases[i].first, ctx->leases[i].num, ctx->leases[i].node, ctx->leases[i].owner);
+
+	rv = 0;
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+		rv = -errno;
+	if (fclose(fp) != 0 && rv == 0)
+		rv = -errno;
+	if (rv == 0 && rename(path, ctx->lease_path) != 0)
+		rv = -errno;
+
+	if (rv != 0)
+	{
+		err(ctx, "Could not write lease state file %s: %d", ctx->lease_path, rv);
+		unlink(path);
+	}
+
+	return rv;
+}
+
+/**
+ * Rebuild the pools if the block table changed since they were built
+ * @return 0 upon success, -EINVAL if the lease manager is not open, negative errno otherwise
+ */
+static int mem_lease_sync(struct mem_ctx *ctx)
+{
+	if (!ctx->lease_open)
+		return -EINVAL;
+
+	if (!ctx->lease_stale && ctx->lease_seq == mem_events_seq(ctx))
+		return 0;
+
+	return mem_pools_init(ctx);
+}
+
+/**
+ * Parse a sysfs list attribute such as "0-3,8,10-11"
+ * @param ids 	array filled with up to max values in list order 
+ * @return the number of values stored in ids
+ */
+static int mem_list_parse(const char *buf, int *ids, int max)
+{
+	int n, first, last;
+	char *e;
+
+	n = 0;
+
+	while (*buf != 0 && n < max)
+	{
+		first = strtol(buf, &e, 10);
+		if (e == buf)
+			break;
+
+		last = first;
+		if (*e == '-')
+		{
+			buf = e + 1;
+			last = strtol(buf, &e, 10);
+			if (e == buf)
+				break;
+		}
+
+		for ( ; first <= last && n < max ; first++ )
+			ids[n++] = first;
+
+		buf = e;
+		if (*buf == ',')
+			buf++;
+	}
+
+	return n;
+}
+
+/**
+ * Get the held directory fd of the memory directory, opening it if needed
+ * @return directory fd. negative errno if it could not be opened
+ */
+static int mem_memfd(struct mem_ctx *ctx)
+{
+	if (ctx->memfd >= 0)
+		return ctx->memfd;
+
+	ctx->memfd = open(LMFP_MEM_DIR, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (ctx->memfd < 0)
+	{
+		err(ctx, "Failed to open memory directory: %s %d - %s", LMFP_MEM_DIR, errno, strerror(errno));
+		return -errno;
+	}
+
+	return ctx->memfd;
+}
+
+/**
+ * Create a new lib mem context 
+ */
+int mem_new(struct mem_ctx **ctx)
+{
+	int rv; 
+	struct mem_ctx *c; 
+	pthread_condattr_t attr;
+
+	rv = 1; 
+
+	// Allocate memory for the object 
+	c = calloc(1, sizeof(struct mem_ctx));
+	if (c == NULL) 
+		return -ENOMEM;
+
+	c->refcount = 1;
+	c->memfd = -1;
+	c->threads = 1;
+	c->io_uring = 0;
+	c->online_threads = 1;
+	c->offline_threads = 1;
+	c->evfd = -1;
+	c->evstop = -1;
+	c->evnotify = -1;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&c->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	// Create the sysfs file descriptor cache. Each open sysfs file pins a 
+	// kernel buffer. It grows with the block table, see mem_fdcache_resize()
+	c->fdc_size = (mem_fdcache_limit() < LMLN_FDCACHE_SIZE) ? mem_fdcache_limit() : LMLN_FDCACHE_SIZE;
+	rv = fdcache_new(&c->fdc, c->fdc_size);
+	if (rv != 0)
+	{
+		free(c);
+		goto end;
+	}
+
+	// Get a cxl context 
+	rv = cxl_new(&c->cxl);
+	if (rv != 0)
+	{
+		fdcache_free(c->fdc);
+		free(c);
+		goto end;
+	}
+
+	// Set up logger 
+	c->log = log_init("libmem", LDST_SYSLOG, LOG_ERR, 1, NULL);
+	
+	log_info(c->log, "mem_ctx created at: %p\n", c);
+	log_dbg(c->log, "log_priority=%d\n", c->log->priority);
+	
+	// Store logger object into mem_ctx 
+	*ctx = c;
+
+	rv = 0;
+
+end:
+
+	return rv; 
+}
+
+/**
+ * Count and return the number of CXL rmemdevs
+ */
+int mem_num_memdevs(struct mem_ctx* ctx)
+{
+	int num; 
+	struct cxl_memdev *memdev; 
+
+	num = 0;
+
+	cxl_memdev_foreach(ctx->cxl, memdev)  
+		num++;	
+
+	return num;
+}
+
+/**
+ * Count and return the number of CXL regions 
+ */
+int mem_num_regions(struct mem_ctx *ctx)
+{
+	int num; 
+	struct cxl_bus *bus;
+	struct cxl_decoder *decoder;
+	struct cxl_region *region;
+
+	if (ctx->regions != NULL)
+		return ctx->num_regions;
+
+	num = 0;
+
+	// Loop through the cxl bus to count the number of cxl_regions
+	cxl_bus_foreach(ctx->cxl, bus)
+		cxl_decoder_foreach(cxl_bus_get_port(bus), decoder)
+			cxl_region_foreach(decoder, region)
+				num++;
+
+	return num;
+}
+
+/**
+ * Set the node of every memory block from the node block id ranges 
+ *
+ * Both the block array and the ranges are sorted by id so this is a merge
+ */
+static void mem_node_assign(struct mem_ctx *ctx)
+{
+	int i, j;
+	struct mem_blk *blk;
+
+	j = 0;
+	for ( i = 0 ; i < ctx->num ; i++ )
+	{
+		blk = &ctx->blocks[i];
+
+		while (j < ctx->num_nranges && ctx->nranges[j].end <= blk->id)
+			j++;
+
+		if (j < ctx->num_nranges && ctx->nranges[j].first <= blk->id)
+			blk->node = ctx->nranges[j].node;
+		else 
+			blk->node = -1;
 	}
+}
 
-	// Open the directory 
-	d = opendir(LMFP_MEM_DIR);	
+/**
+ * Read the CPUs of a NUMA node into a cpu set
+ * @return the number of CPUs in set
+ */
+static int mem_node_cpulist(struct mem_ctx *ctx, int node, cpu_set_t *set)
+{
+	int i, n; 
+	int cpus[CPU_SETSIZE];
+	char path[LMLN_FILEPATH];
+	char buf[LMLN_SYSFS_ATTR_SIZE];
+
+	CPU_ZERO(set);
+
+	sprintf(path, "%s/node%d/cpulist", LMFP_NODE_DIR, node);
+	if (mem_sysfs_read(ctx, path, buf) < 0)
+		return 0;
+
+	n = mem_list_parse(buf, cpus, CPU_SETSIZE);
+	for ( i = 0 ; i < n ; i++ )
+		if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+			CPU_SET(cpus[i], set);
+
+	return CPU_COUNT(set);
+}
+
+/**
+ * Get the CPUs that should run block operations for a NUMA node
+ *
+ * A node without CPUs, such as the node of a CXL memory region, uses the 
+ * CPUs of the nearest node in its distance table that has any
+ * @return the number of CPUs in set. 0 if none were found
+ */
+static int mem_node_cpus(struct mem_ctx *ctx, int node, cpu_set_t *set)
+{
+	int i, n, num, best;
+	int nodes[LMLN_NODES_MAX];
+	int dist[LMLN_NODES_MAX];
+	char path[LMLN_FILEPATH];
+	char buf[LMLN_SYSFS_ATTR_SIZE];
+
+	CPU_ZERO(set);
+
+	if (node < 0)
+		return 0;
+
+	n = mem_node_cpulist(ctx, node, set);
+	if (n > 0)
+		return n;
+
+	// The distance table has one column per online node in ascending order
+	sprintf(path, "%s/online", LMFP_NODE_DIR);
+	if (mem_sysfs_read(ctx, path, buf) < 0)
+		return 0;
+	num = mem_list_parse(buf, nodes, LMLN_NODES_MAX);
+
+	sprintf(path, "%s/node%d/distance", LMFP_NODE_DIR, node);
+	if (mem_sysfs_read(ctx, path, buf) < 0)
+		return 0;
+
+	// Distances are separated by spaces, not commas
+	for ( i = 0 ; i < (int) strlen(buf) ; i++ )
+		if (buf[i] == ' ')
+			buf[i] = ',';
+	if (mem_list_parse(buf, dist, LMLN_NODES_MAX) < num)
+		return 0;
+
+	// Try the other nodes from nearest to farthest 
+	for ( ; ; )
+	{
+		best = -1;
+		for ( i = 0 ; i < num ; i++ )
+			if (nodes[i] != node && dist[i] >= 0 && (best < 0 || dist[i] < dist[best]))
+				best = i;
+
+		if (best < 0)
+			return 0;
+
+		n = mem_node_cpulist(ctx, nodes[best], set);
+		if (n > 0)
+		{
+			info(ctx, "Using CPUs of node %d for CPU-less node %d", nodes[best], node);
+			return n;
+		}
+
+		dist[best] = -1;
+	}
+}
+
+/**
+ * Free the node block id ranges 
+ */
+static void mem_node_free(struct mem_ctx *ctx)
+{
+	if (ctx->nranges != NULL)
+		free(ctx->nranges);
+
+	ctx->nranges = NULL;
+	ctx->num_nranges = 0;
+}
+
+/**
+ * Build the node block id ranges from the node directories
+ *
+ * Each /sys/devices/system/node/nodeX directory holds a memoryY link for 
+ * every block of the node, so one listing per node gives the whole mapping. 
+ * Runs of consecutive ids are stored as a single range
+ * @return 0 upon success, non-zero otherwise
+ */
+static int mem_node_init(struct mem_ctx *ctx)
+{
+	int rv, i, n, node, cap, dfd, nfd;
+	int *ids;
+	DIR *d;
+  	struct dirent *e; 
+	struct mem_nrange *r, *tmp;
+
+	// Initialize variables 
+	rv = 1;
+	cap = 64;
+	ids = NULL;
+
+	mem_node_free(ctx);
+
+	ctx->nranges = malloc(cap * sizeof(*ctx->nranges));
+	if (ctx->nranges == NULL)
+		return -ENOMEM;
+
+	dfd = open(LMFP_NODE_DIR, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	d = fdopendir(dfd);
 	if (d == NULL)
 	{
-		err(ctx, "Could not open memory directory for enumeration: %s", LMFP_MEM_DIR);
-		rv = 1;
-		goto end;
+		if (dfd >= 0)
+			close(dfd);
+		err(ctx, "Could not open node directory: %s", LMFP_NODE_DIR);
+		goto err;
 	}
 
-	// Loop through all the directory entries and online the memory block that matches
 	for (e = readdir(d) ; e != NULL ; e = readdir(d))
-		if (e->d_type == DT_DIR && sscanf(e->d_name, "memory%d", &index) == 1 && index == blk->id)
+	{
+		if (e->d_type != DT_DIR || sscanf(e->d_name, "node%d", &node) != 1)
+			continue;
+
+		nfd = openat(dfd, e->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (nfd < 0)
+			continue;
+
+		n = mem_blk_scan_dir(ctx, nfd, DT_LNK, &ids);
+		close(nfd);
+		if (n <= 0)
+		{
+			if (ids != NULL)
+				free(ids);
+			ids = NULL;
+			continue;
+		}
+
+		qsort(ids, n, sizeof(int), mem_compare_ints);
+
+		// Collapse runs of consecutive ids into ranges 
+		for ( i = 0 ; i < n ; i++ )
 		{
-			info(ctx, "Found memory block %d. Current State: %d Desired State %d", index, mem_blk_get_state(blk), state);
-			if (mem_blk_get_state(blk) == state)
+			// Every node adds a range at i == 0 so a previous range exists
+			if (i > 0 && ids[i] == ctx->nranges[ctx->num_nranges - 1].end)
 			{
-				info(ctx, "Memory block %d already in state %s. Skipping", index, mem_lmpl(state));
-				rv = 0;
-				goto end;
+				ctx->nranges[ctx->num_nranges - 1].end++;
+				continue;
 			}
 
-			if (state != LMPL_OFFLINE && mem_blk_get_state(blk) != LMPL_OFFLINE)
+			if (ctx->num_nranges == cap)
 			{
-				err(ctx, "Failed to set state of Memory block %d to %s becuase it is not offline: %s", index, mem_lmpl(state), mem_lmpl(mem_blk_get_state(blk)));
-				rv = 1;
-				goto end;
+				cap *= 2;
+				tmp = realloc(ctx->nranges, cap * sizeof(*ctx->nranges));
+				if (tmp == NULL)
+				{
+					rv = -ENOMEM;
+					closedir(d);
+					goto err;
+				}
+				ctx->nranges = tmp;
 			}
 
-			sprintf(path, "%s/%s/%s", LMFP_MEM_DIR, e->d_name, "state");							
-			ret = mem_sysfs_write(ctx, path, mem_lmpl(state));
-			if (ret < 0 || ret != (int) (strlen(mem_lmpl(state)) + 1))
+			r = &ctx->nranges[ctx->num_nranges++];
+			r->first = ids[i];
+			r->end = ids[i] + 1;
+			r->node = node;
+		}
+
+		free(ids);
+		ids = NULL;
+	}
+
+	closedir(d);
+
+	// Sort the ranges of all nodes by starting block id
+	qsort(ctx->nranges, ctx->num_nranges, sizeof(*ctx->nranges), mem_compare_mem_nranges);
+
+	info(ctx, "Mapped memory blocks to NUMA nodes with %d ranges", ctx->num_nranges);
+
+	return 0;
+
+err:
+
+	if (ids != NULL)
+		free(ids);
+
+	mem_node_free(ctx);
+
+	return rv;
+}
+
+/**
+ * Rebuild the node block id ranges from the node of each cached block
+ * @return 0 upon success, negative errno otherwise
+ */
+static int mem_node_rebuild(struct mem_ctx *ctx)
+{
+	int i;
+	struct mem_blk *blk;
+	struct mem_nrange *r;
+
+	mem_node_free(ctx);
+
+	if (ctx->num == 0)
+		return 0;
+
+	ctx->nranges = malloc(ctx->num * sizeof(*ctx->nranges));
+	if (ctx->nranges == NULL)
+		return -ENOMEM;
+
+	for ( i = 0 ; i < ctx->num ; i++ )
+	{
+		blk = &ctx->blocks[i];
+		if (blk->node < 0)
+			continue;
+
+		if (ctx->num_nranges > 0)
+		{
+			r = &ctx->nranges[ctx->num_nranges - 1];
+			if (r->node == blk->node && r->end == blk->id)
 			{
-				err(ctx, "Failed to set state to %s on memory block %d. %d", mem_lmpl(state), index, ret);
-				rv += 1;
+				r->end++;
+				continue;
 			}
-			else 
-				info(ctx, "Set state to %s on memory block %d", mem_lmpl(state), index);
 		}
-end:
 
-	return rv; 
+		r = &ctx->nranges[ctx->num_nranges++];
+		r->first = blk->id;
+		r->end = blk->id + 1;
+		r->node = blk->node;
+	}
+
+	return 0;
 }
 
-/** 
- * Get a struct mem_blk* from a memory block ID 
- */ 
-struct mem_blk *mem_blkid_get_blk(struct mem_ctx *ctx, int id)
+/**
+ * Read CLOCK_MONOTONIC in nanoseconds
+ */
+static unsigned long long mem_now_ns(void)
 {
-	struct mem_blk *blk; 
+	struct timespec ts;
 
-	// Validate Inputs 
-	if (ctx == NULL || id < 0)
-		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	mem_blk_foreach(ctx, blk)
-		if (blk->id == id)
-			return blk;
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Worker thread of an asynchronous operation
+ */
+static void *mem_op_async(void *arg)
+{
+	int i, stop;
+	sigset_t set;
+	unsigned long long t;
+	struct mem_op *op;
+
+	op = (struct mem_op *) arg;
+
+	// The signal must reach this thread even if the caller blocked it 
+	sigemptyset(&set);
+	sigaddset(&set, LMOP_SIGNAL);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	for ( i = 0 ; i < op->num ; i++ )
+	{
+		pthread_mutex_lock(&op->lock);
+		if (op->stop == 0 && op->deadline != 0 && mem_now_ns() >= op->deadline)
+			op->stop = -ETIMEDOUT;
+		stop = op->stop;
+		op->inwrite = (stop == 0);
+		pthread_mutex_unlock(&op->lock);
+
+		if (stop != 0)
+		{
+			op->results[i].rv = stop;
+			continue;
+		}
+
+		t = mem_now_ns();
+		op->results[i].rv = mem_op_async_blk(op, &op->results[i]);
+		op->results[i].ns = mem_now_ns() - t;
+
+		// A write interrupted by the watchdog reports why it was stopped
+		pthread_mutex_lock(&op->lock);
+		op->inwrite = 0;
+		if (op->results[i].rv == -EINTR && op->stop != 0)
+			op->results[i].rv = op->stop;
+		pthread_mutex_unlock(&op->lock);
+	}
+
+	pthread_mutex_lock(&op->lock);
+	op->done = 1;
+	pthread_cond_broadcast(&op->cond);
+	pthread_mutex_unlock(&op->lock);
+
+	eventfd_write(op->evfd, 1);
 
 	return NULL;
 }
 
 /**
- * Get the physical device for the memory block 
+ * Change the state of one block for mem_op_async()
+ *
+ * The write is made by block id without the context lock so the caller 
+ * thread is never blocked behind it. The cached block is then refreshed 
+ * under the lock like an event from the uevent listener
+ * @return see mem_blkid_apply_state()
  */
-int mem_blkid_get_device(struct mem_ctx *ctx, int id)
+static int mem_op_async_blk(struct mem_op *op, struct mem_blk_result *res)
 {
-  	struct mem_blk *blk;
+	int rv;
+	struct mem_ctx *ctx;
+	struct mem_blk *blk;
 
-	mem_blk_foreach(ctx, blk)
-		if (id == blk->id)
-			return blk->device;
+	ctx = op->ctx;
 
-	return -1;
+	rv = mem_blkid_apply_state(ctx, res->id, op->state, 1, NULL);
+
+	pthread_mutex_lock(&ctx->lock);
+	blk = mem_blkid_find(ctx, res->id);
+	if (blk != NULL)
+		res->state = mem_blk_get_state(blk);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return rv;
 }
 
 /**
- * Get the numa node for the memory blocks in the system
- * @return The number of blocks. 0 if error
+ * Cancel an asynchronous operation
+ *
+ * Blocks that have not been started fail with -ECANCELED and a state write
+ * in progress is interrupted. The operation still completes through its fd
+ * @return 0 upon success, -EALREADY if the operation already completed
  */
-int mem_blkid_get_node(struct mem_ctx *ctx, int index)
+int mem_op_cancel(struct mem_op *op)
 {
-	struct mem_blk *blk;
+	int rv;
 
-	mem_blk_foreach(ctx, blk)
-		if (blk->id == index)
-			return blk->node;
+	rv = 0;
 
-	return -1;
+	pthread_mutex_lock(&op->lock);
+	if (op->done)
+		rv = -EALREADY;
+	else if (op->stop == 0)
+		op->stop = -ECANCELED;
+	pthread_cond_broadcast(&op->cond);
+	pthread_mutex_unlock(&op->lock);
+
+	return rv;
 }
- 
+
 /**
- * Get the onnline state of a memory block
+ * Free an asynchronous operation
+ *
+ * An operation that has not completed is cancelled first. This waits for 
+ * the interrupted write to return
  */
-int mem_blkid_get_state(struct mem_ctx *ctx, int id)
+void mem_op_free(struct mem_op *op)
 {
-  	struct mem_blk *blk;
+	if (op == NULL)
+		return;
 
-	mem_blk_foreach(ctx, blk)
-		if (id == blk->id)
-			return blk->state;
+	mem_op_cancel(op);
 
-	return -1;
+	pthread_join(op->worker, NULL);
+	if (op->watching)
+		pthread_join(op->watchdog, NULL);
+
+	close(op->evfd);
+	pthread_mutex_destroy(&op->lock);
+	pthread_cond_destroy(&op->cond);
+	mem_unref(op->ctx);
+	free(op->results);
+	free(op);
 }
 
 /**
- * Get a bitfield representing the valid zones*
+ * Get the eventfd of an asynchronous operation 
+ *
+ * The fd becomes readable when the operation completes. It is owned by 
+ * the operation and closed by mem_op_free()
  */
-unsigned long mem_blkid_get_zones(struct mem_ctx *ctx, int id)
+int mem_op_get_fd(struct mem_op *op)
 {
-  	struct mem_blk *blk;
+	return op->evfd;
+}
 
-	mem_blk_foreach(ctx, blk)
-		if (id == blk->id)
-			return blk->valid_zones;
+/**
+ * Change the state of one item of a mem_op_run() call
+ *
+ * Offlining returns EBUSY or EAGAIN while pages of the block cannot be 
+ * migrated yet. When enabled these are retried with exponential backoff 
+ * until the deadline of the call
+ */
+static void mem_op_item_run(struct mem_op_job *op, struct mem_op_item *item)
+{
+	int rv, delay, prev, j;
+	unsigned long long ns;
+	struct timespec ts;
 
-	return 0;
+	delay = LMLN_RETRY_MIN_MS;
+	prev = mem_blk_restore_state(item->blk, 1);
+
+	// A failed transaction does not start any more blocks 
+	if (__atomic_load_n(&op->abort, __ATOMIC_RELAXED))
+	{
+		rv = -ECANCELED;
+		goto end;
+	}
+
+	if (op->deadline != 0 && mem_now_ns() >= op->deadline)
+	{
+		rv = -ETIMEDOUT;
+		goto end;
+	}
+
+	for ( ; ; )
+	{
+		rv = mem_blkid_apply_state(item->blk->ctx, item->blk->id, op->state, 1, &ns);
+		item->res->ns += ns;
+
+		if (!op->retry || (rv != -EBUSY && rv != -EAGAIN))
+			break;
+
+		// Do not sleep past the deadline
+		if (op->deadline != 0 && mem_now_ns() + delay * 1000000ULL >= op->deadline)
+			break;
+
+		ts.tv_sec = delay / 1000;
+		ts.tv_nsec = (long) (delay % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+
+		item->res->retries++;
+		delay *= 2;
+		if (delay > LMLN_RETRY_MAX_MS)
+			delay = LMLN_RETRY_MAX_MS;
+	}
+
+end:
+
+	item->res->rv = rv;
+	item->res->state = mem_blk_get_state(item->blk);
+
+	// Journal the change so a failed transaction can be rolled back 
+	if (op->flags & LMSR_TRANSACTION)
+	{
+		if (rv == 0 && item->res->ns > 0)
+		{
+			j = __atomic_fetch_add(&op->num_journal, 1, __ATOMIC_RELAXED);
+			op->journal[j].blk = item->blk;
+			op->journal[j].prev = prev;
+			op->journal[j].res = item->res;
+		}
+		else if (rv != 0 && rv != -ECANCELED)
+			__atomic_store_n(&op->abort, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Check an asynchronous operation without blocking
+ * @param results 	array of num results in submission order filled once complete. May be NULL
+ * @return -EINPROGRESS while running, otherwise the number of blocks that failed
+ */
+int mem_op_poll(struct mem_op *op, struct mem_blk_result *results)
+{
+	int rv, i, done;
+
+	pthread_mutex_lock(&op->lock);
+	done = op->done;
+	pthread_mutex_unlock(&op->lock);
+
+	if (!done)
+		return -EINPROGRESS;
+
+	rv = 0;
+	for ( i = 0 ; i < op->num ; i++ )
+		if (op->results[i].rv != 0)
+			rv++;
+
+	if (results != NULL)
+		memcpy(results, op->results, op->num * sizeof(*results));
+
+	return rv;
 }
 
-/**
- * Determine if a memory block is online by phys_index
- */
-int mem_blkid_is_online(struct mem_ctx *ctx, int id)
-{
-  	struct mem_blk *blk;
+/**
+ * Roll back the state changes in a transaction journal
+ *
+ * The blocks are grouped by their previous state and each group is 
+ * restored in parallel by mem_op_run(). Blocks that are restored report 
+ * -ECANCELED. Blocks that could not be restored report the failure
+ * @return the number of blocks that were not restored, or negative errno
+ */
+static int mem_op_rollback(struct mem_ctx *ctx, struct mem_op_jent *journal, int num)
+{
+	int rv, i, n, state, threads, timeout_ms;
+	struct mem_blk **blks;
+	struct mem_op_jent **ents;
+	struct mem_blk_result *res;
+
+	// Initialize variables 
+	rv = 0;
+	blks = malloc(num * sizeof(*blks));
+	ents = malloc(num * sizeof(*ents));
+	res = calloc(num, sizeof(*res));
+	if (blks == NULL || ents == NULL || res == NULL)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
+
+	for ( state = 0 ; state < LMPL_MAX ; state++ )
+	{
+		n = 0;
+		for ( i = 0 ; i < num ; i++ )
+			if (journal[i].prev == state)
+			{
+				blks[n] = journal[i].blk;
+				ents[n] = &journal[i];
+				n++;
+			}
+
+		if (n == 0)
+			continue;
+
+		// Offlining back may have to wait for pages to migrate 
+		threads = (state == LMPL_OFFLINE) ? ctx->offline_threads : ctx->online_threads;
+		timeout_ms = (state == LMPL_OFFLINE) ? LMLN_OFFLINE_TIMEOUT_MS : 0;
+
+		if (mem_op_run(ctx, blks, n, state, threads, timeout_ms, 0, res, NULL) < 0)
+			for ( i = 0 ; i < n ; i++ )
+				res[i].rv = -ENOMEM;
+
+		for ( i = 0 ; i < n ; i++ )
+		{
+			ents[i]->res->rv = (res[i].rv == 0) ? -ECANCELED : res[i].rv;
+			ents[i]->res->state = mem_blk_get_state(ents[i]->blk);
+			ents[i]->res->ns += res[i].ns;
+			if (res[i].rv != 0)
+				rv++;
+		}
+	}
+
+	info(ctx, "Rolled back %d memory blocks. Failed: %d", num, rv);
+
+end:
 
-	mem_blk_foreach(ctx, blk)
-		if (id == blk->id)
-			return blk->online;
+	if (blks != NULL)
+		free(blks);
+	if (ents != NULL)
+		free(ents);
+	if (res != NULL)
+		free(res);
 
-	return -1;
+	return rv;
 }
 
 /**
- * Determine if a memory block is removable by phys_index
+ * Change the state of an array of memory blocks with NUMA local workers
+ *
+ * The blocks are grouped by node and keep the order of blks within a 
+ * group. Each worker starts on a group in proportion to its number of 
+ * blocks, pins itself to the CPUs of that node and claims blocks until the
+ * group is empty, then helps with the other groups. With one thread the 
+ * blocks are changed in order on the calling thread, which is never 
+ * pinned. The workers do not stop on a failure unless the call is a 
+ * transaction. A transaction journals each change and if any block fails 
+ * or misses the deadline the changed blocks are rolled back in parallel
+ * @param threads 		maximum number of worker threads 
+ * @param timeout_ms 	0 to try each block once. Otherwise EBUSY and EAGAIN 
+ * 						are retried until timeout_ms has passed, or forever if -1
+ * @param flags 		bitfield of LMSR masks. LMSR_CONTINUE is implied without LMSR_TRANSACTION
+ * @param results 		array of num results indexed like blks. May be NULL 
+ * @param stats 		set to the latency and throughput of the call. May be NULL
+ * @return the number of blocks that failed, or negative errno
  */
-int mem_blkid_is_removable(struct mem_ctx *ctx, int id)
+static int mem_op_run(struct mem_ctx *ctx, struct mem_blk **blks, int num, int state, int threads, int timeout_ms, int flags, struct mem_blk_result *results, struct mem_op_stats *stats)
 {
-  	struct mem_blk *blk;
+	int rv, i, g, n, created, rolled;
+	unsigned long long start, block_size;
+	struct mem_op_job op;
+	struct mem_op_thread *workers;
+	struct mem_blk_result *res;
 
-	mem_blk_foreach(ctx, blk)
-		if (id == blk->id)
-			return blk->removable;
+	// Initialize variables 
+	rv = 0;
+	memset(&op, 0, sizeof(op));
+	op.state = state;
+	op.flags = flags;
+	workers = NULL;
+	rolled = 0;
+	start = mem_now_ns();
+
+	op.retry = (timeout_ms != 0);
+	if (timeout_ms > 0)
+		op.deadline = start + timeout_ms * 1000000ULL;
+
+	res = results;
+	if (res == NULL)
+		res = calloc(num, sizeof(*res));
+	op.items = malloc(num * sizeof(*op.items));
+	op.groups = malloc(num * sizeof(*op.groups));
+	if (flags & LMSR_TRANSACTION)
+		op.journal = malloc(num * sizeof(*op.journal));
+	if ((res == NULL || op.items == NULL || op.groups == NULL || (op.journal == NULL && (flags & LMSR_TRANSACTION))) && num > 0)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
 
-	return -1;
-}
+	for ( i = 0 ; i < num ; i++ )
+	{
+		res[i].id = blks[i]->id;
+		res[i].rv = -ECANCELED;
+		res[i].state = mem_blk_get_state(blks[i]);
+		res[i].ns = 0;
+		res[i].retries = 0;
+		op.items[i].pos = i;
+		op.items[i].blk = blks[i];
+		op.items[i].res = &res[i];
+	}
 
-/**
- * Offline a memory block by phys_index
- */ 
-int mem_blkid_offline(struct mem_ctx *ctx, int id)
-{
-  	struct mem_blk *blk;
+	qsort(op.items, num, sizeof(*op.items), mem_compare_mem_op_items);
 
-	mem_blk_foreach(ctx, blk)
-		if (id == blk->id)
-			return mem_blk_offline(blk);
+	// Split the items into one group per node 
+	for ( i = 0 ; i < num ; i++ )
+	{
+		if (i == 0 || op.items[i].blk->node != op.items[i-1].blk->node)
+		{
+			g = op.num_groups++;
+			op.groups[g].node = op.items[i].blk->node;
+			op.groups[g].first = i;
+			op.groups[g].next = i;
+			op.groups[g].pin = 0;
+			CPU_ZERO(&op.groups[g].cpus);
+		}
+		op.groups[op.num_groups-1].end = i + 1;
+	}
 
-	return 1;
-}
+	n = threads;
+	if (n > num)
+		n = num;
+	if (n < 1)
+		n = 1;
 
-/**
- * Online a memory block by phys_index
- * @return 0 upon success, non-zero othersise
- */
-int mem_blkid_online(struct mem_ctx *ctx, int id)
-{
-  	struct mem_blk *blk;
+	workers = calloc(n, sizeof(*workers));
+	if (workers == NULL)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
 
-	mem_blk_foreach(ctx, blk)
-		if (id == blk->id)
-			return mem_blk_online(blk);
+	// Home group of each worker by the position of its share of the items
+	g = 0;
+	for ( i = 0 ; i < n ; i++ )
+	{
+		while (g < op.num_groups - 1 && op.groups[g].end <= (int) ((long) num * i / n))
+			g++;
+		workers[i].op = &op;
+		workers[i].home = g;
+		workers[i].pin = (n > 1);
+	}
 
-	return -1;
-}
+	if (n > 1)
+		for ( g = 0 ; g < op.num_groups ; g++ )
+			op.groups[g].pin = (mem_node_cpus(ctx, op.groups[g].node, &op.groups[g].cpus) > 0);
 
-/**
- * Set the online state of the memory block 
- */
-int mem_blkid_set_state(struct mem_ctx *ctx, int id, int state)
-{
-  	struct mem_blk *blk;
+	created = 0;
+	for ( i = 0 ; i < n && n > 1 ; i++ )
+	{
+		if (pthread_create(&workers[i].tid, NULL, mem_op_worker, &workers[i]) != 0)
+			break;
+		created++;
+	}
 
-	mem_blk_foreach(ctx, blk)
-		if (id == blk->id)
-			return mem_blk_set_state(blk, state);
+	// Without any workers the items are changed on the calling thread
+	if (created == 0)
+	{
+		workers[0].pin = 0;
+		mem_op_worker(&workers[0]);
+	}
 
-	return -1;
-}
+	for ( i = 0 ; i < created ; i++ )
+		pthread_join(workers[i].tid, NULL);
 
-/**
- * Compare cxl_memdev function for qsort
- */ 
-int mem_compare_cxl_memdevs(const void* a, const void* b)
-{
-    struct cxl_memdev *arg1 = *(struct cxl_memdev **)a;
-    struct cxl_memdev *arg2 = *(struct cxl_memdev **)b;
+	if (op.abort && op.num_journal > 0)
+	{
+		n = mem_op_rollback(ctx, op.journal, op.num_journal);
+		rolled = (n < 0) ? 0 : op.num_journal - n;
+	}
 
- 	int i1 = cxl_memdev_get_id(arg1);
- 	int i2 = cxl_memdev_get_id(arg2);
+	for ( i = 0 ; i < num ; i++ )
+		if (res[i].rv != 0)
+			rv++;
 
- 	return mem_compare_ints(&i1, &i2);
-}
+	info(ctx, "Set state %s on %d memory blocks with %d threads. Failed: %d", mem_lmpl(state), num, created > 0 ? created : 1, rv);
 
-/**
- * Compare cxl_region function for qsort
- */ 
-int mem_compare_cxl_regions(const void* a, const void* b)
-{
-    struct cxl_region *arg1 = *(struct cxl_region **)a;
-    struct cxl_region *arg2 = *(struct cxl_region **)b;
+	if (stats != NULL)
+	{
+		block_size = mem_system_get_blocksize(ctx);
 
- 	int i1 = cxl_region_get_id(arg1);
- 	int i2 = cxl_region_get_id(arg2);
+		memset(stats, 0, sizeof(*stats));
+		stats->blocks = num;
+		stats->failed = rv;
+		stats->threads = created > 0 ? created : 1;
+		stats->rolled_back = rolled;
+		stats->elapsed_ns = mem_now_ns() - start;
 
- 	return mem_compare_ints(&i1, &i2);
-}
+		for ( i = 0 ; i < num ; i++ )
+		{
+			stats->retries += res[i].retries;
+
+			if (res[i].rv != 0 || res[i].ns == 0)
+				continue;
+
+			stats->changed++;
+			stats->bytes += block_size;
+			stats->lat_avg_ns += res[i].ns;
+			if (stats->lat_min_ns == 0 || res[i].ns < stats->lat_min_ns)
+				stats->lat_min_ns = res[i].ns;
+			if (res[i].ns > stats->lat_max_ns)
+				stats->lat_max_ns = res[i].ns;
+		}
 
-/**
- * Compare int function for qsort
- */ 
-int mem_compare_ints(const void* a, const void* b)
-{
-    int arg1 = *(const int*)a;
-    int arg2 = *(const int*)b;
- 
-    if (arg1 < arg2) return -1;
-    if (arg1 > arg2) return 1;
-    return 0;
-}
+		if (stats->changed > 0)
+			stats->lat_avg_ns /= stats->changed;
+		if (stats->elapsed_ns > 0)
+			stats->bytes_per_sec = (unsigned long long) ((double) stats->bytes * 1000000000.0 / stats->elapsed_ns);
+	}
 
-/**
- * Compare mem_blk function for qsort
- */ 
-int mem_compare_mem_blks(const void* a, const void* b)
-{
-    struct mem_blk *arg1 = (struct mem_blk *)a;
-    struct mem_blk *arg2 = (struct mem_blk *)b;
+end:
 
- 	int i1 = arg1->id;
- 	int i2 = arg2->id;
+	if (workers != NULL)
+		free(workers);
+	if (op.items != NULL)
+		free(op.items);
+	if (op.groups != NULL)
+		free(op.groups);
+	if (op.journal != NULL)
+		free(op.journal);
+	if (res != NULL && res != results)
+		free(res);
 
- 	return mem_compare_ints(&i1, &i2);
+	return rv;
 }
 
 /**
- * Search for and return a cxl_memdev object matching name 
- * @return struct cxl_memdev *. NULL if error. 
+ * Handler of LMOP_SIGNAL. It only exists so the signal interrupts the 
+ * blocked write instead of terminating the process
  */
-struct cxl_memdev *mem_get_memdev(struct mem_ctx *ctx, char *name)
+static void mem_op_signal(int sig)
 {
-	struct cxl_memdev *memdev; 
-
-	cxl_memdev_foreach(ctx->cxl, memdev)  
-		if (!strcmp(cxl_memdev_get_devname(memdev), name))
-			return memdev;
-	
-	return NULL;
+	(void) sig;
 }
 
 /**
- * Return an array of pointers to cxl_memdevs
+ * Install the LMOP_SIGNAL handler without SA_RESTART unless the 
+ * application already handles the signal
  */
-struct cxl_memdev **mem_get_memdevs(struct mem_ctx *ctx)
+static void mem_op_signal_init(void)
 {
-	int i, num;
-	struct cxl_memdev *memdev;
-	struct cxl_memdev **array;
+	struct sigaction sa;
 
-	// Initialize variables 
-	i = 0;
-	num = mem_num_memdevs(ctx);
-	if (num == 0)
-		return NULL;
-	
-	// Allocate memory 
-	array = calloc(num, sizeof(*array));
-	
-	// Populate the array with the memdev pointers 
-	cxl_memdev_foreach(ctx->cxl, memdev)  
-		array[i++] = memdev;
+	if (sigaction(LMOP_SIGNAL, NULL, &sa) != 0)
+		return;
 
-	// Sort the array
-	qsort(array, num, sizeof(*array), mem_compare_cxl_memdevs);
-	
-	return array;
+	if (sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = mem_op_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(LMOP_SIGNAL, &sa, NULL);
 }
 
 /**
- * Search for and return a cxl_region object matching name
- * @return struct cxl_region* or NULL if not found
+ * Start an asynchronous block state change 
+ *
+ * The blocks are changed in the order given on an internal thread so a 
+ * long offline never blocks the caller. Completion is signaled on the fd 
+ * from mem_op_get_fd(), then mem_op_poll() returns the results. When 
+ * timeout_ms passes a write that is still blocked, such as an offline 
+ * waiting on page migration, is interrupted with a signal and the 
+ * remaining blocks fail with -ETIMEDOUT
+ * @param ids 			array of block ids 
+ * @param state 		enum LMPL
+ * @param timeout_ms 	deadline of the whole operation. -1 for none
+ * @param op 			set to the operation. Free with mem_op_free()
+ * @return 0 upon success, negative errno if an error
  */
-struct cxl_region *mem_get_region(struct mem_ctx *ctx, char * name)
+int mem_op_submit(struct mem_ctx *ctx, int *ids, int num, int state, int timeout_ms, struct mem_op **op)
 {
-	struct cxl_bus *bus;
-	struct cxl_decoder *decoder;
-	struct cxl_region *region;
-	
-	cxl_bus_foreach(ctx->cxl, bus)
-		cxl_decoder_foreach(cxl_bus_get_port(bus), decoder)
-			cxl_region_foreach(decoder, region)
-				if (!strcmp(name, cxl_region_get_devname(region)))
-					goto end;
-
-	region = NULL;
-
-end:
+	int rv, i;
+	struct mem_op *o;
+	struct mem_blk *blk;
+	pthread_condattr_t attr;
 
-	return region;
-}
+	// Initialize variables 
+	rv = 0;
 
-/**
- * Return an array of pointers to cxl_regions 
- */
-struct cxl_region **mem_get_regions(struct mem_ctx *ctx)
-{
-	struct cxl_bus *bus;
-	struct cxl_decoder *decoder;
-	struct cxl_region *region;
-	struct cxl_region **array;
-	int i, num;
+	// Validate inputs 
+	if (ctx == NULL || ids == NULL || num < 0 || state < 0 || state >= LMPL_MAX || op == NULL)
+		return -EINVAL;
 
-	if (ctx->regions != NULL)
-		return ctx->regions;
+	// Load the block table and directory fd on the caller thread 
+	if (mem_blk_get_first(ctx) == NULL && num > 0)
+		return -ENOENT;
+	if (mem_memfd(ctx) < 0)
+		return -ENODEV;
 
-	// Initialize variables 
-	i = 0;
-	num = mem_num_regions(ctx);
-	if (num == 0)
-		return NULL;
-	
-	// Allocate memory 
-	array = calloc(num, sizeof(*array));
-	
-	// Loop through CXL tree and get regions 
-	cxl_bus_foreach(ctx->cxl, bus)
-		cxl_decoder_foreach(cxl_bus_get_port(bus), decoder)
-			cxl_region_foreach(decoder, region)
-				array[i++] = region;
-	
-	// Sort the array
-	qsort(array, num, sizeof(*array), mem_compare_cxl_regions);
+	pthread_once(&mem_op_once, mem_op_signal_init);
 
-	ctx->num_regions = num;
-	ctx->regions = array;
+	o = calloc(1, sizeof(*o));
+	if (o == NULL)
+		return -ENOMEM;
 
-	return array;	
-}
+	o->results = calloc(num > 0 ? num : 1, sizeof(*o->results));
+	if (o->results == NULL)
+	{
+		free(o);
+		return -ENOMEM;
+	}
 
-/**
- * Search for and return root cxl_decoder object 
- * @return struct cxl_decoder* or NULL if error
- */
-struct cxl_decoder *mem_get_root_decoder(struct mem_ctx *ctx)
-{
-	struct cxl_bus *bus;
-	struct cxl_port *port;
-	struct cxl_decoder *decoder;
+	o->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (o->evfd < 0)
+	{
+		rv = -errno;
+		free(o->results);
+		free(o);
+		return rv;
+	}
 
-	decoder = NULL;
+	o->ctx = mem_ref(ctx);
+	o->state = state;
+	o->num = num;
+	if (timeout_ms >= 0)
+		o->deadline = mem_now_ns() + timeout_ms * 1000000ULL;
 
-	bus = cxl_bus_get_first(ctx->cxl);
-	if (bus == NULL)
+	for ( i = 0 ; i < num ; i++ )
 	{
-		err(ctx, "Unable to obtain first cxl bus");
-		goto end;
+		blk = mem_blkid_find(ctx, ids[i]);
+		o->results[i].id = ids[i];
+		o->results[i].rv = -ECANCELED;
+		o->results[i].state = (blk != NULL) ? mem_blk_get_state(blk) : -1;
 	}
 
-	port = cxl_bus_get_port(bus);
-	if (port == NULL)
+	pthread_mutex_init(&o->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&o->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	rv = pthread_create(&o->worker, NULL, mem_op_async, o);
+	if (rv != 0)
 	{
-		err(ctx, "Unable to obtain first cxl bus port on bus %s", cxl_bus_get_devname(bus));
-		goto end;
+		close(o->evfd);
+		pthread_mutex_destroy(&o->lock);
+		pthread_cond_destroy(&o->cond);
+		mem_unref(ctx);
+		free(o->results);
+		free(o);
+		return -rv;
 	}
 
-	decoder = cxl_decoder_get_first(port);	
+	// Without a watchdog the operation can not be cancelled or time out 
+	// while a write is blocked, but it still runs to completion
+	if (pthread_create(&o->watchdog, NULL, mem_op_watchdog, o) == 0)
+		o->watching = 1;
+	else 
+		warn(ctx, "Could not start watchdog of asynchronous operation");
 
-end:
+	info(ctx, "Submitted asynchronous %s of %d memory blocks", mem_lmpl(state), num);
 
-	return decoder;
+	*op = o;
+
+	return 0;
 }
 
 /**
- * Return a const char * (string) representation of enum LMPL
+ * Watchdog thread of an asynchronous operation 
+ *
+ * Sleeps until the operation completes, is cancelled or reaches its 
+ * deadline. Once it must stop, the worker is signaled every 
+ * LMLN_OP_KILL_MS while it is in a write since a signal sent just before 
+ * the write started is not seen by it
  */
-const char *mem_lmpl(int policy)
+static void *mem_op_watchdog(void *arg)
 {
-	if (policy < 0 || policy >= LMPL_MAX)
-		return NULL;
-	return _LMPL[policy];
+	unsigned long long until;
+	struct timespec ts;
+	struct mem_op *op;
+
+	op = (struct mem_op *) arg;
+
+	pthread_mutex_lock(&op->lock);
+
+	while (!op->done)
+	{
+		if (op->stop == 0 && op->deadline != 0 && mem_now_ns() >= op->deadline)
+		{
+			op->stop = -ETIMEDOUT;
+			info(op->ctx, "Asynchronous operation reached its deadline");
+		}
+
+		if (op->stop != 0)
+		{
+			if (op->inwrite)
+				pthread_kill(op->worker, LMOP_SIGNAL);
+			until = mem_now_ns() + LMLN_OP_KILL_MS * 1000000ULL;
+		}
+		else if (op->deadline != 0)
+			until = op->deadline;
+		else 
+		{
+			pthread_cond_wait(&op->cond, &op->lock);
+			continue;
+		}
+
+		ts.tv_sec = until / 1000000000ULL;
+		ts.tv_nsec = until % 1000000000ULL;
+		pthread_cond_timedwait(&op->cond, &op->lock, &ts);
+	}
+
+	pthread_mutex_unlock(&op->lock);
+
+	return NULL;
 }
 
 /**
- * Return a const char * (string) representation of enum LMST
+ * Worker of mem_op_run()
+ *
+ * Items are claimed one at a time so a slow block on one worker does not 
+ * hold up the rest of its group
  */
-const char *mem_lmst(int state)
+static void *mem_op_worker(void *arg)
 {
-	if (state < 0 || state >= LMST_MAX)
-		return NULL;
-	return _LMST[state];
+	int i, k;
+	struct mem_op_thread *t;
+	struct mem_op_group *g;
+	struct mem_op_item *item;
+
+	t = (struct mem_op_thread *) arg;
+
+	for ( k = 0 ; k < t->op->num_groups ; k++ )
+	{
+		g = &t->op->groups[(t->home + k) % t->op->num_groups];
+
+		if (t->pin && g->pin)
+			sched_setaffinity(0, sizeof(g->cpus), &g->cpus);
+
+		while ((i = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED)) < g->end)
+		{
+			item = &t->op->items[i];
+			mem_op_item_run(t->op, item);
+		}
+	}
+
+	return NULL;
 }
 
 /**
- * Return a const char * (string) representation of enum LMZN
+ * Count the set bits of an array of 64 bit words 
+ *
+ * Four words are counted at once with the SWAR bit count on vector lanes,
+ * which maps onto SIMD registers without needing a popcnt instruction
  */
-const char *mem_lmzn(int zone)
+static unsigned long long mem_popcount(const unsigned long long *words, unsigned long long num)
 {
-	if (zone < 0 || zone >= LMZN_MAX)
-		return NULL;
-	return _LMZN[zone];
+	unsigned long long i, rv;
+	mem_kpf_vec v, sum;
+
+	sum = (mem_kpf_vec) {0};
+
+	for ( i = 0 ; i + LMLN_KPF_LANES <= num ; i += LMLN_KPF_LANES )
+	{
+		memcpy(&v, &words[i], sizeof(v));
+		v = v - ((v >> 1) & 0x5555555555555555ULL);
+		v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+		v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		sum += (v * 0x0101010101010101ULL) >> 56;
+	}
+
+	rv = 0;
+	for ( ; i < num ; i++ )
+		rv += __builtin_popcountll(words[i]);
+	for ( i = 0 ; i < LMLN_KPF_LANES ; i++ )
+		rv += sum[i];
+
+	return rv;
 }
 
 /**
- * Return current library log priority level 
+ * Insert a free chunk into the free list of its order 
  */
-int	mem_log_get_priority(struct mem_ctx *ctx)
+static void mem_pool_add(struct mem_pool *p, int id, int order)
 {
-	return ctx->log->priority;
+	int i;
+
+	i = id - p->first;
+
+	p->order[i] = order;
+	p->prev[i] = -1;
+	p->next[i] = p->head[order];
+	if (p->head[order] >= 0)
+		p->prev[p->head[order] - p->first] = id;
+	p->head[order] = id;
 }
 
 /**
- * Set the log library destination to use
- * @param dst 	int from enum LMLD 
+ * Take a free chunk of an order, splitting a larger chunk if needed 
+ * @return the first block id of the chunk. -1 if there is none
  */
-void mem_log_set_destination(struct mem_ctx *ctx, int dst, char *filepath)
+static int mem_pool_alloc(struct mem_pool *p, int order)
 {
-	if (dst == LMLD_SYSLOG)
-		ctx->log->log_fn = log_to_syslog;
-	else if (dst == LDST_NULL)
-		ctx->log->log_fn = log_to_null;
-	else if (dst == LDST_FILE & filepath != NULL)
+	int o, id;
+
+	for ( o = order ; o < LMLN_BUDDY_ORDERS && p->head[o] < 0 ; o++ ) ;
+	if (o == LMLN_BUDDY_ORDERS)
+		return -1;
+
+	id = p->head[o];
+	mem_pool_del(p, id);
+
+	// The upper half of each split goes back to the free lists 
+	while (o > order)
 	{
-		ctx->log->file = fopen(filepath, "a");
-		ctx->log->log_fn = log_to_file;
+		o--;
+		mem_pool_add(p, id + (1 << o), o);
 	}
-	else 
-		ctx->log->log_fn = log_to_stdio;
-	
-	info(ctx, "Set log destination to %d %s", dst, log_dst_to_str(dst));
+
+	p->free -= (1 << order);
+
+	return id;
 }
 
 /**
- * Set logging function 
+ * Remove a free chunk from its free list 
  */
-void mem_log_set_fn(struct mem_ctx *ctx,
-		void (*mem_log_fn)(	struct mem_ctx *ctx, 
-							int priority,
-							const char *fn,
-							int line, 
-							const char *format, 
-							va_list args))
+static void mem_pool_del(struct mem_pool *p, int id)
 {
-	ctx->log->log_fn = (log_fn) mem_log_fn;
-	info(ctx, "custom logging function %p registered\n", mem_log_fn);
+	int i;
+
+	i = id - p->first;
+
+	if (p->prev[i] >= 0)
+		p->next[p->prev[i] - p->first] = p->next[i];
+	else 
+		p->head[(int) p->order[i]] = p->next[i];
+
+	if (p->next[i] >= 0)
+		p->prev[p->next[i] - p->first] = p->prev[i];
+
+	p->order[i] = -1;
 }
 
 /**
- * Set library log priority level 
+ * Find the pool that holds a block id 
+ * @return the pool. NULL if the id is not part of any pool
  */
-void mem_log_set_priority(struct mem_ctx *ctx, int priority)
+static struct mem_pool *mem_pool_find(struct mem_ctx *ctx, int id)
 {
-	if (priority > LOG_DEBUG)
-		priority = LOG_DEBUG;
-	if (priority < 0 )
-		priority = 0;	
+	int i;
 
-	ctx->log->priority = priority;
-	info(ctx, "logging priority set to %d - %s\n", priority, log_priority_to_str(priority));
+	for ( i = 0 ; i < ctx->num_pools ; i++ )
+		if (id >= ctx->pools[i].first && id < ctx->pools[i].end)
+			return &ctx->pools[i];
+
+	return NULL;
 }
 
 /**
- * Get the Interleave granulariy presented by first port of the bus 
+ * Return a free chunk to a pool and merge it with its free buddies 
  */
-int mem_memdev_get_interleave_granularity(struct mem_ctx *ctx, struct cxl_memdev *memdev)
+static void mem_pool_free(struct mem_pool *p, int id, int order)
 {
-	unsigned int rv; 
-	struct cxl_bus *bus;
-	struct cxl_port *parent, *port; 
-	struct cxl_decoder *decoder;
+	int buddy;
 
-	rv = 0;
+	p->free += (1 << order);
 
-	bus = cxl_memdev_get_bus(memdev);
-	if (bus == NULL)
+	while (order < LMLN_BUDDY_ORDERS - 1)
 	{
-		rv = 0;
-		err(ctx, "Unable to obtain cxl_bus for memdev %s: %d", cxl_memdev_get_devname(memdev), rv);
-		goto end;
-	}
+		buddy = id ^ (1 << order);
+		if (buddy < p->first || buddy + (1 << order) > p->end || p->order[buddy - p->first] != order)
+			break;
 
-	parent = cxl_bus_get_port(bus);
-	if (parent == NULL)
-	{
-		rv = 0;
-		err(ctx, "Unable to obtain cxl_port for bus %s: %d", cxl_bus_get_devname(bus), rv);
-		goto end;
+		mem_pool_del(p, buddy);
+		if (buddy < id)
+			id = buddy;
+		order++;
 	}
 
-	port = cxl_port_get_first(parent);
-	if (port == NULL)
-	{
-		rv = 0;
-		err(ctx, "Unable to obtain first cxl_port for parent %s: %d", cxl_port_get_devname(parent), rv);
-		goto end;
-	}
+	mem_pool_add(p, id, order);
+}
 
-	decoder = cxl_decoder_get_first(port);
-	if (decoder == NULL)
+/**
+ * Free the pools of the lease manager 
+ */
+static void mem_pools_free(struct mem_ctx *ctx)
+{
+	int i;
+
+	for ( i = 0 ; i < ctx->num_pools ; i++ )
 	{
-		rv = 0;
-		err(ctx, "Unable to obtain decoder for cxl_port %s: %d", cxl_port_get_devname(port), rv);
-		goto end;
+		free(ctx->pools[i].order);
+		free(ctx->pools[i].next);
+		free(ctx->pools[i].prev);
 	}
 
-	rv = cxl_decoder_get_interleave_granularity(decoder);
-
-end:
+	if (ctx->pools != NULL)
+		free(ctx->pools);
 
-	return rv;
+	ctx->pools = NULL;
+	ctx->num_pools = 0;
 }
 
 /**
- * Is a memdev free to be added to a new region 
- * @return 1 for true, 0 for false
+ * Build the pools and their free maps 
+ *
+ * Each node block id range is split at region boundaries. Offline blocks 
+ * that are not leased are then freed into their pool one at a time, which
+ * merges them into the largest aligned chunks
+ * @return 0 upon success, negative errno otherwise
  */
-int mem_memdev_is_available(struct mem_ctx *ctx, struct cxl_memdev *memdev)
+static int mem_pools_init(struct mem_ctx *ctx)
 {
-	int rv;
-	struct cxl_endpoint *endpoint;
-	struct cxl_port *port;
-	struct cxl_decoder *decoder;
-	struct cxl_region *region;
+	int rv, i, j, k, n, first, end;
+	unsigned char *leased;
+	struct mem_nrange *r;
+	struct mem_rgn *rgn;
+	struct mem_pool *p;
+	struct mem_blk *blk;
 
+	// Initialize variables 
 	rv = 0;
+	leased = NULL;
 
-	// Check if memdev is even enabled 
-	rv = cxl_memdev_is_enabled(memdev);
-	if (rv == 0)
-		goto end;
+	mem_pools_free(ctx);
 
-	// Get endpoint 
-	endpoint = cxl_memdev_get_endpoint(memdev);
-	if (endpoint == NULL)
-	{
-		rv = 0;
-		err(ctx, "Unable to get cxl_endpoint for memdev %s", cxl_memdev_get_devname(memdev));
-		goto end;
-	}
-	
-	// Check if endpoint is enabled 
-	rv = cxl_endpoint_is_enabled(endpoint);
-	if (rv == 0)
-		goto end;
+	if (mem_blk_get_first(ctx) == NULL)
+		return -ENODEV;
 
-	// Get the port 
-	port = cxl_endpoint_get_port(endpoint);
-	if (port == NULL)
+	// Regions are optional 
+	if (ctx->rgns == NULL && mem_region_index_init(ctx) != 0)
+		warn(ctx, "Could not build the region index. Pools ignore regions");
+
+	// Each region boundary inside a node range adds at most two pools 
+	ctx->pools = calloc(ctx->num_nranges + 2 * ctx->num_rgns + 1, sizeof(*ctx->pools));
+	leased = calloc(ctx->max_id + 1, 1);
+	if (ctx->pools == NULL || leased == NULL)
 	{
-		rv = 0;
-		err(ctx, "Unable to get cxl_port for cxl_endpoint %s", cxl_endpoint_get_devname(endpoint));
+		rv = -ENOMEM;
 		goto end;
 	}
 
-	// Check if port is enabled 
-	rv = cxl_port_is_enabled(port);
-	if (rv == 0)
-		goto end;
+	for ( i = 0 ; i < ctx->num_leases ; i++ )
+		for ( j = ctx->leases[i].first ; j < ctx->leases[i].first + ctx->leases[i].num && j <= ctx->max_id ; j++ )
+			leased[j] = 1;
 
-	// Get Decoder 
-	decoder = cxl_decoder_get_first(port);
-	if (decoder == NULL)
+	for ( i = 0 ; i < ctx->num_nranges ; i++ )
 	{
-		rv = 0;
-		err(ctx, "Unable to get cxl_decoder for cxl_port %s", cxl_port_get_devname(port));
-		goto end;
+		r = &ctx->nranges[i];
+
+		for ( first = r->first ; first < r->end ; first = end )
+		{
+			// Cut at the next region start or end 
+			end = r->end;
+			rgn = NULL;
+			for ( k = 0 ; k < ctx->num_rgns ; k++ )
+			{
+				if (ctx->rgns[k].first <= first && ctx->rgns[k].end > first)
+				{
+					rgn = &ctx->rgns[k];
+					if (rgn->end < end)
+						end = rgn->end;
+				}
+				else if (ctx->rgns[k].first > first && ctx->rgns[k].first < end)
+					end = ctx->rgns[k].first;
+			}
+
+			p = &ctx->pools[ctx->num_pools++];
+			p->first = first;
+			p->end = end;
+			p->node = r->node;
+			p->region = (rgn != NULL) ? rgn->region : NULL;
+
+			n = end - first;
+			p->order = malloc(n);
+			p->next = malloc(n * sizeof(int));
+			p->prev = malloc(n * sizeof(int));
+			if (p->order == NULL || p->next == NULL || p->prev == NULL)
+			{
+				rv = -ENOMEM;
+				goto end;
+			}
+
+			memset(p->order, -1, n);
+			for ( k = 0 ; k < LMLN_BUDDY_ORDERS ; k++ )
+				p->head[k] = -1;
+
+			for ( j = first ; j < end ; j++ )
+			{
+				blk = mem_blkid_find(ctx, j);
+				if (blk != NULL && !blk->online && !leased[j])
+					mem_pool_free(p, j, 0);
+			}
+		}
 	}
 
-	region = cxl_decoder_get_region(decoder);
-	if (region == NULL)
-		rv = 1;
-	else 
-		rv = 0;
+	ctx->lease_stale = 0;
+	ctx->lease_seq = mem_events_seq(ctx);
+
+	info(ctx, "Built %d lease pools", ctx->num_pools);
 
 end:
 
+	if (leased != NULL)
+		free(leased);
+	if (rv != 0)
+		mem_pools_free(ctx);
+
 	return rv;
 }
 
 /**
- * Create a new lib mem context 
+ * mem_ref - Create an additional reference on the mem context
+ * @param ctx struct mem_ctx context created by cxl_new()
  */
-int mem_new(struct mem_ctx **ctx)
+struct mem_ctx *mem_ref(struct mem_ctx *ctx)
 {
-	int rv; 
-	struct mem_ctx *c; 
+	if (ctx == NULL)
+		return NULL;
+	ctx->refcount++;
+	return ctx;
+}
 
-	rv = 1; 
+/**
+ * Refresh cached state in the context without creating a new one
+ *
+ * LMRF_BLOCKS diffs the memory directory listing against the blocks array 
+ * and only reads blocks that were added. Block pointers obtained before a 
+ * refresh that added or removed blocks are no longer valid. LMRF_REGIONS
+ * only drops the cached region array. Changes of the same kind queued by the
+ * event listener are consumed 
+ * @param flags bitfield of LMRF masks 
+ * @return 0 upon success, non-zero otherwise
+ */
+int mem_refresh(struct mem_ctx *ctx, int flags)
+{
+	int rv, i; 
 
-	// Allocate memory for the object 
-	c = calloc(1, sizeof(struct mem_ctx));
-	if (c == NULL) 
-		return -ENOMEM;
+	// Initialize variables 
+	rv = 0;
 
-	c->refcount = 1;
+	if (ctx == NULL)
+		return -EINVAL;
 
-	// Get a cxl context 
-	rv = cxl_new(&c->cxl);
-	if (rv != 0)
-		goto end;
+	__atomic_and_fetch(&ctx->pending, ~flags, __ATOMIC_ACQ_REL);
 
-	// Set up logger 
-	c->log = log_init("libmem", LDST_SYSLOG, LOG_ERR, 1, NULL);
-	
-	log_info(c->log, "mem_ctx created at: %p\n", c);
-	log_dbg(c->log, "log_priority=%d\n", c->log->priority);
-	
-	// Store logger object into mem_ctx 
-	*ctx = c;
+	pthread_mutex_lock(&ctx->lock);
 
-	rv = 0;
+	ctx->lease_stale = 1;
 
-end:
+	if (flags & LMRF_SYSTEM)
+	{
+		// Region ranges are stored in block ids so depend on the block size 
+		mem_region_index_free(ctx);
 
-	return rv; 
-}
+		ctx->sys.loaded = 0;
+		rv = mem_system_init(ctx);
+		if (rv != 0)
+		{
+			err(ctx, "Failed to reload system facts: %d", rv);
+			goto end;
+		}
+	}
 
-/**
- * Count and return the number of CXL rmemdevs
- */
-int mem_num_memdevs(struct mem_ctx* ctx)
-{
-	int num; 
-	struct cxl_memdev *memdev; 
+	if (flags & LMRF_REGIONS)
+		mem_regions_invalidate(ctx);
+
+	if (flags & LMRF_BLOCKS)
+	{
+		rv = mem_blk_rescan(ctx);
+		if (rv != 0)
+		{
+			err(ctx, "Failed to rescan memory blocks: %d", rv);
+			goto end;
+		}
+	}
+
+	if ((flags & LMRF_STATE) && ctx->blocks != NULL)
+	{
+		for ( i = 0 ; i < ctx->num ; i++ )
+			if (mem_blk_refresh(&ctx->blocks[i]) != 0)
+				rv++;
+	}
 
-	num = 0;
+end:
 
-	cxl_memdev_foreach(ctx->cxl, memdev)  
-		num++;	
+	pthread_mutex_unlock(&ctx->lock);
 
-	return num;
+	return rv;
 }
 
 /**
- * Count and return the number of CXL regions 
+ * Re-read the state of a set of memory blocks 
+ *
+ * Ids that are not in the blocks array are counted as failures. Use 
+ * mem_refresh() with LMRF_BLOCKS first to pick up new blocks
+ * @return 0 upon success, otherwise the number of blocks that could not be refreshed
  */
-int mem_num_regions(struct mem_ctx *ctx)
+int mem_refresh_ids(struct mem_ctx *ctx, int *ids, int num)
 {
-	int num; 
-	struct cxl_bus *bus;
-	struct cxl_decoder *decoder;
-	struct cxl_region *region;
-
-	if (ctx->regions != NULL)
-		return ctx->num_regions;
-
-	num = 0;
+	int rv, i;
 
-	// Loop through the cxl bus to count the number of cxl_regions
-	cxl_bus_foreach(ctx->cxl, bus)
-		cxl_decoder_foreach(cxl_bus_get_port(bus), decoder)
-			cxl_region_foreach(decoder, region)
-				num++;
+	rv = 0;
 
-	return num;
-}
+	for ( i = 0 ; i < num ; i++ )
+		if (mem_blkid_refresh(ctx, ids[i]) != 0)
+			rv++;
 
-/**
- * mem_ref - Create an additional reference on the mem context
- * @param ctx struct mem_ctx context created by cxl_new()
- */
-struct mem_ctx *mem_ref(struct mem_ctx *ctx)
-{
-	if (ctx == NULL)
-		return NULL;
-	ctx->refcount++;
-	return ctx;
+	return rv;
 }
 
 /**
@@ -1387,6 +5649,9 @@ int mem_region_create(struct mem_ctx *ctx, int granularity, int num, struct cxl_
 	else 
 		info(ctx, "Enabled region %s", cxl_region_get_devname(region));
 
+	// The set of regions changed so drop the cached region array and index
+	mem_regions_invalidate(ctx);
+
 	rv = 0;
 
 	goto end;
@@ -1542,6 +5807,9 @@ int mem_region_delete(struct mem_ctx *ctx, struct cxl_region *region)
 	else 
 		info(ctx, "Deleted region %s", buf);
 
+	// The region object was freed so drop the cached region array and index
+	mem_regions_invalidate(ctx);
+
 	rv = 0;
 
 end:
@@ -1549,13 +5817,46 @@ end:
 	return rv;
 }
 
+/**
+ * Get the first memory block of a cxl_region 
+ * @return struct mem_blk* or NULL if the region has no memory blocks
+ */
+struct mem_blk *mem_region_blk_get_first(struct mem_ctx *ctx, struct cxl_region *region)
+{
+	int num;
+
+	return mem_region_get_span(ctx, region, &num);
+}
+
+/**
+ * Get the next memory block of the cxl_region that contains blk 
+ * @return struct mem_blk* or NULL if blk was the last block of the region
+ */
+struct mem_blk *mem_region_blk_get_next(struct mem_blk *blk)
+{
+	struct mem_ctx *ctx;
+	struct mem_rgn *rgn;
+
+	ctx = blk->ctx;
+
+	// Blocks of a region are adjacent in the sorted block array 
+	if (blk + 1 >= ctx->blocks + ctx->num)
+		return NULL;
+
+	rgn = mem_region_index_find(ctx, blk->id);
+	if (rgn == NULL || (blk + 1)->id >= rgn->end)
+		return NULL;
+
+	return blk + 1;
+}
+
 /**
  * Get the state of block offset within 
  */
 int mem_region_get_blk_state(struct mem_ctx *ctx, struct cxl_region *region, int offset)
 {
 	int rv;
-	unsigned long long block_size, base, size, end, addr;
+	struct mem_rgn *rgn;
   	struct mem_blk *blk;
 
 	rv = -1;
@@ -1566,52 +5867,23 @@ int mem_region_get_blk_state(struct mem_ctx *ctx, struct cxl_region *region, int
 		goto end;
 	}
 
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
-	{
-		rv = -1;
-		err(ctx, "Unable to obtain system memory block size");
-		goto end;
-	}
-
-	// Get region base address 
-	base = cxl_region_get_resource(region);
-	if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
-	{
-		rv = -1;
-		err(ctx, "Unable to get cxl region %s resource address\n", cxl_region_get_devname(region));
-		goto end;
-	}
-
-	// Get region size in bytes 
-	size = cxl_region_get_size(region);
-	if (size == 0)
+	rgn = mem_region_index_get(ctx, region);
+	if (rgn == NULL)
 	{
-		rv = -1;
-		warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
+		err(ctx, "Unable to get block range of cxl region %s", cxl_region_get_devname(region));
 		goto end;
 	}
-	end = base + size;
-	addr = base + block_size * offset;
 
 	// Verify offset block is within region
-	if (addr >= end)
+	if (offset >= rgn->end - rgn->first)
 	{
 		err(ctx, "Could not get offset within region as it exceeds region range");
-		rv = -1;
 		goto end;
 	}
 
-	// Loop through the memory directories and check address
-	mem_blk_foreach(ctx, blk)
-	{
-		if (addr == (block_size * blk->id))
-		{
-			rv = mem_blk_get_state(blk);
-			goto end;	
-		}
-	}
+	blk = mem_blkid_get_blk(ctx, rgn->first + offset);
+	if (blk != NULL)
+		rv = mem_blk_get_state(blk);
 
 end:
 
@@ -1622,100 +5894,359 @@ end:
  * Return an array of integers representing the block index number 
  * @return int* array of phys_index numebrs, NULL on error
  *
- * The length of the array is mem_get_num_blocks()
+ * The length of the array is mem_region_num_blocks()
  */
 int *mem_region_get_blocks(struct mem_ctx *ctx, struct cxl_region *region)
 {
-	unsigned long long block_size, base, size, end, addr;
   	struct mem_blk *blk;
 	int i, num; 
 	int *array;
 
-	i = 0; 
-	array = NULL;
+	// Get the contiguous span of blocks in the region
+	blk = mem_region_get_span(ctx, region, &num);
+	if (blk == NULL)
+		return NULL;
 
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
+	// Allocate memory for the array 
+	array = malloc(num * sizeof(int));
+	if (array == NULL)
+		return NULL;
+
+	// The span is sorted by id
+	for ( i = 0 ; i < num ; i++ )
+		array[i] = blk[i].id;
+
+	return array;
+}
+
+/**
+ * Get total memory capacity of a cxl_region in bytes 
+ */
+unsigned long long mem_region_get_capacity(struct mem_ctx *ctx, struct cxl_region *region)
+{
+	struct mem_stats stats;
+
+	if (mem_region_get_stats(ctx, region, &stats) != 0)
+		return 0;
+
+	return stats.capacity;
+}
+
+/**
+ * Get offline memory capacity of a cxl_region in bytes 
+ */
+unsigned long long mem_region_get_capacity_offline(struct mem_ctx *ctx, struct cxl_region *region)
+{
+	struct mem_stats stats;
+
+	if (mem_region_get_stats(ctx, region, &stats) != 0)
+		return 0;
+
+	return stats.capacity_offline;
+}
+
+/**
+ * Get online memory capacity of a cxl_region in bytes 
+ */
+unsigned long long mem_region_get_capacity_online(struct mem_ctx *ctx, struct cxl_region *region)
+{
+	struct mem_stats stats;
+
+	if (mem_region_get_stats(ctx, region, &stats) != 0)
+		return 0;
+
+	return stats.capacity_online;
+}
+
+/**
+ * Measure the idle memory of a region 
+ *
+ * See mem_blk_get_idle_range(). Like mem_system_get_idle() the total only 
+ * covers the blocks that were online when sampling started. Offline 
+ * capacity is left to the caller
+ * @param interval_ms 	time the pages are left to be accessed 
+ * @param idle 			array of mem_region_num_blocks() idle byte counts in block order. May be NULL
+ * @param total 		set to the idle bytes of the online blocks of the region. May be NULL
+ * @return 0 upon success, negative errno otherwise
+ */
+int mem_region_get_idle(struct mem_ctx *ctx, struct cxl_region *region, int interval_ms, unsigned long long *idle, unsigned long long *total)
+{
+	int rv, i, num, *sel;
+	struct mem_blk *blk;
+	unsigned long long *res;
+
+	// Validate inputs 
+	if (ctx == NULL || region == NULL || interval_ms < 0)
+		return -EINVAL;
+
+	blk = mem_region_get_span(ctx, region, &num);
+	if (blk == NULL)
+		return -ENODEV;
+
+	sel = malloc(num * sizeof(*sel));
+	res = (idle != NULL) ? idle : malloc(num * sizeof(*res));
+	if (sel == NULL || res == NULL)
 	{
-		err(ctx, "Unable to read system memory block size");
+		rv = -ENOMEM;
 		goto end;
 	}
 
-	// Get region base address 
-	base = cxl_region_get_resource(region);
-	if (base == 0)
+	for ( i = 0 ; i < num ; i++ )
+		sel[i] = blk[i].online ? blk[i].id : -1;
+
+	rv = mem_idle_sample(ctx, sel, num, interval_ms, res);
+
+	// Blocks that were not sampled are left at 0 
+	if (total != NULL && rv >= 0)
 	{
-		err(ctx, "Unable to get cxl region %s resource address", cxl_region_get_devname(region));
-		return NULL;
+		*total = 0;
+		for ( i = 0 ; i < num ; i++ )
+			*total += res[i];
 	}
 
-	// Get region size in bytes 
-	size = cxl_region_get_size(region);
-	if (size == 0)
+end:
+
+	if (sel != NULL)
+		free(sel);
+	if (res != NULL && res != idle)
+		free(res);
+
+	return rv;
+}
+
+/**
+ * Get the contiguous span of memory blocks that make up a cxl_region
+ * @param num set to the number of blocks in the span
+ * @return pointer to the first struct mem_blk of the span. NULL if empty or error
+ *
+ * Blocks of the span are adjacent so blk[0] to blk[num-1] may be indexed 
+ * directly. The span is found with one binary search of the block table
+ */
+struct mem_blk *mem_region_get_span(struct mem_ctx *ctx, struct cxl_region *region, int *num)
+{
+	int lo, hi, mid, first;
+	struct mem_rgn *rgn;
+
+	*num = 0;
+
+	// Enumerate the memory blocks if not done already
+	if (ctx->blocks == NULL && mem_blk_get_first(ctx) == NULL)
+		return NULL;
+
+	rgn = mem_region_index_get(ctx, region);
+	if (rgn == NULL)
+		return NULL;
+
+	// Binary search for the first block with id >= rgn->first
+	lo = 0;
+	hi = ctx->num;
+	while (lo < hi)
 	{
-		warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
+		mid = lo + (hi - lo) / 2;
+		if (ctx->blocks[mid].id < rgn->first)
+			lo = mid + 1;
+		else 
+			hi = mid;
+	}
+	first = lo;
+
+	// Walk to the end of the span. Block ids within a region are contiguous 
+	// so this normally lands on the first guess
+	hi = first + (rgn->end - rgn->first);
+	if (hi > ctx->num)
+		hi = ctx->num;
+	while (hi > first && ctx->blocks[hi - 1].id >= rgn->end)
+		hi--;
+
+	*num = hi - first;
+	if (*num == 0)
 		return NULL;
+
+	return &ctx->blocks[first];
+}
+
+/**
+ * Get aggregate statistics of the memory blocks of a cxl_region
+ * @return 0 upon success, non-zero otherwise
+ */
+int mem_region_get_stats(struct mem_ctx *ctx, struct cxl_region *region, struct mem_stats *stats)
+{
+	int num;
+	struct mem_blk *blk;
+	unsigned long long block_size;
+
+	memset(stats, 0, sizeof(*stats));
+
+	block_size = mem_system_get_blocksize(ctx);
+	if (block_size == 0)
+	{
+		err(ctx, "Unable to obtain system memory block size");
+		return 1;
 	}
-	end = base + size;
 
-	// Get the number of blocks 
-	num = mem_region_num_blocks(ctx, region);
+	blk = mem_region_get_span(ctx, region, &num);
 
-	// Allocate memory for the array 
-	array = malloc(num * sizeof(int));
-	if (array == NULL)
+	mem_stats_fill(stats, blk, num, block_size);
+
+	return 0;
+}
+
+/**
+ * Find the region index entry that contains a memory block id
+ * @return struct mem_rgn* or NULL if the block is not part of a region
+ */
+static struct mem_rgn *mem_region_index_find(struct mem_ctx *ctx, int id)
+{
+	int lo, hi, mid;
+
+	if (ctx->rgns == NULL && mem_region_index_init(ctx) != 0)
 		return NULL;
 
-	mem_blk_foreach(ctx, blk)
+	// Binary search for the last entry with first <= id
+	lo = 0;
+	hi = ctx->num_rgns;
+	while (lo < hi)
 	{
-		addr = block_size * blk->id;			
-		if (addr >= base && addr < end)
-			array[i++] = blk->id;
+		mid = lo + (hi - lo) / 2;
+		if (ctx->rgns[mid].first <= id)
+			lo = mid + 1;
+		else 
+			hi = mid;
 	}
 
-	// Sort the array
-	qsort(array, num, sizeof(int), mem_compare_ints);
+	if (lo == 0 || id >= ctx->rgns[lo - 1].end)
+		return NULL;
 
-end:
+	return &ctx->rgns[lo - 1];
+}
 
-	return array;
+/**
+ * Free the region interval index
+ */
+static void mem_region_index_free(struct mem_ctx *ctx)
+{
+	if (ctx->rgns != NULL)
+		free(ctx->rgns);
+
+	ctx->rgns = NULL;
+	ctx->num_rgns = 0;
 }
 
 /**
- * Get total memory capacity of a cxl_region in bytes 
+ * Get the region index entry of a cxl_region 
+ * @return struct mem_rgn* or NULL if the region has no valid address range
  */
-unsigned long long mem_region_get_capacity(struct mem_ctx *ctx, struct cxl_region *region)
+static struct mem_rgn *mem_region_index_get(struct mem_ctx *ctx, struct cxl_region *region)
 {
-	unsigned long long capacity; 
+	int i;
 
-	capacity = mem_system_get_blocksize(ctx) * mem_region_num_blocks(ctx, region);
+	if (region == NULL)
+		return NULL;
+
+	if (ctx->rgns == NULL && mem_region_index_init(ctx) != 0)
+		return NULL;
 
-	return capacity;
+	// The number of regions is small so a linear scan is fine
+	for ( i = 0 ; i < ctx->num_rgns ; i++ )
+		if (ctx->rgns[i].region == region)
+			return &ctx->rgns[i];
+
+	return NULL;
 }
- 
+
 /**
- * Get offline memory capacity of a cxl_region in bytes 
+ * Build the sorted region interval index 
+ *
+ * Each entry holds the memory block id range [first, end) covered by the 
+ * region resource. Regions without a resource address or size are skipped
+ * @return 0 upon success, non-zero otherwise
  */
-unsigned long long mem_region_get_capacity_offline(struct mem_ctx *ctx, struct cxl_region *region)
+static int mem_region_index_init(struct mem_ctx *ctx)
 {
-	unsigned long long capacity; 
+	int rv, i, num;
+	unsigned long long block_size, base, size;
+	struct cxl_region *region, **regions;
+	struct mem_rgn *rgns;
+
+	// Initialize variables 
+	rv = 1;
+
+	mem_region_index_free(ctx);
+
+	num = mem_num_regions(ctx);
+
+	// Allocate one extra entry so an empty index is still non-NULL
+	rgns = calloc(num + 1, sizeof(*rgns));
+	if (rgns == NULL)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
+
+	ctx->rgns = rgns;
+
+	if (num == 0)
+	{
+		rv = 0;
+		goto end;
+	}
+
+	// Get memory block size in bytes 
+	block_size = mem_system_get_blocksize(ctx);
+	if (block_size == 0)
+	{
+		err(ctx, "Unable to read system memory block size");
+		goto err;
+	}
+
+	regions = mem_get_regions(ctx);	
+	if (regions == NULL)
+	{
+		err(ctx, "Could not obtain regions");
+		goto err;	
+	}
+
+	for ( i = 0 ; i < num ; i++ )
+	{
+		region = regions[i];
+
+		// Get region base address 
+		base = cxl_region_get_resource(region);
+		if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
+		{
+			warn(ctx, "Unable to get cxl region %s resource address", cxl_region_get_devname(region));
+			continue;
+		}
+
+		// Get region size in bytes 
+		size = cxl_region_get_size(region);
+		if (size == 0)
+		{
+			warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
+			continue;
+		}
 
-	capacity = mem_system_get_blocksize(ctx) * mem_region_num_blocks_offline(ctx, region);
+		// Blocks whose start address is within [base, base + size) belong to the region
+		rgns[ctx->num_rgns].first = (base + block_size - 1) / block_size;
+		rgns[ctx->num_rgns].end = (base + size + block_size - 1) / block_size;
+		rgns[ctx->num_rgns].region = region;
+		ctx->num_rgns++;
+	}
 
-	return capacity;
-}
+	// Sort the index by starting block id
+	qsort(rgns, ctx->num_rgns, sizeof(*rgns), mem_compare_mem_rgns);
 
-/**
- * Get online memory capacity of a cxl_region in bytes 
- */
-unsigned long long mem_region_get_capacity_online(struct mem_ctx *ctx, struct cxl_region *region)
-{
-	unsigned long long capacity; 
+	rv = 0;
+
+	goto end;
 
-	capacity = mem_system_get_blocksize(ctx) * mem_region_num_blocks_online(ctx, region);
+err:
 
-	return capacity;
+	mem_region_index_free(ctx);
+
+end:
+
+	return rv;
 }
 
 /**
@@ -1810,48 +6341,8 @@ end:
 int mem_region_num_blocks(struct mem_ctx *ctx, struct cxl_region *region)
 {
 	int num;
-	unsigned long long block_size, base, size, end, addr;
-  	struct mem_blk *blk;
-
-	num = 0;
-
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
-	{
-		num = -1;
-		err(ctx, "Unable to obtain system memory block size");
-		goto end;
-	}
-
-	// Get region base address 
-	base = cxl_region_get_resource(region);
-	if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
-	{
-		num = 0;
-		err(ctx, "Unable to get cxl region %s resource address\n", cxl_region_get_devname(region));
-		goto end;
-	}
-
-	// Get region size in bytes 
-	size = cxl_region_get_size(region);
-	if (size == 0)
-	{
-		num = 0;
-		warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
-		goto end;
-	}
-	end = base + size;
-
-	// Loop through the memory directories and check address
-	mem_blk_foreach(ctx, blk)
-	{
-		addr = block_size * blk->id;
-		if (addr >= base && addr < end)
-			num++;	
-	}
 
-end:
+	mem_region_get_span(ctx, region, &num);
 
 	return num;
 }
@@ -1862,50 +6353,12 @@ end:
  */
 int mem_region_num_blocks_offline(struct mem_ctx *ctx, struct cxl_region *region)
 {
-	int num;
-	unsigned long long block_size, base, size, end, addr;
-  	struct mem_blk *blk;
-
-	num = 0;
-
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
-	{
-		err(ctx, "Unable to read system memory block size");
-		goto end;
-	}
-
-	// Get region base address 
-	base = cxl_region_get_resource(region);
-	if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
-	{
-		num = 0;
-		err(ctx, "Unable to get cxl region %s resource address", cxl_region_get_devname(region));
-		goto end;
-	}
-
-	// Get region size in bytes 
-	size = cxl_region_get_size(region);
-	if (size == 0)
-	{
-		num = 0;
-		warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
-		goto end;
-	}
-	end = base + size;
-
-	// Loop through the memory directories and check address
-	mem_blk_foreach(ctx, blk)
-	{
-		addr = block_size * blk->id;			
-		if (addr >= base && addr < end && !mem_blk_is_online(blk))
-			num++;	
-	}
+	struct mem_stats stats;
 
-end:
+	if (mem_region_get_stats(ctx, region, &stats) != 0)
+		return 0;
 
-	return num;
+	return stats.offline;
 }
 
 /**
@@ -1914,107 +6367,109 @@ end:
  */
 int mem_region_num_blocks_online(struct mem_ctx *ctx, struct cxl_region *region)
 {
-	int num;
-	unsigned long long block_size, base, size, end, addr;
-  	struct mem_blk *blk;
-
-	num = 0;
-
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
-	{
-		err(ctx, "Unable to read system memory block size");
-		goto end;
-	}
-
-	// Get region base address 
-	base = cxl_region_get_resource(region);
-	if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
-	{
-		num = 0;
-		err(ctx, "Unable to get cxl region %s resource address", cxl_region_get_devname(region));
-		goto end;
-	}
-
-	// Get region size in bytes 
-	size = cxl_region_get_size(region);
-	if (size == 0)
-	{
-		num = 0;
-		warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
-		goto end;
-	}
-	end = base + size;
-
-	// Loop through the memory directories and check address
-	mem_blk_foreach(ctx, blk)
-	{
-		addr = block_size * blk->id;			
-		if (addr >= base && addr < end && mem_blk_is_online(blk))
-			num++;	
-	}
+	struct mem_stats stats;
 
-end:
+	if (mem_region_get_stats(ctx, region, &stats) != 0)
+		return 0;
 
-	return num;
+	return stats.online;
 }
 
 /**
  * Offline all blocks in a region
+ *
+ * Blocks that are busy migrating pages are retried for up to 
+ * LMLN_OFFLINE_TIMEOUT_MS by mem_region_offline_blocks_parallel()
  */
 int mem_region_offline_blocks(struct mem_ctx *ctx, struct cxl_region *region)
 {
-	int rv, ret;
-	struct mem_blk *blk;
-	unsigned long long block_size, base, size, end, addr;
+	return mem_region_offline_blocks_parallel(ctx, region, LMLN_OFFLINE_TIMEOUT_MS, 0, NULL, NULL);
+}
+
+/**
+ * Offline all blocks in a region with a pool of NUMA local worker threads
+ *
+ * Up to mem_set_offline_threads() blocks are offlined at once. The blocks 
+ * with the lowest migration cost from mem_blk_get_pages() go first. 
+ * Offlines that fail with EBUSY or EAGAIN are retried with exponential 
+ * backoff until timeout_ms has passed. Blocks not started by then fail 
+ * with -ETIMEDOUT. With LMSR_TRANSACTION a failure puts every block that 
+ * was offlined back online
+ * @param timeout_ms 	0 to try each block once. -1 to retry forever
+ * @param flags 		bitfield of LMSR masks
+ * @param results 		array of mem_region_num_blocks() results in block order. May be NULL
+ * @param stats 		set to the per block latency and overall throughput. May be NULL
+ * @return 0 upon success, the number of blocks that failed, or negative errno
+ */
+int mem_region_offline_blocks_parallel(struct mem_ctx *ctx, struct cxl_region *region, int timeout_ms, int flags, struct mem_blk_result *results, struct mem_op_stats *stats)
+{
+	int rv, i, num, scan;
+	struct mem_blk *blk, **blks;
+	struct mem_blk_cost *costs;
+	struct mem_blk_result *res, *sorted;
+	struct mem_blk_pages pages;
+	struct mem_kpf kpf;
 
 	// Initialize variables 
 	rv = 1;
+	scan = -1;
+	blks = NULL;
+	costs = NULL;
+	sorted = NULL;
 
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
+	if (stats != NULL)
+		memset(stats, 0, sizeof(*stats));
+
+	// Get the contiguous span of blocks in the region
+	blk = mem_region_get_span(ctx, region, &num);
+	if (blk == NULL)
 	{
-		rv = 1;
-		err(ctx, "Unable to obtain system memory block size");
+		if (cxl_region_get_size(region) == 0)
+		{
+			rv = 0;
+			warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
+		}
+		else 
+			err(ctx, "Unable to get block range of cxl region %s", cxl_region_get_devname(region));
 		goto end;
 	}
 
-	// Get region base address 
-	base = cxl_region_get_resource(region);
-	if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
+	blks = malloc(num * sizeof(*blks));
+	costs = malloc(num * sizeof(*costs));
+	sorted = calloc(num, sizeof(*sorted));
+	if (blks == NULL || costs == NULL || sorted == NULL)
 	{
-		rv = 1;
-		err(ctx, "Unable to get cxl region %s resource address\n", cxl_region_get_devname(region));
+		rv = -ENOMEM;
 		goto end;
 	}
 
-	// Get region size in bytes 
-	size = cxl_region_get_size(region);
-	if (size == 0)
+	// Order the blocks by migration cost. Without access to kpageflags the 
+	// blocks stay in id order
+	scan = mem_kpf_open(ctx, &kpf);
+
+	for ( i = 0 ; i < num ; i++ )
 	{
-		rv = 0;
-		warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
-		goto end;
+		costs[i].blk = &blk[i];
+		costs[i].pos = i;
+		costs[i].cost = 0;
+		if (scan == 0 && blk[i].online && mem_blk_scan(&blk[i], &kpf, &pages) == 0)
+			costs[i].cost = pages.cost;
 	}
-	end = base + size;
 
-	// Loop through the memory directories and check address
-	rv = 0;
-	mem_blk_foreach(ctx, blk)
-	{
-		addr = block_size * blk->id;
-		if (addr >= base && addr < end)
+	qsort(costs, num, sizeof(*costs), mem_compare_mem_blk_costs);
+
+	for ( i = 0 ; i < num ; i++ )
+		blks[i] = costs[i].blk;
+
+	rv = mem_op_run(ctx, blks, num, LMPL_OFFLINE, ctx->offline_threads, timeout_ms, flags, sorted, stats);
+
+	// Return the results in block order 
+	if (results != NULL && rv >= 0)
+		for ( i = 0 ; i < num ; i++ )
 		{
-			ret = mem_blk_offline(blk);	
-			if (ret != 0)
-			{
-				err(ctx, "Could not offline memory block %d. %d", blk->id, ret);
-				rv += 1;
-			}
+			res = &results[blks[i] - blk];
+			*res = sorted[i];
 		}
-	}
 
 	if (rv == 0)
 	{info(ctx, "Offlined all blocks of region %s", cxl_region_get_devname(region));}
@@ -2023,64 +6478,89 @@ int mem_region_offline_blocks(struct mem_ctx *ctx, struct cxl_region *region)
 
 end:
 
+	if (scan == 0)
+		mem_kpf_close(&kpf);
+	if (blks != NULL)
+		free(blks);
+	if (costs != NULL)
+		free(costs);
+	if (sorted != NULL)
+		free(sorted);
+
 	return rv;
 }
 
 /**
  * Online all blocks in a region
+ *
+ * The blocks are onlined to zone movable by mem_region_online_blocks_parallel()
+ * with the concurrency limit set by mem_set_online_threads()
  */
 int mem_region_online_blocks(struct mem_ctx *ctx, struct cxl_region *region)
 {
-	int rv, ret;
-	struct mem_blk *blk;
-	unsigned long long block_size, base, size, end, addr;
+	return mem_region_online_blocks_parallel(ctx, region, LMPL_MOVABLE, 0, 0, NULL, NULL);
+}
+
+/**
+ * Online all blocks in a region with a pool of NUMA local worker threads
+ *
+ * Each state write makes the kernel initialize the memmap of the block 
+ * synchronously. Up to mem_set_online_threads() blocks are onlined at once,
+ * each from a thread pinned to the CPUs of the node of the block, or of the
+ * nearest node with CPUs for a CPU-less node. With LMSR_TRANSACTION a 
+ * failure or a missed deadline takes every block that was onlined back 
+ * offline so the region is left as it was found
+ * @param state 		enum LMPL online state 
+ * @param timeout_ms 	0 to try each block once. Otherwise busy blocks are retried until timeout_ms has passed, or forever if -1
+ * @param flags 		bitfield of LMSR masks
+ * @param results 		array of mem_region_num_blocks() results in block order. May be NULL
+ * @param stats 		set to the per block latency and overall throughput. May be NULL
+ * @return 0 upon success, the number of blocks that failed, or negative errno
+ */
+int mem_region_online_blocks_parallel(struct mem_ctx *ctx, struct cxl_region *region, int state, int timeout_ms, int flags, struct mem_blk_result *results, struct mem_op_stats *stats)
+{
+	int rv, i, num;
+	struct mem_blk *blk, **blks;
 
 	// Initialize variables 
 	rv = 1;
+	blks = NULL;
 
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
+	// Validate inputs 
+	if (state <= LMPL_OFFLINE || state >= LMPL_MAX)
 	{
-		rv = 1;
-		err(ctx, "Unable to obtain system memory block size");
+		err(ctx, "Attempted to online region blocks to invalid state: %d", state);
+		rv = -EINVAL;
 		goto end;
 	}
 
-	// Get region base address 
-	base = cxl_region_get_resource(region);
-	if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
+	if (stats != NULL)
+		memset(stats, 0, sizeof(*stats));
+
+	// Get the contiguous span of blocks in the region
+	blk = mem_region_get_span(ctx, region, &num);
+	if (blk == NULL)
 	{
-		rv = 1;
-		err(ctx, "Unable to get cxl region %s resource address\n", cxl_region_get_devname(region));
+		if (cxl_region_get_size(region) == 0)
+		{
+			rv = 0;
+			warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
+		}
+		else 
+			err(ctx, "Unable to get block range of cxl region %s", cxl_region_get_devname(region));
 		goto end;
 	}
 
-	// Get region size in bytes 
-	size = cxl_region_get_size(region);
-	if (size == 0)
+	blks = malloc(num * sizeof(*blks));
+	if (blks == NULL)
 	{
-		rv = 0;
-		warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
+		rv = -ENOMEM;
 		goto end;
 	}
-	end = base + size;
+	for ( i = 0 ; i < num ; i++ )
+		blks[i] = &blk[i];
 
-	// Loop through the memory directories and check address
-	rv = 0;
-	mem_blk_foreach(ctx, blk)
-	{
-		addr = block_size * blk->id;
-		if (addr >= base && addr < end)
-		{
-			ret = mem_blk_online(blk);	
-			if (ret != 0)
-			{
-				err(ctx, "Could not online memory block %d. %d", blk->id, ret);
-				rv += 1;
-			}
-		}
-	}
+	rv = mem_op_run(ctx, blks, num, state, ctx->online_threads, timeout_ms, flags, results, stats);
 
 	if (rv == 0)
 	{info(ctx, "Onlined all blocks of region %s", cxl_region_get_devname(region));}
@@ -2089,6 +6569,9 @@ int mem_region_online_blocks(struct mem_ctx *ctx, struct cxl_region *region)
 
 end:
 
+	if (blks != NULL)
+		free(blks);
+
 	return rv;
 }
 
@@ -2157,76 +6640,254 @@ int mem_region_rammode(struct mem_ctx *ctx, struct cxl_region *region)
 
 end:
 
-	return rv;
+	return rv;
+}
+
+/**
+ * Set the online state of the memory block within a specified region 
+ */
+int mem_region_set_blk_state(struct mem_ctx *ctx, struct cxl_region *region, int offset, int mode)
+{
+	int rv;
+	struct mem_rgn *rgn;
+  	struct mem_blk *blk;
+
+	rv = -1;
+
+	if (offset < 0)
+	{
+		err(ctx, "Requested offset is below zero: %d", offset);
+		goto end;
+	}
+
+	rgn = mem_region_index_get(ctx, region);
+	if (rgn == NULL)
+	{
+		err(ctx, "Unable to get block range of cxl region %s", cxl_region_get_devname(region));
+		goto end;
+	}
+
+	// Verify offset block is within region
+	if (offset >= rgn->end - rgn->first)
+	{
+		err(ctx, "Could not get offset within region as it exceeds region range");
+		goto end;
+	}
+
+	blk = mem_blkid_get_blk(ctx, rgn->first + offset);
+	if (blk != NULL)
+		rv = mem_blk_set_state(blk, mode);
+
+end:
+
+	return rv;
+}
+
+/**
+ * Drop the cached region array and region interval index
+ *
+ * Called when regions are created or deleted. The next call to 
+ * mem_get_regions() or a block to region lookup rebuilds them
+ */
+static void mem_regions_invalidate(struct mem_ctx *ctx)
+{
+	mem_region_index_free(ctx);
+
+	// Pools point to regions 
+	ctx->lease_stale = 1;
+
+	if (ctx->regions != NULL)
+		free(ctx->regions);
+
+	ctx->regions = NULL;
+	ctx->num_regions = 0;
+}
+
+/**
+ * Wait for all memory blocks of a region to be present and online 
+ *
+ * Use after enabling a region in system-ram mode (e.g. daxctl_dev_enable_ram).
+ * Queued uevents are applied on each wake up so blocks that appear are 
+ * picked up. Without a running listener only the blocks of the region are 
+ * re-read on each poll interval. The memory directory is rescanned every 
+ * LMLN_WAIT_RECHECK_MS, or sooner once the first missing block of the region
+ * appears. Block pointers into the context are not valid after this returns
+ * @param timeout_ms -1 to wait forever. 0 to check once
+ * @return 0 upon success, -ETIMEDOUT on timeout, negative errno otherwise
+ */
+int mem_region_wait_online(struct mem_ctx *ctx, struct cxl_region *region, int timeout_ms)
+{
+	int rv, i, num, delay;
+	unsigned long seq;
+	char path[64];
+	struct mem_blk *span;
+	struct mem_rgn *rgn;
+	struct timespec until, rescan, now;
+
+	// Validate inputs 
+	if (ctx == NULL || region == NULL)
+		return -EINVAL;
+
+	delay = LMLN_WAIT_POLL_MIN_MS;
+	if (timeout_ms >= 0)
+		mem_events_deadline(&until, timeout_ms);
+
+	// Rescan the memory directory on the first pass 
+	memset(&rescan, 0, sizeof(rescan));
+
+	for (;;)
+	{
+		seq = mem_events_seq(ctx);
+
+		if (ctx->evfd >= 0)
+			mem_events_apply(ctx);
+		else 
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > rescan.tv_sec || (now.tv_sec == rescan.tv_sec && now.tv_nsec >= rescan.tv_nsec))
+			{
+				mem_refresh(ctx, LMRF_BLOCKS);
+				mem_events_deadline(&rescan, LMLN_WAIT_RECHECK_MS);
+			}
+		}
+
+		span = mem_region_get_span(ctx, region, &num);
+		rgn = mem_region_index_get(ctx, region);
+		if (rgn == NULL)
+			return -ENOENT;
+
+		// All blocks of the region must be present before they can be online
+		if (span != NULL && num == rgn->end - rgn->first)
+		{
+			for ( i = 0 ; i < num ; i++ )
+			{
+				if (ctx->evfd < 0)
+					mem_blk_refresh(&span[i]);
+				if (!span[i].online)
+					break;
+			}
+
+			if (i == num)
+				return 0;
+		}
+		else if (ctx->evfd < 0)
+		{
+			// Find the first missing block and rescan as soon as it appears
+			for ( i = 0 ; span != NULL && i < num && span[i].id == rgn->first + i ; i++ ) ;
+
+			sprintf(path, "memory%d", rgn->first + i);
+			if (faccessat(mem_memfd(ctx), path, F_OK, 0) == 0)
+				memset(&rescan, 0, sizeof(rescan));
+		}
+
+		rv = mem_events_wait(ctx, seq, (timeout_ms >= 0) ? &until : NULL, &delay);
+		if (rv != 0)
+			return rv;
+	}
+}
+
+/**
+ * Enable or disable batched io_uring reads during block enumeration 
+ *
+ * Disabled by default. sysfs opens are usually punted to io_uring worker 
+ * threads so measure before enabling. When io_uring is not available the 
+ * synchronous sysfs reads are used regardless of this setting 
+ * @param enable 0 to always use synchronous reads, 1 to use io_uring 
+ */
+void mem_set_io_uring(struct mem_ctx *ctx, int enable)
+{
+	ctx->io_uring = (enable != 0);
+}
+
+/**
+ * Set the number of blocks that are offlined at once by 
+ * mem_region_offline_blocks_parallel()
+ *
+ * @param threads number of worker threads. 1 offlines the blocks in order on the calling thread
+ * @return 0 upon success, -EINVAL if threads is out of range
+ */
+int mem_set_offline_threads(struct mem_ctx *ctx, int threads)
+{
+	if (threads < 1 || threads > LMLN_THREADS_MAX)
+		return -EINVAL;
+
+	ctx->offline_threads = threads;
+
+	return 0;
+}
+
+/**
+ * Set the number of blocks that are onlined at once by 
+ * mem_region_online_blocks_parallel()
+ *
+ * @param threads number of worker threads. 1 onlines the blocks in order on the calling thread
+ * @return 0 upon success, -EINVAL if threads is out of range
+ */
+int mem_set_online_threads(struct mem_ctx *ctx, int threads)
+{
+	if (threads < 1 || threads > LMLN_THREADS_MAX)
+		return -EINVAL;
+
+	ctx->online_threads = threads;
+
+	return 0;
 }
 
 /**
- * Set the online state of the memory block within a specified region 
+ * Set the number of worker threads used to enumerate memory blocks
+ *
+ * Takes effect the next time the blocks array is loaded
+ * @param threads number of threads. 1 loads the blocks on the calling thread
+ * @return 0 upon success, -EINVAL if threads is out of range
  */
-int mem_region_set_blk_state(struct mem_ctx *ctx, struct cxl_region *region, int offset, int mode)
+int mem_set_threads(struct mem_ctx *ctx, int threads)
 {
-	int rv;
-	unsigned long long block_size, base, size, end, addr;
-  	struct mem_blk *blk;
+	if (threads < 1 || threads > LMLN_THREADS_MAX)
+		return -EINVAL;
 
-	rv = -1;
+	ctx->threads = threads;
 
-	if (offset < 0)
-	{
-		err(ctx, "Requested offset is below zero: %d", offset);
-		goto end;
-	}
+	return 0;
+}
 
-	// Get memory block size in bytes 
-	block_size = mem_system_get_blocksize(ctx);
-	if (block_size == 0)
-	{
-		rv = -1;
-		err(ctx, "Unable to obtain system memory block size");
-		goto end;
-	}
+/**
+ * Accumulate statistics over an array of memory blocks in a single pass
+ */
+static void mem_stats_fill(struct mem_stats *stats, struct mem_blk *blk, int num, unsigned long long block_size)
+{
+	int i, j, state;
 
-	// Get region base address 
-	base = cxl_region_get_resource(region);
-	if (base == 0 || base == 0xFFFFFFFFFFFFFFFF)
-	{
-		rv = -1;
-		err(ctx, "Unable to get cxl region %s resource address\n", cxl_region_get_devname(region));
-		goto end;
-	}
+	stats->block_size = block_size;
 
-	// Get region size in bytes 
-	size = cxl_region_get_size(region);
-	if (size == 0)
+	for ( i = 0 ; i < num ; i++, blk++ )
 	{
-		rv = -1;
-		warn(ctx, "Region size was zero for region %s", cxl_region_get_devname(region));
-		goto end;
-	}
-	end = base + size;
-	addr = base + block_size * offset;
+		stats->blocks++;
 
-	// Verify offset block is within region
-	if (addr >= end)
-	{
-		err(ctx, "Could not get offset within region as it exceeds region range");
-		rv = -1;
-		goto end;
-	}
+		if (blk->online)
+			stats->online++;
+		else 
+			stats->offline++;
 
-	// Loop through the memory directories and check address
-	mem_blk_foreach(ctx, blk)
-	{
-		if (addr == (block_size * blk->id))
+		if (blk->state == LMST_GOING_OFFLINE)
+			stats->going_offline++;
+
+		for ( j = 0 ; j < LMZN_MAX ; j++ )
+			if (blk->valid_zones & (0x01 << j))
+				stats->zones[j]++;
+
+		if (blk->online)
 		{
-			rv = mem_blk_set_state(blk, mode);
-			goto end;	
+			state = mem_blk_get_state(blk);
+			if (state == LMPL_MOVABLE)
+				stats->movable++;
+			else if (state == LMPL_KERNEL || state == LMPL_ONLINE)
+				stats->kernel++;
 		}
 	}
 
-end:
-
-	return rv;
+	stats->capacity         = block_size * stats->blocks;
+	stats->capacity_online  = block_size * stats->online;
+	stats->capacity_offline = block_size * stats->offline;
 }
 
 /**
@@ -2234,25 +6895,42 @@ end:
  * @return the number of bytes read. negative errno if an error
  */
 static int mem_sysfs_read(struct mem_ctx *ctx, const char *path, char *buf)
+{
+	return mem_sysfs_readat(ctx, AT_FDCWD, path, buf, 1);
+}
+
+/**
+ * Read in a sysfs attribute relative to a directory fd
+ *
+ * Attributes that are read repeatedly use a descriptor from the fd cache.
+ * One-shot reads such as block enumeration open and close the file so 
+ * they neither fill the cache nor contend on its lock
+ * @param cache 	1 to read through the fd cache 
+ * @return the number of bytes read. negative errno if an error
+ */
+static int mem_sysfs_readat(struct mem_ctx *ctx, int dirfd, const char *path, char *buf, int cache)
 {
 	int n, fd;
 
-	fd = open(path, O_RDONLY|O_CLOEXEC);
-	if (fd < 0) 
+	if (cache)
 	{
-		n = -errno;
-		err(ctx, "Failed to open sysfs file: %s %d - %s", path, errno, strerror(errno) );
-		goto end;
+		n = fdcache_pread(ctx->fdc, dirfd, path, buf, LMLN_SYSFS_ATTR_SIZE);
+	}
+	else 
+	{
+		fd = openat(dirfd, path, O_RDONLY|O_CLOEXEC);
+		n = (fd < 0) ? -errno : pread(fd, buf, LMLN_SYSFS_ATTR_SIZE, 0);
+		if (fd >= 0 && n < 0)
+			n = -errno;
+		if (fd >= 0)
+			close(fd);
 	}
-
-	n = read(fd, buf, LMLN_SYSFS_ATTR_SIZE);
-	close(fd);
-
 	if (n < 0 || n >= LMLN_SYSFS_ATTR_SIZE) 
 	{
 		buf[0] = 0;
-		n = -errno;
-		err(ctx, "Failed to read sysfs file: %s %d - %s", path, errno, strerror(errno) );
+		err(ctx, "Failed to read sysfs file: %s %d", path, n);
+		if (n >= 0)
+			n = -EOVERFLOW;
 		goto end;
 	}
 
@@ -2267,24 +6945,31 @@ end:
 
 /**
  * Write a value to a sysfs atribute 
- * @return the number of bytes written, 0 or negative number of bytes written if an error
+ * @return the number of bytes written. negative errno, or negative number of bytes written if an error
  */
 static int mem_sysfs_write(struct mem_ctx *ctx, const char *path, const char *buf)
 {
-	int n, fd, len;
+	return mem_sysfs_writeat(ctx, AT_FDCWD, path, buf);
+}
 
-	fd = open(path, O_WRONLY|O_CLOEXEC);
-	if (fd < 0) 
-	{
-		n = -errno;
-		err(ctx, "Failed to open sysfs file: %s %d - %s", path, errno, strerror(errno) );
-		goto end;
-	}
+/**
+ * Write a value to a sysfs atribute relative to a directory fd
+ *
+ * The value is written with pwrite() on a descriptor from the fd cache 
+ * @return the number of bytes written. negative errno, or negative number of bytes written if an error
+ */
+static int mem_sysfs_writeat(struct mem_ctx *ctx, int dirfd, const char *path, const char *buf)
+{
+	int n, len;
 
 	len = strlen(buf) + 1;
 
-	n = write(fd, buf, len);
-	close(fd);
+	n = fdcache_pwrite(ctx->fdc, dirfd, path, buf, len);
+	if (n < 0)
+	{
+		err(ctx, "Failed to write sysfs file: %s %d - %s", path, -n, strerror(-n));
+		goto end;
+	}
 
 	if (n < len) 
 	{
@@ -2337,19 +7022,10 @@ int *mem_system_get_blocks(struct mem_ctx *ctx)
  */
 unsigned long long mem_system_get_blocksize(struct mem_ctx *ctx)
 {
-	int rv;
-	char path[LMLN_FILEPATH];
-	char buf[LMLN_SYSFS_ATTR_SIZE];
-
-	sprintf(path, "%s/%s", LMFP_MEM_DIR, "block_size_bytes");							
-	rv = mem_sysfs_read(ctx, path, buf);
-	if (rv <= 0)
-	{
-		err(ctx, "Unable to read system memory block size: %d\n", rv);
+	if (!ctx->sys.loaded && mem_system_init(ctx) != 0)
 		return 0;
-	}
 
-	return strtoul(buf, NULL, 16);
+	return ctx->sys.block_size;
 }
 
 /**
@@ -2357,11 +7033,12 @@ unsigned long long mem_system_get_blocksize(struct mem_ctx *ctx)
  */
 unsigned long long mem_system_get_capacity(struct mem_ctx *ctx)
 {
-	unsigned long long capacity; 
+	struct mem_stats stats;
 
-	capacity = mem_system_get_blocksize(ctx) * mem_system_num_blocks(ctx);
+	if (mem_system_get_stats(ctx, &stats) != 0)
+		return 0;
 
-	return capacity;
+	return stats.capacity;
 }
 
 /**
@@ -2369,11 +7046,12 @@ unsigned long long mem_system_get_capacity(struct mem_ctx *ctx)
  */
 unsigned long long mem_system_get_capacity_offline(struct mem_ctx *ctx)
 {
-	unsigned long long capacity; 
+	struct mem_stats stats;
 
-	capacity = mem_system_get_blocksize(ctx) * mem_system_num_blocks_offline(ctx);
+	if (mem_system_get_stats(ctx, &stats) != 0)
+		return 0;
 
-	return capacity;
+	return stats.capacity_offline;
 }
 
 /**
@@ -2381,13 +7059,66 @@ unsigned long long mem_system_get_capacity_offline(struct mem_ctx *ctx)
  */
 unsigned long long mem_system_get_capacity_online(struct mem_ctx *ctx)
 {
-	unsigned long long capacity; 
+	struct mem_stats stats;
 
-	capacity = mem_system_get_blocksize(ctx) * mem_system_num_blocks_online(ctx);
+	if (mem_system_get_stats(ctx, &stats) != 0)
+		return 0;
 
-	return capacity;
+	return stats.capacity_online;
 }
  
+/**
+ * Measure the idle memory of the online blocks of a NUMA node 
+ *
+ * See mem_blk_get_idle_range(). Like mem_region_get_idle() offline 
+ * capacity is not part of the total and is left to the caller
+ * @param node 			NUMA node. -1 for all nodes 
+ * @param interval_ms 	time the pages are left to be accessed 
+ * @param total 		set to the idle bytes of the online blocks
+ * @return 0 upon success, negative errno otherwise
+ */
+int mem_system_get_idle(struct mem_ctx *ctx, int node, int interval_ms, unsigned long long *total)
+{
+	int rv, i, num, *ids;
+	struct mem_blk *blk;
+	unsigned long long *idle;
+
+	// Validate inputs 
+	if (ctx == NULL || total == NULL || interval_ms < 0)
+		return -EINVAL;
+
+	if (mem_blk_get_first(ctx) == NULL)
+		return -ENODEV;
+
+	ids = malloc(ctx->num * sizeof(*ids));
+	idle = malloc(ctx->num * sizeof(*idle));
+	if (ids == NULL || idle == NULL)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
+
+	num = 0;
+	for ( blk = mem_blk_get_first(ctx) ; blk != NULL ; blk = mem_blk_get_next(blk) )
+		if (blk->online && (node < 0 || blk->node == node))
+			ids[num++] = blk->id;
+
+	rv = mem_idle_sample(ctx, ids, num, interval_ms, idle);
+
+	*total = 0;
+	for ( i = 0 ; i < num && rv >= 0 ; i++ )
+		*total += idle[i];
+
+end:
+
+	if (ids != NULL)
+		free(ids);
+	if (idle != NULL)
+		free(idle);
+
+	return rv;
+}
+
 /**
  * Get the current auto_online_policy 
  * 
@@ -2399,6 +7130,12 @@ int mem_system_get_policy(struct mem_ctx *ctx)
 	char path[LMLN_FILEPATH];
 	char buf[LMLN_SYSFS_ATTR_SIZE];
 
+	if (!mem_system_has_feature(ctx, LMFT_AUTO_ONLINE))
+	{
+		err(ctx, "System does not support an auto memory online policy");
+		return -1;
+	}
+
 	sprintf(path, "%s/%s", LMFP_MEM_DIR, "auto_online_blocks");							
 	rv = mem_sysfs_read(ctx, path, buf);
 	if (rv <= 0)
@@ -2410,21 +7147,137 @@ int mem_system_get_policy(struct mem_ctx *ctx)
 	return mem_to_lmpl(buf);
 }	
 
+/**
+ * Determine if the running kernel provides a memory hotplug feature
+ * @param feature int from enum LMFT
+ * @return 1 if present, 0 if not present or error
+ */
+int mem_system_has_feature(struct mem_ctx *ctx, int feature)
+{
+	if (feature < 0 || feature >= LMFT_MAX)
+		return 0;
+
+	if (!ctx->sys.loaded && mem_system_init(ctx) != 0)
+		return 0;
+
+	return (ctx->sys.features >> feature) & 0x01;
+}
+
+/**
+ * Get aggregate statistics of all memory blocks in the system
+ * @return 0 upon success, non-zero otherwise
+ */
+int mem_system_get_stats(struct mem_ctx *ctx, struct mem_stats *stats)
+{
+	unsigned long long block_size;
+
+	memset(stats, 0, sizeof(*stats));
+
+	block_size = mem_system_get_blocksize(ctx);
+	if (block_size == 0)
+	{
+		err(ctx, "Unable to obtain system memory block size");
+		return 1;
+	}
+
+	// Enumerate the memory blocks if not done already
+	if (ctx->blocks == NULL && mem_blk_get_first(ctx) == NULL)
+		return 0;
+
+	mem_stats_fill(stats, ctx->blocks, ctx->num, block_size);
+
+	return 0;
+}
+
+/**
+ * Load the immutable memory system facts into the context
+ * @return 0 upon success, non-zero otherwise
+ */
+static int mem_system_init(struct mem_ctx *ctx)
+{
+	int rv, index;
+	DIR *d;
+  	struct dirent *e; 
+	struct mem_sys *sys;
+	struct utsname uts;
+	char path[LMLN_FILEPATH];
+	char buf[LMLN_SYSFS_ATTR_SIZE];
+
+	// Initialize variables 
+	rv = 1;
+	sys = &ctx->sys;
+	memset(sys, 0, sizeof(*sys));
+	sys->memmap_on_memory = -1;
+
+	// Memory block size 
+	sprintf(path, "%s/%s", LMFP_MEM_DIR, "block_size_bytes");							
+	rv = mem_sysfs_read(ctx, path, buf);
+	if (rv <= 0)
+	{
+		err(ctx, "Unable to read system memory block size: %d\n", rv);
+		rv = 1;
+		goto end;
+	}
+	sys->block_size = strtoull(buf, NULL, 16);
+
+	// Kernel version 
+	if (uname(&uts) == 0)
+		sscanf(uts.release, "%d.%d", &sys->kernel_major, &sys->kernel_minor);
+
+	// Optional sysfs attributes 
+	sprintf(path, "%s/%s", LMFP_MEM_DIR, "auto_online_blocks");							
+	if (access(path, F_OK) == 0)
+		sys->features |= (0x01 << LMFT_AUTO_ONLINE);
+
+	sprintf(path, "%s/%s", LMFP_MEM_DIR, "probe");							
+	if (access(path, F_OK) == 0)
+		sys->features |= (0x01 << LMFT_PROBE);
+
+	if (access(LMFP_MEMMAP_ON_MEMORY, F_OK) == 0)
+	{
+		sys->features |= (0x01 << LMFT_MEMMAP_ON_MEMORY);
+		if (mem_sysfs_read(ctx, LMFP_MEMMAP_ON_MEMORY, buf) > 0)
+			sys->memmap_on_memory = (buf[0] == 'Y' || buf[0] == 'y' || buf[0] == '1' || !strcmp(buf, "force"));
+	}
+
+	// Check the first memory block found for the valid_zones attribute
+	d = opendir(LMFP_MEM_DIR);	
+	if (d != NULL)
+	{
+		for (e = readdir(d) ; e != NULL ; e = readdir(d))
+			if (e->d_type == DT_DIR && sscanf(e->d_name, "memory%d", &index) == 1)
+			{
+				sprintf(path, "%s/%s/%s", LMFP_MEM_DIR, e->d_name, "valid_zones");							
+				if (access(path, F_OK) == 0)
+					sys->features |= (0x01 << LMFT_VALID_ZONES);
+				break;
+			}
+		closedir(d);
+	}
+
+	sys->loaded = 1;
+
+	info(ctx, "Loaded system facts. Block size: 0x%llx Kernel: %d.%d Features: 0x%lx", 
+		sys->block_size, sys->kernel_major, sys->kernel_minor, sys->features);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
 /**
  * Get the number of memory blocks in the system
  * @return The number of blocks. 0 if error
  */
 int mem_system_num_blocks(struct mem_ctx *ctx)
 {
-  	struct mem_blk *blk;
-	int num;
-
-	num = 0;
-
-	mem_blk_foreach(ctx, blk)
-		num++;	
+	// Enumerate the memory blocks if not done already
+	if (ctx->blocks == NULL && mem_blk_get_first(ctx) == NULL)
+		return 0;
 
-	return num;
+	return ctx->num;
 }
 
 /**
@@ -2432,16 +7285,12 @@ int mem_system_num_blocks(struct mem_ctx *ctx)
  */
 int mem_system_num_blocks_offline(struct mem_ctx *ctx)
 {
-  	struct mem_blk *blk;
-	int num;
-
-	num = 0;
+	struct mem_stats stats;
 
-	mem_blk_foreach(ctx, blk)
-		if (!mem_blk_is_online(blk))
-			num++;	
+	if (mem_system_get_stats(ctx, &stats) != 0)
+		return 0;
 
-	return num;
+	return stats.offline;
 }
 
 /**
@@ -2449,16 +7298,131 @@ int mem_system_num_blocks_offline(struct mem_ctx *ctx)
  */
 int mem_system_num_blocks_online(struct mem_ctx *ctx)
 {
-  	struct mem_blk *blk; 
-	int num;
+	struct mem_stats stats;
+
+	if (mem_system_get_stats(ctx, &stats) != 0)
+		return 0;
+
+	return stats.online;
+}
+
+/**
+ * Online or offline just enough memory blocks of a NUMA node to reach a 
+ * capacity in a zone 
+ *
+ * The online capacity of the node in the zone is rounded up to a whole 
+ * number of blocks. Only the difference is changed: offline blocks that 
+ * can be onlined to the zone are onlined, or online removable blocks of 
+ * the zone are offlined, preferring contiguous runs of blocks. The state 
+ * changes run on the parallel NUMA local workers with the online and 
+ * offline concurrency limits
+ * @param node 		NUMA node 
+ * @param bytes 	target online capacity in bytes 
+ * @param zone 		enum LMZN. LMZN_MOVABLE onlines to zone movable, LMZN_NORMAL to online_kernel
+ * @param flags 	bitfield of LMSR masks. With LMSR_TRANSACTION nothing is changed if the target can not be reached
+ * @param capacity 	set to the online capacity of the node in the zone after the call. May be NULL
+ * @return 0 upon success, the number of blocks that failed, -ENOSPC if there
+ * were not enough blocks to reach the target, or negative errno
+ */
+int mem_system_set_online_capacity(struct mem_ctx *ctx, int node, unsigned long long bytes, int zone, int flags, unsigned long long *capacity)
+{
+	int rv, num, cur, target, need, online, state, picked;
+	unsigned long long block_size;
+	struct mem_blk *blk, **cands, **pick;
 
+	// Initialize variables 
+	rv = 0;
 	num = 0;
+	cur = 0;
+	cands = NULL;
+	pick = NULL;
+
+	// Validate inputs. Blocks can only be onlined to the normal or movable zone
+	if (ctx == NULL || node < 0 || (zone != LMZN_NORMAL && zone != LMZN_MOVABLE))
+		return -EINVAL;
+
+	block_size = mem_system_get_blocksize(ctx);
+	if (block_size == 0 || mem_blk_get_first(ctx) == NULL)
+	{
+		err(ctx, "Unable to obtain system memory blocks");
+		return -ENODEV;
+	}
+
+	cands = malloc(ctx->num * sizeof(*cands));
+	pick = malloc(ctx->num * sizeof(*pick));
+	if (cands == NULL || pick == NULL)
+	{
+		rv = -ENOMEM;
+		goto end;
+	}
 
+	// Count the blocks of the node that are online in the zone 
 	mem_blk_foreach(ctx, blk)
-		if (mem_blk_is_online(blk))
-			num++;	
+		if (blk->node == node && blk->online && (blk->valid_zones & (0x01 << zone)))
+			cur++;
 
-	return num;
+	target = (int) ((bytes + block_size - 1) / block_size);
+	if (target == cur)
+		goto end;
+
+	online = (target > cur);
+	need = online ? target - cur : cur - target;
+
+	// Offline blocks list the zones they can be onlined to in valid_zones
+	mem_blk_foreach(ctx, blk)
+	{
+		if (blk->node != node || !(blk->valid_zones & (0x01 << zone)))
+			continue;
+
+		if (online && !blk->online)
+			cands[num++] = blk;
+		else if (!online && blk->online && blk->removable)
+			cands[num++] = blk;
+	}
+
+	// Offline from the end of a run so what stays online stays contiguous
+	picked = mem_blk_pick_runs(cands, num, need, !online, pick);
+	if (picked < need && (flags & LMSR_TRANSACTION))
+	{
+		err(ctx, "Only %d of %d memory blocks of node %d can be changed", picked, need, node);
+		rv = -ENOSPC;
+		goto end;
+	}
+
+	if (!online)
+		state = LMPL_OFFLINE;
+	else if (zone == LMZN_MOVABLE)
+		state = LMPL_MOVABLE;
+	else 
+		state = LMPL_KERNEL;
+
+	info(ctx, "Changing %d memory blocks of node %d to %s to reach %llu bytes", picked, node, mem_lmpl(state), bytes);
+
+	if (online)
+		rv = mem_op_run(ctx, pick, picked, state, ctx->online_threads, 0, flags, NULL, NULL);
+	else 
+		rv = mem_op_run(ctx, pick, picked, state, ctx->offline_threads, LMLN_OFFLINE_TIMEOUT_MS, flags, NULL, NULL);
+
+	if (rv == 0 && picked < need)
+		rv = -ENOSPC;
+
+end:
+
+	if (capacity != NULL)
+	{
+		cur = 0;
+		mem_blk_foreach(ctx, blk)
+			if (blk->node == node && blk->online && (blk->valid_zones & (0x01 << zone)))
+				cur++;
+		*capacity = block_size * cur;
+	}
+
+	if (cands != NULL)
+		free(cands);
+	if (pick != NULL)
+		free(pick);
+
+	return rv;
 }
 
 /**
@@ -2544,8 +7508,30 @@ int mem_unref(struct mem_ctx *ctx)
 	if (ctx->refcount > 0)
 		return 0;
 
-	if (ctx->regions != NULL)
-		free(ctx->regions);
+	mem_events_stop(ctx);
+
+	mem_regions_invalidate(ctx);
+
+	if (ctx->blocks != NULL)
+		free(ctx->blocks);
+
+	if (ctx->index != NULL)
+		free(ctx->index);
+
+	mem_node_free(ctx);
+
+	mem_lease_close(ctx);
+
+	fdcache_free(ctx->fdc);
+
+	if (ctx->evnotify >= 0)
+		close(ctx->evnotify);
+
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+
+	if (ctx->memfd >= 0)
+		close(ctx->memfd);
 
 	if (ctx->cxl)
 		cxl_unref(ctx->cxl);
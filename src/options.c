@@ -81,6 +81,7 @@ static int pr_show_block	(int key, char *arg, struct argp_state *state);
 static int pr_show_capacity (int key, char *arg, struct argp_state *state);
 static int pr_show_device   (int key, char *arg, struct argp_state *state);
 static int pr_show_num      (int key, char *arg, struct argp_state *state);
+static int pr_show_occupancy(int key, char *arg, struct argp_state *state);
 static int pr_show_region   (int key, char *arg, struct argp_state *state);
 static int pr_show_system   (int key, char *arg, struct argp_state *state);
 
@@ -119,7 +120,8 @@ char *CLOP[] = {
 	"MOVABLE",
 	"BLOCKS",
 	"DEVICES",
-	"REGIONS"
+	"REGIONS",
+	"NODE"
 };
 
 
@@ -176,6 +178,7 @@ Subcommands: \n\
   capacity                    Show memory capacity \n\
   device                      List of memory devices \n\
   num                         Count of items \n\
+  occupancy                   Used and free pages of memory blocks \n\
   region                      List of memory regions \n\
   system                      Memory System values \n\
 ";
@@ -226,6 +229,15 @@ Filters. These filter the data to include only the desired qualifier: \n\
   <region>                    Show number of blocks that are part of a region \n\
 ";
 
+const char *ho_show_occupancy = "\n\
+Usage: mem show occupancy [<options>] \n\n\
+Prints runs of consecutive blocks with the same node, state and used \n\
+fraction in tenths, read from /proc/kpageflags. Requires root. \n\n\
+Filters. These filter the data to include only the desired qualifier: \n\
+  <region>                    Show blocks of a region \n\
+  -N <node>                   Show blocks of a NUMA node \n\
+";
+
 const char *ho_show_region = "\n\
 Usage: mem show region [subcommand <options>] \n\n\
 Filters. These filter the data to include only the desired qualifier: \n\
@@ -586,6 +598,26 @@ struct argp_option ao_show_num[] =
 	{0,0,0,0,0,0} // Final option should be all null
 };
 
+/**
+ *  CLAP_SHOW_OCCUPANCY - mem show occupancy
+ */
+struct argp_option ao_show_occupancy[] =						
+{
+	{0,                              0, 	0, 		OPTION_HIDDEN, 	"Command options", 						1}, 
+
+	{0,                              0, 	0, 		0,             	"Filters", 								3},	
+  	{"region",                     'r', 	"STR", 	0,             	"Region name (e.g. region0)", 			0},	
+  	{"node",                       'N', 	"INT", 	0,             	"NUMA node id (e.g. 1)", 				0},	
+
+	{0,                              0, 	0,		0, 				"Help options", 						9},
+  	{"help",                       'h',  	NULL, 	0, 				"Display Help", 						0},
+  	{"usage",                      701,  	NULL, 	0, 				"Display Usage", 						0},	
+  	{"version",                    702,  	NULL, 	0, 				"Display Version", 						0},
+  	{"print-options",              706,  	NULL, 	OPTION_HIDDEN,	"Print options array", 					0},
+
+	{0,0,0,0,0,0} // Final option should be all null
+};
+
 /**
  *  CLAP_SHOW_REGION - Options for mem show region 
  */
@@ -669,6 +701,7 @@ struct argp ap_show_block 		= {ao_show_block        , pr_show_block			, 0, 0, 0,
 struct argp ap_show_capacity  	= {ao_show_capacity     , pr_show_capacity 		, 0, 0, 0, 0, 0};
 struct argp ap_show_device		= {ao_show_device       , pr_show_device		, 0, 0, 0, 0, 0};
 struct argp ap_show_num   		= {ao_show_num          , pr_show_num   		, 0, 0, 0, 0, 0};
+struct argp ap_show_occupancy	= {ao_show_occupancy    , pr_show_occupancy		, 0, 0, 0, 0, 0};
 struct argp ap_show_region		= {ao_show_region       , pr_show_region		, 0, 0, 0, 0, 0};
 struct argp ap_show_system		= {ao_show_system       , pr_show_system		, 0, 0, 0, 0, 0};
 
@@ -1133,6 +1166,12 @@ static void print_help(int option)
 			printf("\n");
 			break;
 
+		case CLAP_SHOW_OCCUPANCY:
+			printf("%s", ho_show_occupancy);
+			print_options(ao_show_occupancy);
+			printf("\n");
+			break;
+
 		case CLAP_SHOW_REGION:
 			printf("%s", ho_show_region);
 			print_options(ao_show_region);
@@ -1261,6 +1300,13 @@ static int pr_common(int key, char *arg, struct argp_state *state, int type, str
 			o->set = 1;
 			break;
 
+		// node
+		case 'N': 
+			o = &opts[CLOP_NODE];
+			o->set = 1;
+			o->val = strtoul(arg, NULL, 0);
+			break;
+
 		// offline
 		case 'o': 
 			o = &opts[CLOP_OFFLINE];
@@ -1827,6 +1873,9 @@ static int pr_show(int key, char *arg, struct argp_state *state)
 			else if (!strcmp(arg, "num") ) 
 				rv = argp_parse(&ap_show_num, state->argc-state->next+1, &state->argv[state->next-1], ARGP_IN_ORDER | ARGP_NO_HELP, 0, opts);
 
+			else if (!strcmp(arg, "occupancy") || !strcmp(arg, "occ") ) 
+				rv = argp_parse(&ap_show_occupancy, state->argc-state->next+1, &state->argv[state->next-1], ARGP_IN_ORDER | ARGP_NO_HELP, 0, opts);
+
 			else if (!strcmp(arg, "region") || !strcmp(arg, "rgn") || !strcmp(arg, "regions") ) 
 				rv = argp_parse(&ap_show_region, state->argc-state->next+1, &state->argv[state->next-1], ARGP_IN_ORDER | ARGP_NO_HELP, 0, opts);
 
@@ -2209,6 +2258,46 @@ static int pr_show_num(int key, char *arg, struct argp_state *state)
 	return rv;	
 }
 
+/**
+ * Parse function for: mem show occupancy
+ *
+ * @return 0 success, non-zero to indicate a problem 
+ */
+static int pr_show_occupancy(int key, char *arg, struct argp_state *state)
+{
+	struct opt *opts = (struct opt*) state->input;
+	int index, rv = pr_common(key, arg, state, CLAP_SHOW_OCCUPANCY, ao_show_occupancy);
+
+	opts[CLOP_CMD].set = 1;
+	opts[CLOP_CMD].val = CLCM_SHOW_OCCUPANCY;
+
+	switch (key)
+	{
+		case ARGP_KEY_ARG: 				
+
+			if (sscanf(arg, "region%d", &index) ) 
+			{
+				opts[CLOP_REGION].set = 1;
+				opts[CLOP_REGION].str = strdup(arg);
+			}
+			else 
+				argp_error (state, "Invalid subcommand"); 
+
+			break;
+
+		case ARGP_KEY_END:				
+
+			if (opts[CLOP_PRNT_OPTS].set)
+			{
+				print_options_array(opts);
+				opts[CLOP_PRNT_OPTS].set = 0;
+			}
+
+			break;
+	} 
+	return rv;	
+}
+
 /**
  * Parse function for: mem show region
  *
@@ -0,0 +1,495 @@
+/**
+ * @file 		uring.c
+ *
+ * @brief 		Code file for io_uring batched file reads
+ *
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date        Jul 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *
+ * The ring is driven with the raw system calls so there is no dependency on
+ * liburing. If the kernel headers or the kernel do not support io_uring,
+ * uring_new() fails and the caller is expected to use synchronous reads.
+ */
+
+/* INCLUDES ==================================================================*/
+
+/* calloc()
+ * free()
+ * malloc()
+ */
+#include <stdlib.h>
+
+/* memset()
+ */
+#include <string.h>
+
+/* close()
+ * syscall()
+ */
+#include <unistd.h>
+
+/* errno
+ */
+#include <errno.h>
+
+/* INT_MIN
+ */
+#include <limits.h>
+
+/* O_RDONLY
+ * O_DIRECTORY
+ * AT_FDCWD
+ */
+#include <fcntl.h>
+
+/* mmap()
+ * munmap()
+ */
+#include <sys/mman.h>
+
+/* SYS_io_uring_setup
+ * SYS_io_uring_enter
+ * SYS_io_uring_register
+ */
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>) && defined(SYS_io_uring_setup)
+#    define URING_SUPPORTED 1
+#    include <linux/io_uring.h>
+#  endif
+#endif
+
+#include "uring.h"
+
+/* MACROS ====================================================================*/
+
+#define URING_OPS_PER_READ 		3     // openat + read + close
+
+/* ENUMERATIONS ==============================================================*/
+
+/* STRUCTS ===================================================================*/
+
+#ifdef URING_SUPPORTED
+
+/**
+ * Submission and completion ring state mapped from the kernel
+ */
+struct uring
+{
+	int fd;
+	unsigned chains;         // Reads that can be in flight. One file slot each
+
+	void *sq_ptr;
+	size_t sq_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	void *cq_ptr;
+	size_t cq_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/* PROTOTYPES ================================================================*/
+
+static int uring_enter(struct uring *ur, unsigned submit, unsigned wait);
+static struct io_uring_sqe *uring_get_sqe(struct uring *ur);
+static void uring_prep_chain(struct uring *ur, struct uring_read *req, unsigned slot, unsigned long long data);
+static int uring_probe(struct uring *ur);
+static int uring_run(struct uring *ur, struct uring_read *reqs, int num);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Submit queued entries and wait for completions
+ * @return number of entries submitted. negative errno if an error
+ */
+static int uring_enter(struct uring *ur, unsigned submit, unsigned wait)
+{
+	int rv;
+
+	do
+	{
+		rv = syscall(SYS_io_uring_enter, ur->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	}
+	while (rv < 0 && errno == EINTR);
+
+	if (rv < 0)
+		return -errno;
+
+	return rv;
+}
+
+/**
+ * Free a ring and unmap its queues
+ */
+void uring_free(struct uring *ur)
+{
+	if (ur == NULL)
+		return;
+
+	if (ur->sqes != NULL && ur->sqes != MAP_FAILED)
+		munmap(ur->sqes, ur->sqes_len);
+
+	if (ur->cq_ptr != NULL && ur->cq_ptr != MAP_FAILED && ur->cq_ptr != ur->sq_ptr)
+		munmap(ur->cq_ptr, ur->cq_len);
+
+	if (ur->sq_ptr != NULL && ur->sq_ptr != MAP_FAILED)
+		munmap(ur->sq_ptr, ur->sq_len);
+
+	if (ur->fd >= 0)
+		close(ur->fd);
+
+	free(ur);
+}
+
+/**
+ * Get the next free submission queue entry
+ *
+ * The caller never queues more than the ring size between submissions so
+ * this cannot run out of entries
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ur)
+{
+	unsigned tail, index;
+	struct io_uring_sqe *sqe;
+
+	tail = *ur->sq_tail;
+	index = tail & *ur->sq_mask;
+
+	sqe = &ur->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	ur->sq_array[index] = index;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+/**
+ * Create a ring with a sparse table of direct file slots
+ * @param entries 	size of the submission queue
+ * @return 0 upon success. negative errno if io_uring is not usable
+ */
+int uring_new(struct uring **ur, unsigned entries)
+{
+	int rv, *fds;
+	unsigned i;
+	struct uring *r;
+	struct io_uring_params p;
+
+	// Initialize variables
+	rv = -ENOMEM;
+	fds = NULL;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		goto end;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+	{
+		rv = -errno;
+		goto end;
+	}
+
+	// Map the submission queue ring, completion queue ring and the sqes
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+	{
+		rv = -errno;
+		goto end;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else
+	{
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED)
+		{
+			rv = -errno;
+			goto end;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+	{
+		rv = -errno;
+		goto end;
+	}
+
+	r->sq_head  = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+	r->sq_tail  = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+	r->sq_mask  = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+	r->cq_head  = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+	r->cq_tail  = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+	r->cq_mask  = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+
+	// Register one sparse direct file slot per chain that can be in flight
+	r->chains = p.sq_entries / URING_OPS_PER_READ;
+	if (r->chains == 0)
+	{
+		rv = -EINVAL;
+		goto end;
+	}
+
+	fds = malloc(r->chains * sizeof(int));
+	if (fds == NULL)
+		goto end;
+
+	for ( i = 0 ; i < r->chains ; i++ )
+		fds[i] = -1;
+
+	if (syscall(SYS_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, r->chains) < 0)
+	{
+		rv = -errno;
+		goto end;
+	}
+
+	// Make sure the kernel can open into a direct slot
+	rv = uring_probe(r);
+	if (rv != 0)
+		goto end;
+
+	*ur = r;
+	r = NULL;
+
+	rv = 0;
+
+end:
+
+	if (fds != NULL)
+		free(fds);
+
+	if (r != NULL)
+		uring_free(r);
+
+	return rv;
+}
+
+/**
+ * Queue a linked openat+read+close chain for one read request
+ *
+ * The links are hard links so the close still runs after a short read,
+ * which io_uring otherwise treats as a failure that cancels the chain
+ */
+static void uring_prep_chain(struct uring *ur, struct uring_read *req, unsigned slot, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	// Open directly into the file slot. O_CLOEXEC is invalid for direct fds
+	sqe = uring_get_sqe(ur);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = req->dirfd;
+	sqe->addr = (unsigned long) req->path;
+	sqe->open_flags = O_RDONLY;
+	sqe->file_index = slot + 1;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe->user_data = data * URING_OPS_PER_READ + 0;
+
+	sqe = uring_get_sqe(ur);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot;
+	sqe->addr = (unsigned long) req->buf;
+	sqe->len = req->len;
+	sqe->off = 0;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe->user_data = data * URING_OPS_PER_READ + 1;
+
+	sqe = uring_get_sqe(ur);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = slot + 1;
+	sqe->user_data = data * URING_OPS_PER_READ + 2;
+}
+
+/**
+ * Check that opening into a direct file slot works on this kernel
+ *
+ * Kernels without direct descriptors reject a non zero file_index
+ */
+static int uring_probe(struct uring *ur)
+{
+	int rv;
+	unsigned head;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	sqe = uring_get_sqe(ur);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long) "/";
+	sqe->open_flags = O_RDONLY|O_DIRECTORY;
+	sqe->file_index = 1;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe->user_data = 0;
+
+	sqe = uring_get_sqe(ur);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = 1;
+	sqe->user_data = 1;
+
+	rv = uring_enter(ur, 2, 2);
+	if (rv < 0)
+		return rv;
+
+	rv = 0;
+	head = *ur->cq_head;
+	while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		cqe = &ur->cqes[head & *ur->cq_mask];
+		if (cqe->res < 0)
+			rv = cqe->res;
+		head++;
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	return rv;
+}
+
+/**
+ * Read a batch of files
+ *
+ * Requests are submitted in rounds of as many chains as there are direct
+ * file slots. Each round is one io_uring_enter call
+ * @return 0 upon success, negative errno if the ring failed. Per file
+ * results are returned in reqs[].res
+ */
+int uring_read_batch(struct uring *ur, struct uring_read *reqs, int num)
+{
+	int rv, i, n;
+
+	for ( i = 0 ; i < num ; i += n )
+	{
+		n = num - i;
+		if ((unsigned) n > ur->chains)
+			n = ur->chains;
+
+		rv = uring_run(ur, &reqs[i], n);
+		if (rv != 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+/**
+ * Submit one round of read chains and collect all of their completions
+ */
+static int uring_run(struct uring *ur, struct uring_read *reqs, int num)
+{
+	int rv, i, k, op;
+	unsigned head, total, seen, submitted;
+	struct io_uring_cqe *cqe;
+
+	for ( i = 0 ; i < num ; i++ )
+	{
+		reqs[i].res = INT_MIN;
+		uring_prep_chain(ur, &reqs[i], i, i);
+	}
+
+	total = num * URING_OPS_PER_READ;
+	seen = 0;
+
+	// The kernel may take fewer entries than queued. Submit the rest until
+	// it takes none
+	submitted = 0;
+	do
+	{
+		rv = uring_enter(ur, total - submitted, 0);
+		if (rv > 0)
+			submitted += rv;
+	}
+	while (rv > 0 && submitted < total);
+
+	// Entries left in the queue are dropped and their reads fail so the 
+	// caller reads those files synchronously
+	if (submitted < total)
+	{
+		__atomic_store_n(ur->sq_tail, __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+		for ( i = submitted / URING_OPS_PER_READ ; i < num ; i++ )
+			reqs[i].res = -EAGAIN;
+
+		if (submitted == 0)
+			return (rv < 0) ? rv : -EAGAIN;
+	}
+
+	while (seen < submitted)
+	{
+		head = *ur->cq_head;
+		while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe = &ur->cqes[head & *ur->cq_mask];
+			k = cqe->user_data / URING_OPS_PER_READ;
+			op = cqe->user_data % URING_OPS_PER_READ;
+
+			// A failed open is the error to report, otherwise the read result
+			if (op == 0 && cqe->res < 0)
+				reqs[k].res = cqe->res;
+			else if (op == 1 && reqs[k].res == INT_MIN)
+				reqs[k].res = cqe->res;
+
+			head++;
+			seen++;
+		}
+		__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+		if (seen < submitted)
+		{
+			rv = uring_enter(ur, 0, 1);
+			if (rv < 0)
+				return rv;
+		}
+	}
+
+	return 0;
+}
+
+#else
+
+/* FUNCTIONS =================================================================*/
+
+void uring_free(struct uring *ur)
+{
+	(void) ur;
+}
+
+int uring_new(struct uring **ur, unsigned entries)
+{
+	(void) ur;
+	(void) entries;
+	return -ENOSYS;
+}
+
+int uring_read_batch(struct uring *ur, struct uring_read *reqs, int num)
+{
+	(void) ur;
+	(void) reqs;
+	(void) num;
+	return -ENOSYS;
+}
+
+#endif // URING_SUPPORTED